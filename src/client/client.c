@@ -8,6 +8,15 @@
 #include "encrypt.h"
 #include "tunnel.h"
 #include "obfsutil.h"
+#include "dest_table.h"
+#include "stripe.h"
+
+#if defined(__linux__)
+#include <linux/netfilter_ipv4.h>  /* SO_ORIGINAL_DST */
+#ifndef IP6T_SO_ORIGINAL_DST
+#define IP6T_SO_ORIGINAL_DST 80
+#endif
+#endif // defined(__linux__)
 
 /* A connection is modeled as an abstraction on top of two simple state
  * machines, one for reading and one for writing.  Either state machine
@@ -55,6 +64,7 @@ enum session_state {
     session_ssr_receipt_of_feedback_sent,
     session_auth_complition_done,      /* Connected. Start piping data. */
     session_streaming,            /* Connected. Pipe data back and forth. */
+    session_stripe_streaming,     /* Connected. Data goes in chunks over several upstream connections. */
     session_kill,             /* Tear down session. */
 };
 
@@ -64,6 +74,19 @@ struct client_ctx {
     struct buffer_t *init_pkg;
     s5_ctx *parser;  /* The SOCKS protocol parser. */
     enum session_state state;
+    bool transparent;  /* Redirected connection, no SOCKS5 handshake with the client. */
+    struct stripe_session *stripe;  /* Shared by the subflows of a striped tunnel. */
+    size_t stripe_index;  /* 0 is the tunnel with the SOCKS client, the others only dial out. */
+    struct buffer_t *stripe_pkg;  /* Sent upstream in place of |init_pkg|. */
+};
+
+/* What a subflow tunnel is set up from, see stripe_subflow_init_done_cb(). */
+struct stripe_spawn {
+    struct server_env_t *env;
+    struct stripe_session *session;
+    const uint8_t *id;
+    const uint8_t *token;
+    size_t index;
 };
 
 static struct buffer_t * initial_package_create(const s5_ctx *parser);
@@ -72,6 +95,11 @@ static void do_handshake(struct tunnel_ctx *tunnel);
 static void do_handshake_auth(struct tunnel_ctx *tunnel);
 static void do_wait_s5_request(struct tunnel_ctx *tunnel);
 static void do_parse_s5_request(struct tunnel_ctx *tunnel);
+static void do_prepare_ssr_connection(struct tunnel_ctx *tunnel);
+static void do_prepare_stripe(struct tunnel_ctx *tunnel);
+static void do_start_ssr_connection(struct tunnel_ctx *tunnel, size_t head_len);
+static void do_reply_failure(struct tunnel_ctx *tunnel, const char *reply);
+static bool get_original_destination(struct tunnel_ctx *tunnel, s5_ctx *parser);
 static void do_resolve_ssr_server_host(struct tunnel_ctx *tunnel);
 static void do_connect_ssr_server(struct tunnel_ctx *tunnel);
 static void do_connect_ssr_server_done(struct tunnel_ctx *tunnel);
@@ -79,6 +107,8 @@ static void do_ssr_auth_sent(struct tunnel_ctx *tunnel);
 static bool do_ssr_receipt_for_feedback(struct tunnel_ctx *tunnel);
 static void do_socks5_reply_success(struct tunnel_ctx *tunnel);
 static void do_launch_streaming(struct tunnel_ctx *tunnel);
+static void do_launch_stripe_streaming(struct tunnel_ctx *tunnel);
+static void do_stripe_streaming(struct tunnel_ctx *tunnel, struct socket_ctx *socket);
 static uint8_t* tunnel_extract_data(struct socket_ctx *socket, void*(*allocator)(size_t size), size_t *size);
 static void tunnel_dying(struct tunnel_ctx *tunnel);
 static void tunnel_timeout_expire_done(struct tunnel_ctx *tunnel, struct socket_ctx *socket);
@@ -86,11 +116,22 @@ static void tunnel_outgoing_connected_done(struct tunnel_ctx *tunnel, struct soc
 static void tunnel_read_done(struct tunnel_ctx *tunnel, struct socket_ctx *socket);
 static void tunnel_getaddrinfo_done(struct tunnel_ctx *tunnel, struct socket_ctx *socket);
 static void tunnel_write_done(struct tunnel_ctx *tunnel, struct socket_ctx *socket);
+static void tunnel_stripe_read_eof(struct tunnel_ctx *tunnel, struct socket_ctx *socket);
 static size_t tunnel_get_alloc_size(struct tunnel_ctx *tunnel, struct socket_ctx *socket, size_t suggested_size);
+static size_t tunnel_get_recv_need(struct tunnel_ctx *tunnel, struct socket_ctx *socket);
 static bool tunnel_is_in_streaming(struct tunnel_ctx *tunnel);
 static bool can_auth_none(const uv_tcp_t *lx, const struct tunnel_ctx *cx);
 static bool can_auth_passwd(const uv_tcp_t *lx, const struct tunnel_ctx *cx);
 static bool can_access(const uv_tcp_t *lx, const struct tunnel_ctx *cx, const struct sockaddr *addr);
+static struct socket_ctx * stripe_client_wire(struct tunnel_ctx *subflow);
+static bool stripe_client_seal(struct tunnel_ctx *subflow, struct buffer_t *buf);
+static void stripe_client_deliver(struct stripe_session *session, const uint8_t *data, size_t len);
+
+static const struct stripe_ops client_stripe_ops = {
+    &stripe_client_wire,
+    &stripe_client_seal,
+    &stripe_client_deliver,
+};
 
 static bool init_done_cb(struct tunnel_ctx *tunnel, void *p) {
     struct server_env_t *env = (struct server_env_t *)p;
@@ -106,6 +147,7 @@ static bool init_done_cb(struct tunnel_ctx *tunnel, void *p) {
     tunnel->tunnel_getaddrinfo_done = &tunnel_getaddrinfo_done;
     tunnel->tunnel_write_done = &tunnel_write_done;
     tunnel->tunnel_get_alloc_size = &tunnel_get_alloc_size;
+    tunnel->tunnel_get_recv_need = &tunnel_get_recv_need;
     tunnel->tunnel_is_in_streaming = &tunnel_is_in_streaming;
     tunnel->tunnel_extract_data = &tunnel_extract_data;
 
@@ -120,12 +162,83 @@ static bool init_done_cb(struct tunnel_ctx *tunnel, void *p) {
 }
 
 void client_tunnel_initialize(uv_tcp_t *lx, unsigned int idle_timeout) {
-    uv_loop_t *loop = lx->loop;
-    struct server_env_t *env = (struct server_env_t *)loop->data;
+    struct server_env_t *env = (struct server_env_t *)lx->data;
 
     tunnel_initialize(lx, idle_timeout, &init_done_cb, env);
 }
 
+/*
+ * Connections redirected to us by the kernel (iptables REDIRECT) carry their
+ * real destination on the socket, so the SOCKS5 exchange is skipped and the
+ * SSR connection starts right away.
+ */
+static bool transparent_init_done_cb(struct tunnel_ctx *tunnel, void *p) {
+    struct client_ctx *ctx;
+
+    init_done_cb(tunnel, p);
+    ctx = (struct client_ctx *) tunnel->data;
+    ctx->transparent = true;
+
+    if (get_original_destination(tunnel, ctx->parser) == false) {
+        pr_warn("transparent connection without an original destination");
+        return false;
+    }
+    ctx->parser->cmd = s5_cmd_tcp_connect;
+    tunnel->connect_on_accept = true;
+
+    do_prepare_ssr_connection(tunnel);
+    return true;
+}
+
+void client_transparent_tunnel_initialize(uv_tcp_t *lx, unsigned int idle_timeout) {
+    struct server_env_t *env = (struct server_env_t *)lx->data;
+
+    tunnel_initialize(lx, idle_timeout, &transparent_init_done_cb, env);
+}
+
+/* An extra upstream connection of a striped tunnel, it has no SOCKS client of its own. */
+static bool stripe_subflow_init_done_cb(struct tunnel_ctx *tunnel, void *p) {
+    const struct stripe_spawn *spawn = (const struct stripe_spawn *)p;
+    struct client_ctx *ctx;
+
+    init_done_cb(tunnel, spawn->env);
+    ctx = (struct client_ctx *) tunnel->data;
+    ctx->stripe_index = spawn->index;
+
+    if (stripe_session_attach(spawn->session, spawn->index, tunnel) == false) {
+        return false;
+    }
+    ctx->stripe = spawn->session;
+    ctx->stripe_pkg = stripe_header_create(spawn->id, spawn->token, spawn->index, stripe_session_count(spawn->session));
+
+    do_start_ssr_connection(tunnel, ctx->stripe_pkg->len);
+    return true;
+}
+
+static bool get_original_destination(struct tunnel_ctx *tunnel, s5_ctx *parser) {
+#if defined(__linux__)
+    int fd = uv_stream_fd(&tunnel->incoming->handle.tcp);
+    union sockaddr_universal addr = { 0 };
+    socklen_t len = sizeof(addr);
+
+    if (getsockopt(fd, SOL_IP, SO_ORIGINAL_DST, &addr, &len) == 0 && addr.addr.sa_family == AF_INET) {
+        parser->atyp = s5_atyp_ipv4;
+        memcpy(parser->daddr, &addr.addr4.sin_addr, sizeof(addr.addr4.sin_addr));
+        parser->dport = ntohs(addr.addr4.sin_port);
+        return true;
+    }
+    len = sizeof(addr);
+    if (getsockopt(fd, SOL_IPV6, IP6T_SO_ORIGINAL_DST, &addr, &len) == 0 && addr.addr.sa_family == AF_INET6) {
+        parser->atyp = s5_atyp_ipv6;
+        memcpy(parser->daddr, &addr.addr6.sin6_addr, sizeof(addr.addr6.sin6_addr));
+        parser->dport = ntohs(addr.addr6.sin6_port);
+        return true;
+    }
+#endif // defined(__linux__)
+    (void)tunnel; (void)parser;
+    return false;
+}
+
 static void _do_shutdown_tunnel(void *obj, void *p) {
     tunnel_shutdown((struct tunnel_ctx *)obj);
     (void)p;
@@ -236,6 +349,9 @@ static void do_next(struct tunnel_ctx *tunnel, struct socket_ctx *socket) {
     case session_streaming:
         tunnel_traditional_streaming(tunnel, socket);
         break;
+    case session_stripe_streaming:
+        do_stripe_streaming(tunnel, socket);
+        break;
     case session_kill:
         tunnel_shutdown(tunnel);
         break;
@@ -393,7 +509,75 @@ static void do_parse_s5_request(struct tunnel_ctx *tunnel) {
 
     ASSERT(parser->cmd == s5_cmd_tcp_connect);
 
+    do_prepare_ssr_connection(tunnel);
+}
+
+static void do_prepare_ssr_connection(struct tunnel_ctx *tunnel) {
+    struct client_ctx *ctx = (struct client_ctx *) tunnel->data;
+    s5_ctx *parser = ctx->parser;
+    struct server_env_t *env;
+    const struct dest_entry *entry;
+    size_t head_len;
+
     ctx->init_pkg = initial_package_create(parser);
+    entry = dest_table_intern(ssr_client_destinations(ctx->env), ctx->init_pkg->buffer, ctx->init_pkg->len);
+    if (entry == NULL) {
+        pr_err("malformed destination");
+        tunnel_shutdown(tunnel);
+        return;
+    }
+    *tunnel->desired_addr = entry->address;
+    head_len = entry->header_len;
+
+    // The destination may be bound to another server than the listener's own.
+    env = ssr_client_route(ctx->env, tunnel->desired_addr);
+    if (env != ctx->env) {
+        objects_container_remove(ctx->env->tunnel_set, tunnel);
+        objects_container_add(env->tunnel_set, tunnel);
+        ctx->env = env;
+    }
+
+    if (ctx->env->config->stripes > 1) {
+        do_prepare_stripe(tunnel);
+        head_len = ctx->stripe_pkg->len;
+    }
+
+    do_start_ssr_connection(tunnel, head_len);
+}
+
+/*
+ * The upstream is asked for a stripe session instead of the destination,
+ * which goes as the first chunk right behind the request. The other
+ * subflows dial out in parallel and join the session as they come up.
+ */
+static void do_prepare_stripe(struct tunnel_ctx *tunnel) {
+    struct client_ctx *ctx = (struct client_ctx *) tunnel->data;
+    struct stripe_spawn spawn = { 0 };
+    uint8_t id[STRIPE_ID_SIZE];
+    uint8_t token[STRIPE_TOKEN_SIZE];
+    size_t count = min((size_t)ctx->env->config->stripes, (size_t)STRIPE_MAX_SUBFLOWS);
+
+    rand_bytes(id, sizeof(id));
+    rand_bytes(token, sizeof(token));
+    ctx->stripe = stripe_session_create(id, token, count, &client_stripe_ops, NULL);
+    VERIFY(stripe_session_attach(ctx->stripe, 0, tunnel));
+    ctx->stripe_pkg = stripe_header_create(id, token, 0, count);
+    stripe_session_append(ctx->stripe, ctx->stripe_pkg, ctx->init_pkg->buffer, ctx->init_pkg->len);
+
+    spawn.env = ctx->env;
+    spawn.session = ctx->stripe;
+    spawn.id = id;
+    spawn.token = token;
+    for (spawn.index = 1; spawn.index < count; ++spawn.index) {
+        tunnel_initialize_outbound(tunnel->listener, tunnel->incoming->idle_timeout, &stripe_subflow_init_done_cb, &spawn);
+    }
+}
+
+static void do_start_ssr_connection(struct tunnel_ctx *tunnel, size_t head_len) {
+    struct socket_ctx *outgoing = tunnel->outgoing;
+    struct client_ctx *ctx = (struct client_ctx *) tunnel->data;
+    struct server_config *config = ctx->env->config;
+
     ctx->cipher = tunnel_cipher_create(ctx->env, 1452);
 
     {
@@ -403,7 +587,7 @@ static void do_parse_s5_request(struct tunnel_ctx *tunnel) {
         info = protocol ? protocol->get_server_info(protocol) : (obfs ? obfs->get_server_info(obfs) : NULL);
         if (info) {
             info->buffer_size = SSR_BUFF_SIZE;
-            info->head_len = (int) get_s5_head_size(ctx->init_pkg->buffer, ctx->init_pkg->len, 30);
+            info->head_len = (int) head_len;
         }
     }
     {
@@ -437,18 +621,17 @@ static void do_resolve_ssr_server_host(struct tunnel_ctx *tunnel) {
             parser->daddr,
             uv_strerror((int)outgoing->result));
         /* Send back a 'Host unreachable' reply. */
-        socket_write(incoming, "\5\4\0\1\0\0\0\0\0\0", 10);
-        ctx->state = session_kill;
+        do_reply_failure(tunnel, "\5\4\0\1\0\0\0\0\0\0");
         return;
     }
 
     /* Don't make assumptions about the offset of sin_port/sin6_port. */
     switch (outgoing->addr.addr.sa_family) {
     case AF_INET:
-        outgoing->addr.addr4.sin_port = htons(parser->dport);
+        outgoing->addr.addr4.sin_port = htons(ctx->env->config->remote_port);
         break;
     case AF_INET6:
-        outgoing->addr.addr6.sin6_port = htons(parser->dport);
+        outgoing->addr.addr6.sin6_port = htons(ctx->env->config->remote_port);
         break;
     default:
         UNREACHABLE();
@@ -472,8 +655,7 @@ static void do_connect_ssr_server(struct tunnel_ctx *tunnel) {
     if (!can_access(tunnel->listener, tunnel, &outgoing->addr.addr)) {
         pr_warn("connection not allowed by ruleset");
         /* Send a 'Connection not allowed by ruleset' reply. */
-        socket_write(incoming, "\5\2\0\1\0\0\0\0\0\0", 10);
-        ctx->state = session_kill;
+        do_reply_failure(tunnel, "\5\2\0\1\0\0\0\0\0\0");
         return;
     }
 
@@ -498,7 +680,7 @@ static void do_connect_ssr_server_done(struct tunnel_ctx *tunnel) {
     ASSERT(outgoing->wrstate == socket_stop);
 
     if (outgoing->result == 0) {
-        struct buffer_t *tmp = buffer_clone(ctx->init_pkg);
+        struct buffer_t *tmp = buffer_clone(ctx->stripe_pkg ? ctx->stripe_pkg : ctx->init_pkg);
         if (ssr_ok != tunnel_cipher_client_encrypt(ctx->cipher, tmp)) {
             buffer_free(tmp);
             tunnel_shutdown(tunnel);
@@ -512,8 +694,7 @@ static void do_connect_ssr_server_done(struct tunnel_ctx *tunnel) {
     } else {
         socket_dump_error_info("upstream connection", outgoing);
         /* Send a 'Connection refused' reply. */
-        socket_write(incoming, "\5\5\0\1\0\0\0\0\0\0", 10);
-        ctx->state = session_kill;
+        do_reply_failure(tunnel, "\5\5\0\1\0\0\0\0\0\0");
         return;
     }
 
@@ -582,12 +763,28 @@ static bool do_ssr_receipt_for_feedback(struct tunnel_ctx *tunnel) {
     return done;
 }
 
+/* The SOCKS5 failure replies are 10 bytes, a transparent client just sees the connection close. */
+static void do_reply_failure(struct tunnel_ctx *tunnel, const char *reply) {
+    struct client_ctx *ctx = (struct client_ctx *) tunnel->data;
+    if (ctx->transparent || ctx->stripe_index != 0) {
+        tunnel_shutdown(tunnel);
+        return;
+    }
+    socket_write(tunnel->incoming, reply, 10);
+    ctx->state = session_kill;
+}
+
 static void do_socks5_reply_success(struct tunnel_ctx *tunnel) {
     struct client_ctx *ctx = (struct client_ctx *) tunnel->data;
     struct socket_ctx *incoming = tunnel->incoming;
     struct socket_ctx *outgoing = tunnel->outgoing;
     uint8_t *buf;
     struct buffer_t *init_pkg = ctx->init_pkg;
+
+    if (ctx->transparent || ctx->stripe_index != 0) {
+        do_launch_streaming(tunnel);
+        return;
+    }
     buf = (uint8_t *)calloc(3 + init_pkg->len, sizeof(uint8_t));
 
     ASSERT(incoming->rdstate == socket_stop);
@@ -620,11 +817,64 @@ static void do_launch_streaming(struct tunnel_ctx *tunnel) {
         return;
     }
 
+    if (ctx->stripe) {
+        do_launch_stripe_streaming(tunnel);
+        return;
+    }
+
+    tunnel->half_close_allowed = true;
     socket_read(incoming);
     socket_read(outgoing);
     ctx->state = session_streaming;
 }
 
+/* Subflows read continuously, the session decides when a read has to wait. */
+static void do_launch_stripe_streaming(struct tunnel_ctx *tunnel) {
+    struct client_ctx *ctx = (struct client_ctx *) tunnel->data;
+
+    tunnel->tunnel_read_eof = &tunnel_stripe_read_eof;
+    ctx->state = session_stripe_streaming;
+    if (ctx->stripe_index == 0) {
+        socket_read(tunnel->incoming);
+    }
+    socket_read(tunnel->outgoing);
+    stripe_session_ready(ctx->stripe, ctx->stripe_index);
+    if (ctx->stripe_index == 0) {
+        // The SOCKS client can take what arrived over the faster subflows meanwhile.
+        stripe_session_release(ctx->stripe);
+    }
+}
+
+static void do_stripe_streaming(struct tunnel_ctx *tunnel, struct socket_ctx *socket) {
+    struct client_ctx *ctx = (struct client_ctx *) tunnel->data;
+    struct stripe_session *stripe = ctx->stripe;
+    struct socket_ctx *target = NULL;
+    struct buffer_t *buf;
+    bool ok = false;
+
+    buf = buffer_create_from((uint8_t *)socket->buf->base, (size_t)socket->result);
+    if (socket == tunnel->incoming) {
+        ok = stripe_session_send(stripe, buf->buffer, buf->len);
+        target = stripe_session_drain_wire(stripe);
+    } else {
+        struct buffer_t *feedback = NULL;
+        if (tunnel_cipher_client_decrypt(ctx->cipher, buf, &feedback) == ssr_ok) {
+            ok = stripe_session_receive(stripe, ctx->stripe_index, buf->buffer, buf->len);
+        }
+        buffer_free(feedback);
+        if (stripe_session_subflow(stripe, 0)) {
+            target = stripe_session_subflow(stripe, 0)->incoming;
+        }
+    }
+    buffer_free(buf);
+
+    if (ok == false || target == NULL) {
+        stripe_session_abort(stripe);
+        return;
+    }
+    socket_throttle(socket, target);
+}
+
 static uint8_t* tunnel_extract_data(struct socket_ctx *socket, void*(*allocator)(size_t size), size_t *size) {
     struct tunnel_ctx *tunnel = socket->tunnel;
     struct client_ctx *ctx = (struct client_ctx *) tunnel->data;
@@ -668,10 +918,14 @@ static void tunnel_dying(struct tunnel_ctx *tunnel) {
     struct client_ctx *ctx = (struct client_ctx *) tunnel->data;
 
     objects_container_remove(ctx->env->tunnel_set, tunnel);
+    if (ctx->stripe && stripe_session_detach(ctx->stripe, ctx->stripe_index)) {
+        stripe_session_destroy(ctx->stripe);
+    }
     if (ctx->cipher) {
         tunnel_cipher_release(ctx->cipher);
     }
     buffer_free(ctx->init_pkg);
+    buffer_free(ctx->stripe_pkg);
     free(ctx->parser);
     free(ctx);
 }
@@ -697,6 +951,21 @@ static void tunnel_write_done(struct tunnel_ctx *tunnel, struct socket_ctx *sock
     do_next(tunnel, socket);
 }
 
+/* The SOCKS client finished sending, or the upstream closed one subflow. */
+static void tunnel_stripe_read_eof(struct tunnel_ctx *tunnel, struct socket_ctx *socket) {
+    struct client_ctx *ctx = (struct client_ctx *) tunnel->data;
+    bool ok;
+
+    if (socket == tunnel->incoming) {
+        ok = stripe_session_send(ctx->stripe, NULL, 0);
+    } else {
+        ok = stripe_session_eof(ctx->stripe, ctx->stripe_index);
+    }
+    if (ok == false) {
+        stripe_session_abort(ctx->stripe);
+    }
+}
+
 static size_t tunnel_get_alloc_size(struct tunnel_ctx *tunnel, struct socket_ctx *socket, size_t suggested_size) {
     (void)tunnel;
     (void)socket;
@@ -704,10 +973,19 @@ static size_t tunnel_get_alloc_size(struct tunnel_ctx *tunnel, struct socket_ctx
     return SSR_BUFF_SIZE;
 }
 
+static size_t tunnel_get_recv_need(struct tunnel_ctx *tunnel, struct socket_ctx *socket) {
+    struct client_ctx *ctx = (struct client_ctx *) tunnel->data;
+    // Only the server's side is framed, the local application sends a plain stream.
+    if (socket != tunnel->outgoing) {
+        return 0;
+    }
+    return tunnel_cipher_recv_need(ctx->cipher);
+}
+
 static bool tunnel_is_in_streaming(struct tunnel_ctx *tunnel) {
-    // struct client_ctx *ctx = (struct client_ctx *) tunnel->data;
-    // return (ctx->state == session_streaming);
-    return false;
+    struct client_ctx *ctx = (struct client_ctx *) tunnel->data;
+    // Only striped tunnels read continuously, see do_stripe_streaming().
+    return (ctx->state == session_stripe_streaming);
 }
 
 static bool can_auth_none(const uv_tcp_t *lx, const struct tunnel_ctx *cx) {
@@ -755,3 +1033,28 @@ static bool can_access(const uv_tcp_t *lx, const struct tunnel_ctx *cx, const st
 
     return false;
 }
+
+static struct socket_ctx * stripe_client_wire(struct tunnel_ctx *subflow) {
+    return subflow->outgoing;
+}
+
+static bool stripe_client_seal(struct tunnel_ctx *subflow, struct buffer_t *buf) {
+    struct client_ctx *ctx = (struct client_ctx *) subflow->data;
+    return (tunnel_cipher_client_encrypt(ctx->cipher, buf) == ssr_ok);
+}
+
+/* Everything comes back to the SOCKS client on subflow 0. */
+static void stripe_client_deliver(struct stripe_session *session, const uint8_t *data, size_t len) {
+    struct tunnel_ctx *tunnel = stripe_session_subflow(session, 0);
+    struct socket_ctx *incoming;
+
+    if (tunnel == NULL || tunnel->terminated) {
+        return;
+    }
+    incoming = tunnel->incoming;
+    if (len) {
+        socket_write(incoming, data, len);
+    } else if (incoming->sdstate == socket_stop) {
+        socket_shutdown(incoming);
+    }
+}
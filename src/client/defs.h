@@ -45,8 +45,15 @@ struct server_env_t;
 
 /* client.c */
 void client_tunnel_initialize(uv_tcp_t *lx, unsigned int idle_timeout);
+void client_transparent_tunnel_initialize(uv_tcp_t *lx, unsigned int idle_timeout);
 void client_shutdown(struct server_env_t *env);
 
+/* listener.c */
+struct socks5_address;
+struct dest_table;
+struct server_env_t * ssr_client_route(struct server_env_t *env, const struct socks5_address *addr);
+struct dest_table * ssr_client_destinations(struct server_env_t *env);
+
 /* getopt.c */
 #if !HAVE_UNISTD_H
 extern char *optarg;
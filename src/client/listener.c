@@ -28,6 +28,9 @@
 #include "ssr_executive.h"
 #include "ssr_client_api.h"
 #include "common.h"
+#include "encrypt.h"
+#include "route.h"
+#include "dest_table.h"
 #if UDP_RELAY_ENABLE
 #include "udprelay.h"
 #endif // UDP_RELAY_ENABLE
@@ -40,11 +43,17 @@ struct udp_listener_ctx_t;
 
 struct listener_t {
     uv_tcp_t *tcp_server;
+    uv_tcp_t *transparent_server;
     struct udp_listener_ctx_t *udp_server;
 };
 
 struct ssr_client_state {
-    struct server_env_t *env;
+    struct server_env_t *env;  /* The first binding, also in |envs|. */
+
+    size_t env_count;  /* One cipher env per listener -> server binding. */
+    struct server_env_t **envs;
+    struct route_table *routes;  /* Destination -> env, from the "routes" config. */
+    struct dest_table *destinations;  /* Shared by every binding. */
 
     uv_signal_t *sigint_watcher;
     uv_signal_t *sigterm_watcher;
@@ -60,26 +69,44 @@ struct ssr_client_state {
 
 static void getaddrinfo_done_cb(uv_getaddrinfo_t *req, int status, struct addrinfo *addrs);
 static void listen_incoming_connection_cb(uv_stream_t *server, int status);
+static void listen_transparent_connection_cb(uv_stream_t *server, int status);
 static void signal_quit(uv_signal_t* handle, int signum);
+static struct route_table * build_route_table(struct ssr_client_state *state, const struct server_config *cf);
 
 int ssr_run_loop_begin(struct server_config *cf, void(*feedback_state)(struct ssr_client_state *state, void *p), void *p) {
     uv_loop_t * loop = NULL;
     struct addrinfo hints;
     struct ssr_client_state *state;
-    int err;
-    uv_getaddrinfo_t *req;
+    struct server_config *binding;
+    int err = 0;
+    size_t n;
 
     loop = (uv_loop_t *) calloc(1, sizeof(uv_loop_t));
     uv_loop_init(loop);
 
     state = (struct ssr_client_state *) calloc(1, sizeof(*state));
     state->listeners = NULL;
-    state->env = ssr_cipher_env_create(cf, state);
+    for (binding = cf; binding; binding = binding->next_binding) {
+        state->env_count++;
+    }
+    state->envs = (struct server_env_t **) calloc(state->env_count, sizeof(state->envs[0]));
+    for (binding = cf, n = 0; binding; binding = binding->next_binding, ++n) {
+        state->envs[n] = ssr_cipher_env_create(binding, state);
+        pr_info("crypto backend   %s", cipher_env_backend_name(state->envs[n]->cipher));
+    }
+    state->env = state->envs[0];
+    state->routes = build_route_table(state, cf);
+    state->destinations = dest_table_create(DEST_TABLE_DEFAULT_SIZE);
     state->feedback_state = feedback_state;
     state->ptr = p;
 
     loop->data = state->env;
 
+    tunnel_set_memory_budget((size_t)cf->memory_budget_mb * 1024 * 1024);
+#if UDP_RELAY_ENABLE
+    udprelay_set_single_reply_ports(cf->udp_single_reply_ports, cf->udp_single_reply_timeout);
+#endif // UDP_RELAY_ENABLE
+
     /* Resolve the address of the interface that we should bind to.
     * The getaddrinfo callback starts the server and everything else.
     */
@@ -88,33 +115,53 @@ int ssr_run_loop_begin(struct server_config *cf, void(*feedback_state)(struct ss
     hints.ai_socktype = SOCK_STREAM;
     hints.ai_protocol = IPPROTO_TCP;
 
-    req = (uv_getaddrinfo_t *)calloc(1, sizeof(*req));
+    for (n = 0; n < state->env_count; ++n) {
+        uv_getaddrinfo_t *req;
+        if (state->envs[n]->config->route_only) {
+            continue;
+        }
+        req = (uv_getaddrinfo_t *)calloc(1, sizeof(*req));
+        req->data = state->envs[n];
+        err = uv_getaddrinfo(loop, req, getaddrinfo_done_cb, state->envs[n]->config->listen_host, NULL, &hints);
+        if (err != 0) {
+            pr_err("getaddrinfo: %s", uv_strerror(err));
+            free(req);
+            break;
+        }
+    }
 
-    err = uv_getaddrinfo(loop, req, getaddrinfo_done_cb, cf->listen_host, NULL, &hints);
     if (err != 0) {
-        pr_err("getaddrinfo: %s", uv_strerror(err));
+        /* Lookups of the earlier bindings are still queued. Let them finish,
+         * getaddrinfo_done_cb() drops their results once shutting down.
+         */
+        state->shutting_down = true;
+        uv_run(loop, UV_RUN_DEFAULT);
         if (state->feedback_state) {
             state->feedback_state(state, state->ptr);
         }
-        return err;
+    } else {
+        // Setup signal handler
+        state->sigint_watcher = (uv_signal_t *) calloc(1, sizeof(uv_signal_t));
+        uv_signal_init(loop, state->sigint_watcher);
+        uv_signal_start(state->sigint_watcher, signal_quit, SIGINT);
+
+        state->sigterm_watcher = (uv_signal_t *) calloc(1, sizeof(uv_signal_t));
+        uv_signal_init(loop, state->sigterm_watcher);
+        uv_signal_start(state->sigterm_watcher, signal_quit, SIGTERM);
+
+        /* Start the event loop.  Control continues in getaddrinfo_done_cb(). */
+        err = uv_run(loop, UV_RUN_DEFAULT);
+        if (err != 0) {
+            pr_err("uv_run: %s", uv_strerror(err));
+        }
     }
 
-    // Setup signal handler
-    state->sigint_watcher = (uv_signal_t *) calloc(1, sizeof(uv_signal_t));
-    uv_signal_init(loop, state->sigint_watcher);
-    uv_signal_start(state->sigint_watcher, signal_quit, SIGINT);
-
-    state->sigterm_watcher = (uv_signal_t *) calloc(1, sizeof(uv_signal_t));
-    uv_signal_init(loop, state->sigterm_watcher);
-    uv_signal_start(state->sigterm_watcher, signal_quit, SIGTERM);
-
-    /* Start the event loop.  Control continues in getaddrinfo_done_cb(). */
-    err = uv_run(loop, UV_RUN_DEFAULT);
-    if (err != 0) {
-        pr_err("uv_run: %s", uv_strerror(err));
+    for (n = 0; n < state->env_count; ++n) {
+        ssr_cipher_env_release(state->envs[n]);
     }
-
-    ssr_cipher_env_release(state->env);
+    free(state->envs);
+    route_table_destroy(state->routes);
+    dest_table_destroy(state->destinations);
 
     if (state->listeners) {
         free(state->listeners);
@@ -130,6 +177,45 @@ int ssr_run_loop_begin(struct server_config *cf, void(*feedback_state)(struct ss
     return err;
 }
 
+static struct route_table * build_route_table(struct ssr_client_state *state, const struct server_config *cf) {
+    struct route_table *routes;
+    size_t i, n;
+
+    if (cf->route_count == 0) {
+        return NULL;
+    }
+    routes = route_table_create();
+    for (i = 0; i < cf->route_count; ++i) {
+        const struct server_route *route = &cf->routes[i];
+        struct server_env_t *target = NULL;
+        for (n = 0; n < state->env_count; ++n) {
+            const char *remarks = state->envs[n]->config->remarks;
+            if (remarks && strcmp(remarks, route->server) == 0) {
+                target = state->envs[n];
+                break;
+            }
+        }
+        if (target == NULL) {
+            pr_warn("route \"%s\": no server named \"%s\"", route->match, route->server);
+            continue;
+        }
+        if (route_table_add(routes, route->match, target) == false) {
+            pr_warn("route \"%s\" is malformed or repeated", route->match);
+        }
+    }
+    return routes;
+}
+
+struct server_env_t * ssr_client_route(struct server_env_t *env, const struct socks5_address *addr) {
+    struct ssr_client_state *state = (struct ssr_client_state *)env->data;
+    struct server_env_t *target = (struct server_env_t *)route_table_lookup(state->routes, addr);
+    return target ? target : env;
+}
+
+struct dest_table * ssr_client_destinations(struct server_env_t *env) {
+    return ((struct ssr_client_state *)env->data)->destinations;
+}
+
 static void tcp_close_done_cb(uv_handle_t* handle) {
     free((void *)((uv_tcp_t *)handle));
 }
@@ -157,6 +243,9 @@ void ssr_run_loop_shutdown(struct ssr_client_state *state) {
             if (tcp_server) {
                 uv_close((uv_handle_t *)tcp_server, tcp_close_done_cb);
             }
+            if (listener->transparent_server) {
+                uv_close((uv_handle_t *)listener->transparent_server, tcp_close_done_cb);
+            }
 
 #if UDP_RELAY_ENABLE
             udp_server = listener->udp_server;
@@ -167,7 +256,12 @@ void ssr_run_loop_shutdown(struct ssr_client_state *state) {
         }
     }
 
-    client_shutdown(state->env);
+    {
+        size_t n;
+        for (n = 0; n < state->env_count; ++n) {
+            client_shutdown(state->envs[n]);
+        }
+    }
 
     pr_info(" ");
     pr_info("terminated.\n");
@@ -199,13 +293,18 @@ static void getaddrinfo_done_cb(uv_getaddrinfo_t *req, int status, struct addrin
 
     loop = req->loop;
 
-    env = (struct server_env_t *) loop->data;
+    env = (struct server_env_t *) req->data;
     state = (struct ssr_client_state *) env->data;
     ASSERT(state);
     cf = env->config;
 
     free(req);
 
+    if (state->shutting_down) {
+        uv_freeaddrinfo(addrs);
+        return;
+    }
+
     if (status < 0) {
         pr_err("getaddrinfo(\"%s\"): %s", cf->listen_host, uv_strerror(status));
         uv_freeaddrinfo(addrs);
@@ -231,10 +330,12 @@ static void getaddrinfo_done_cb(uv_getaddrinfo_t *req, int status, struct addrin
         return;
     }
 
-    state->listener_count = (ipv4_naddrs + ipv6_naddrs);
-    state->listeners = (struct listener_t *) calloc(state->listener_count, sizeof(state->listeners[0]));
+    // Bindings resolve one after another, each appends its listeners.
+    n = (unsigned int) state->listener_count;
+    state->listener_count += (ipv4_naddrs + ipv6_naddrs);
+    state->listeners = (struct listener_t *) realloc(state->listeners, state->listener_count * sizeof(state->listeners[0]));
+    memset(state->listeners + n, 0, (ipv4_naddrs + ipv6_naddrs) * sizeof(state->listeners[0]));
 
-    n = 0;
     for (ai = addrs; ai != NULL; ai = ai->ai_next) {
         struct listener_t *listener;
         uv_tcp_t *tcp_server;
@@ -265,6 +366,7 @@ static void getaddrinfo_done_cb(uv_getaddrinfo_t *req, int status, struct addrin
         listener->tcp_server = (uv_tcp_t *)calloc(1, sizeof(listener->tcp_server[0]));
         tcp_server = listener->tcp_server;
         VERIFY(0 == uv_tcp_init(loop, tcp_server));
+        tcp_server->data = env;
 
         what = "uv_tcp_bind";
         err = uv_tcp_bind(tcp_server, &s.addr, 0);
@@ -288,6 +390,31 @@ static void getaddrinfo_done_cb(uv_getaddrinfo_t *req, int status, struct addrin
 
         pr_info("listening on     %s:%hu\n", addrbuf, port);
 
+        if (cf->transparent_port) {
+            uv_tcp_t *transparent_server = (uv_tcp_t *)calloc(1, sizeof(*transparent_server));
+            VERIFY(0 == uv_tcp_init(loop, transparent_server));
+            transparent_server->data = env;
+            listener->transparent_server = transparent_server;
+
+            if (s.addr.sa_family == AF_INET) {
+                s.addr4.sin_port = htons(cf->transparent_port);
+            } else {
+                s.addr6.sin6_port = htons(cf->transparent_port);
+            }
+            what = "uv_tcp_bind";
+            err = uv_tcp_bind(transparent_server, &s.addr, 0);
+            if (err == 0) {
+                what = "uv_listen";
+                err = uv_listen((uv_stream_t *)transparent_server, 128, listen_transparent_connection_cb);
+            }
+            if (err != 0) {
+                pr_err("%s(\"%s:%hu\"): %s", what, addrbuf, cf->transparent_port, uv_strerror(err));
+                ssr_run_loop_shutdown(state);
+                break;
+            }
+            pr_info("transparent on   %s:%hu\n", addrbuf, cf->transparent_port);
+        }
+
 #if UDP_RELAY_ENABLE
         if (cf->udp) {
             union sockaddr_universal remote_addr = { 0 };
@@ -297,7 +424,7 @@ static void getaddrinfo_done_cb(uv_getaddrinfo_t *req, int status, struct addrin
                 cf->listen_host, port,
                 &remote_addr,
                 NULL, 0, cf->idle_timeout,
-                state->env->cipher,
+                env->cipher,
                 cf->protocol, cf->protocol_param);
         }
 #endif // UDP_RELAY_ENABLE
@@ -309,13 +436,19 @@ static void getaddrinfo_done_cb(uv_getaddrinfo_t *req, int status, struct addrin
 }
 
 static void listen_incoming_connection_cb(uv_stream_t *server, int status) {
-    uv_loop_t *loop = server->loop;
-    struct server_env_t *env = (struct server_env_t *)loop->data;
+    struct server_env_t *env = (struct server_env_t *)server->data;
 
     VERIFY(status == 0);
     client_tunnel_initialize((uv_tcp_t *)server, env->config->idle_timeout);
 }
 
+static void listen_transparent_connection_cb(uv_stream_t *server, int status) {
+    struct server_env_t *env = (struct server_env_t *)server->data;
+
+    VERIFY(status == 0);
+    client_transparent_tunnel_initialize((uv_tcp_t *)server, env->config->idle_timeout);
+}
+
 static void signal_quit(uv_signal_t* handle, int signum) {
     switch (signum) {
     case SIGINT:
@@ -60,6 +60,8 @@ int main(int argc, char **argv) {
             break;
         }
 
+        set_dump_level((enum dump_level)cmds->log_level);
+
         if (cmds->cfg_file == NULL) {
             string_safe_assign(&cmds->cfg_file, DEFAULT_CONF_PATH);
         }
@@ -70,7 +72,12 @@ int main(int argc, char **argv) {
         }
 
 #ifndef UDP_RELAY_ENABLE
-        config->udp = false;
+        {
+            struct server_config *binding;
+            for (binding = config; binding; binding = binding->next_binding) {
+                binding->udp = false;
+            }
+        }
 #endif // UDP_RELAY_ENABLE
 
         if (config->method == NULL || config->password==NULL || config->remote_host==NULL) {
@@ -79,7 +86,7 @@ int main(int argc, char **argv) {
 
         if (cmds->daemon_flag) {
             char param[257] = { 0 };
-            sprintf(param, "-c \"%s\"", cmds->cfg_file);
+            sprintf(param, "-c \"%s\" -l %d", cmds->cfg_file, cmds->log_level);
             daemon_wrapper(argv[0], param);
         }
 
@@ -93,6 +100,8 @@ int main(int argc, char **argv) {
 
     cmd_line_info_destroy(cmds);
 
+    pr_flush();
+
     config_release(config);
 
     if (err != 0) {
@@ -134,6 +143,15 @@ void print_remote_info(const struct server_config *config) {
     if (config->obfs_param && strlen(config->obfs_param)) {
         pr_info("obfs_param       %s", config->obfs_param);
     }
+    if (config->route_count) {
+        pr_info("routes           %u", (unsigned int)config->route_count);
+    }
+    if (config->transparent_port) {
+        pr_info("transparent port %hu", config->transparent_port);
+    }
+    if (config->stripes > 1) {
+        pr_info("stripes          %u", config->stripes);
+    }
     pr_info("udp relay        %s\n", config->udp ? "yes" : "no");
 }
 
@@ -147,13 +165,15 @@ static void usage(void) {
         "\n"
         "Usage:\n"
         "\n"
-        "  %s [-d] [-c <config file>] [-h]\n"
+        "  %s [-d] [-c <config file>] [-l <level>] [-h]\n"
         "\n"
         "Options:\n"
         "\n"
         "  -d                     Run in background as a daemon.\n"
         "  -c <config file>       Configure file path.\n"
         "                         Default: " DEFAULT_CONF_PATH "\n"
+        "  -l <level>             Log level, 0 none, 1 errors, 2 warnings, 3 info.\n"
+        "                         Default: 3\n"
         "  -h                     Show this help message.\n"
         "",
         get_app_name());
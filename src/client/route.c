@@ -0,0 +1,252 @@
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <uv.h>
+
+#include "route.h"
+#include "sockaddr_universal.h"
+#include "ssr_executive.h"
+
+struct route_domain {
+    void *target;
+    bool suffix;  /* Also matches names below this one. */
+};
+
+struct route_cidr {
+    int family;
+    uint8_t addr[16];  /* Already masked to |prefix| bits. */
+    unsigned int prefix;
+    void *target;
+};
+
+/* The run of |cidrs| that shares one family and prefix length. */
+struct route_cidr_group {
+    int family;
+    unsigned int prefix;
+    size_t begin;
+    size_t end;
+};
+
+/* One group per distinct prefix length: 33 for IPv4 and 129 for IPv6 at most. */
+#define ROUTE_CIDR_GROUPS_MAX (33 + 129)
+
+struct route_table {
+    struct cstl_map *domains;
+    struct route_cidr *cidrs;  /* Grouped by family and prefix, longest first, then by address. */
+    size_t cidr_count;
+    struct route_cidr_group groups[ROUTE_CIDR_GROUPS_MAX];
+    size_t group_count;
+};
+
+static int route_domain_compare_key(void *left, void *right) {
+    return strcmp(*(char **)left, *(char **)right);
+}
+
+static void route_domain_destroy_key(void *obj) {
+    if (obj) {
+        free(*(void **)obj);
+    }
+}
+
+static size_t route_family_size(int family) {
+    return (family == AF_INET) ? sizeof(struct in_addr) : sizeof(struct in6_addr);
+}
+
+static void route_mask(uint8_t *addr, size_t size, unsigned int prefix) {
+    size_t i;
+    for (i = 0; i < size; ++i) {
+        if (prefix >= 8) {
+            prefix -= 8;
+        } else {
+            addr[i] &= (uint8_t)(0xFF << (8 - prefix));
+            prefix = 0;
+        }
+    }
+}
+
+static int route_cidr_compare(const void *left, const void *right) {
+    const struct route_cidr *l = (const struct route_cidr *)left;
+    const struct route_cidr *r = (const struct route_cidr *)right;
+    if (l->family != r->family) {
+        return l->family - r->family;
+    }
+    if (l->prefix != r->prefix) {
+        return (l->prefix > r->prefix) ? -1 : 1;
+    }
+    return memcmp(l->addr, r->addr, route_family_size(l->family));
+}
+
+static void route_lower(char *dst, const char *src, size_t size) {
+    size_t i;
+    for (i = 0; i + 1 < size && src[i]; ++i) {
+        dst[i] = (char)tolower((unsigned char)src[i]);
+    }
+    dst[i] = '\0';
+}
+
+struct route_table * route_table_create(void) {
+    struct route_table *table = (struct route_table *)calloc(1, sizeof(*table));
+    table->domains = obj_map_create(route_domain_compare_key, route_domain_destroy_key, NULL);
+    return table;
+}
+
+void route_table_destroy(struct route_table *table) {
+    if (table == NULL) {
+        return;
+    }
+    obj_map_destroy(table->domains);
+    free(table->cidrs);
+    free(table);
+}
+
+static bool route_table_add_domain(struct route_table *table, const char *name, bool suffix, void *target) {
+    struct route_domain domain = { target, suffix };
+    char *key = (char *)calloc(strlen(name) + 1, sizeof(char));
+    route_lower(key, name, strlen(name) + 1);
+    if (strlen(key) == 0 || obj_map_exists(table->domains, &key)) {
+        free(key);
+        return false;
+    }
+    if (obj_map_add(table->domains, &key, sizeof(void *), &domain, sizeof(domain)) == false) {
+        free(key);
+        return false;
+    }
+    return true;
+}
+
+/* Find where each family and prefix run begins and ends, once per rule added. */
+static void route_table_group_cidrs(struct route_table *table) {
+    size_t i;
+    table->group_count = 0;
+    for (i = 0; i < table->cidr_count; ++i) {
+        const struct route_cidr *cidr = &table->cidrs[i];
+        struct route_cidr_group *group = table->group_count ? &table->groups[table->group_count - 1] : NULL;
+        if (group && group->family == cidr->family && group->prefix == cidr->prefix) {
+            group->end = i + 1;
+            continue;
+        }
+        group = &table->groups[table->group_count++];
+        group->family = cidr->family;
+        group->prefix = cidr->prefix;
+        group->begin = i;
+        group->end = i + 1;
+    }
+}
+
+static bool route_table_add_cidr(struct route_table *table, const char *text, void *target) {
+    struct route_cidr cidr = { 0 };
+    char addr[64] = { 0 };
+    const char *slash = strchr(text, '/');
+    size_t len = slash ? (size_t)(slash - text) : strlen(text);
+    size_t size;
+
+    if (len == 0 || len >= sizeof(addr)) {
+        return false;
+    }
+    memcpy(addr, text, len);
+    if (uv_inet_pton(AF_INET, addr, cidr.addr) == 0) {
+        cidr.family = AF_INET;
+    } else if (uv_inet_pton(AF_INET6, addr, cidr.addr) == 0) {
+        cidr.family = AF_INET6;
+    } else {
+        return false;
+    }
+    size = route_family_size(cidr.family);
+    cidr.prefix = (unsigned int)(size * 8);
+    if (slash) {
+        char *end = NULL;
+        long prefix;
+        // strtol() would also take blanks and a sign, "/abc" would be /0.
+        if (slash[1] < '0' || slash[1] > '9') {
+            return false;
+        }
+        prefix = strtol(slash + 1, &end, 10);
+        if (*end != '\0' || prefix < 0 || prefix > (long)(size * 8)) {
+            return false;
+        }
+        cidr.prefix = (unsigned int)prefix;
+    }
+    route_mask(cidr.addr, size, cidr.prefix);
+    cidr.target = target;
+
+    table->cidrs = (struct route_cidr *)realloc(table->cidrs, (table->cidr_count + 1) * sizeof(table->cidrs[0]));
+    table->cidrs[table->cidr_count++] = cidr;
+    qsort(table->cidrs, table->cidr_count, sizeof(table->cidrs[0]), route_cidr_compare);
+    route_table_group_cidrs(table);
+    return true;
+}
+
+bool route_table_add(struct route_table *table, const char *rule, void *target) {
+    if (table == NULL || rule == NULL) {
+        return false;
+    }
+    if (strncmp(rule, "domain:", 7) == 0) {
+        return route_table_add_domain(table, rule + 7, true, target);
+    }
+    if (strncmp(rule, "full:", 5) == 0) {
+        return route_table_add_domain(table, rule + 5, false, target);
+    }
+    if (strncmp(rule, "cidr:", 5) == 0) {
+        return route_table_add_cidr(table, rule + 5, target);
+    }
+    return false;
+}
+
+static void * route_table_lookup_domain(const struct route_table *table, const char *host) {
+    char name[0x0100];
+    const char *iter;
+
+    route_lower(name, host, sizeof(name));
+    for (iter = name; iter && *iter; ) {
+        const struct route_domain *domain = (const struct route_domain *)obj_map_find(table->domains, &iter);
+        if (domain && (domain->suffix || iter == name)) {
+            return domain->target;
+        }
+        iter = strchr(iter, '.');
+        if (iter) {
+            ++iter;
+        }
+    }
+    return NULL;
+}
+
+static void * route_table_lookup_cidr(const struct route_table *table, int family, const uint8_t *addr) {
+    size_t size = route_family_size(family);
+    size_t i;
+
+    for (i = 0; i < table->group_count; ++i) {
+        const struct route_cidr_group *group = &table->groups[i];
+        struct route_cidr key = { 0 };
+        const struct route_cidr *found;
+        if (group->family != family) {
+            continue;
+        }
+        key.family = family;
+        key.prefix = group->prefix;
+        memcpy(key.addr, addr, size);
+        route_mask(key.addr, size, key.prefix);
+        found = (const struct route_cidr *)bsearch(&key, &table->cidrs[group->begin],
+            group->end - group->begin, sizeof(key), route_cidr_compare);
+        if (found) {
+            return found->target;
+        }
+    }
+    return NULL;
+}
+
+void * route_table_lookup(const struct route_table *table, const struct socks5_address *addr) {
+    if (table == NULL || addr == NULL) {
+        return NULL;
+    }
+    switch (addr->addr_type) {
+    case SOCKS5_ADDRTYPE_DOMAINNAME:
+        return route_table_lookup_domain(table, addr->addr.domainname);
+    case SOCKS5_ADDRTYPE_IPV4:
+        return route_table_lookup_cidr(table, AF_INET, (const uint8_t *)&addr->addr.ipv4);
+    case SOCKS5_ADDRTYPE_IPV6:
+        return route_table_lookup_cidr(table, AF_INET6, (const uint8_t *)&addr->addr.ipv6);
+    default:
+        break;
+    }
+    return NULL;
+}
@@ -0,0 +1,22 @@
+#if !defined(__route_h__)
+#define __route_h__ 1
+
+#include <stdbool.h>
+
+struct route_table;
+struct socks5_address;
+
+/*
+ * Destination rules, each mapping to an opaque target:
+ *   "domain:example.com"  example.com and every name below it
+ *   "full:www.example.com" that name only
+ *   "cidr:10.0.0.0/8", "cidr:2001:db8::/32"
+ * Names cost one map lookup per label, addresses one binary search per
+ * distinct prefix length.
+ */
+struct route_table * route_table_create(void);
+void route_table_destroy(struct route_table *table);
+bool route_table_add(struct route_table *table, const char *rule, void *target);
+void * route_table_lookup(const struct route_table *table, const struct socks5_address *addr);
+
+#endif // !defined(__route_h__)
@@ -7,13 +7,15 @@
 
 #include "cmd_line_parser.h"
 #include "ssr_executive.h"
+#include "dump_info.h"
 
 struct cmd_line_info * cmd_line_info_create(int argc, char * const argv[]) {
     int opt;
 
     struct cmd_line_info *info = (struct cmd_line_info *)calloc(1, sizeof(*info));
+    info->log_level = dump_level_info;
 
-    while (-1 != (opt = getopt(argc, argv, "c:dh"))) {
+    while (-1 != (opt = getopt(argc, argv, "c:dl:h"))) {
         switch (opt) {
         case 'c':
             string_safe_assign(&info->cfg_file, optarg);
@@ -21,6 +23,17 @@ struct cmd_line_info * cmd_line_info_create(int argc, char * const argv[]) {
         case 'd':
             info->daemon_flag = true;
             break;
+        case 'l':
+            {
+                char *end = NULL;
+                long level = strtol(optarg, &end, 10);
+                if (end == optarg || *end != '\0' || level < dump_level_none || level > dump_level_info) {
+                    info->help_flag = true;
+                    break;
+                }
+                info->log_level = (int)level;
+            }
+            break;
         case 'h':
         default:
             info->help_flag = true;
@@ -11,6 +11,7 @@ struct cmd_line_info {
     char * cfg_file;
     bool daemon_flag;
     bool help_flag;
+    int log_level; /* enum dump_level */
 };
 
 struct cmd_line_info * cmd_line_info_create(int argc, char * const argv[]);
@@ -67,16 +67,98 @@ bool json_iter_extract_bool(const char *key, const struct json_object_iter *iter
     return result;
 }
 
+static void parse_config_object(struct json_object *jso, struct server_config *config);
+static void parse_config_bindings(struct json_object *jso, struct server_config *config);
+static void parse_config_routes(struct json_object *jso, struct server_config *config);
+
 bool parse_config_file(const char *file, struct server_config *config) {
     bool result = false;
     json_object *jso = NULL;
     do {
-        struct json_object_iter iter;
-
         jso = json_object_from_file(file);
         if (jso == NULL) {
             break;
         }
+        parse_config_object(jso, config);
+        parse_config_routes(jso, config);
+        parse_config_bindings(jso, config);
+        result = true;
+    } while (0);
+    if (jso) {
+        json_object_put(jso);
+    }
+    return result;
+}
+
+/*
+ * "bindings": [ { "local_port": 1081, "server": "...", ... }, ... ]
+ * Each entry starts as a copy of the top level settings and overrides
+ * what it names, so one client process can serve several exits.
+ */
+static void parse_config_bindings(struct json_object *jso, struct server_config *config) {
+    struct json_object *bindings = NULL;
+    struct server_config **tail = &config->next_binding;
+    size_t i, count;
+
+    if (json_object_object_get_ex(jso, "bindings", &bindings) == false ||
+        json_type_array != json_object_get_type(bindings)) {
+        return;
+    }
+    count = json_object_array_length(bindings);
+    for (i = 0; i < count; ++i) {
+        struct json_object *item = json_object_array_get_idx(bindings, i);
+        struct server_config *binding;
+        if (item == NULL || json_type_object != json_object_get_type(item)) {
+            continue;
+        }
+        binding = config_clone(config);
+        parse_config_object(item, binding);
+        *tail = binding;
+        tail = &binding->next_binding;
+    }
+}
+
+/* "routes": [ { "match": "domain:example.com", "server": "<remarks of a binding>" }, ... ] */
+static void parse_config_routes(struct json_object *jso, struct server_config *config) {
+    struct json_object *routes = NULL;
+    size_t i, count;
+
+    if (json_object_object_get_ex(jso, "routes", &routes) == false ||
+        json_type_array != json_object_get_type(routes)) {
+        return;
+    }
+    count = json_object_array_length(routes);
+    config->routes = (struct server_route *)calloc(count ? count : 1, sizeof(config->routes[0]));
+    for (i = 0; i < count; ++i) {
+        struct json_object *item = json_object_array_get_idx(routes, i);
+        struct server_route *route = &config->routes[config->route_count];
+        struct json_object_iter iter;
+        if (item == NULL || json_type_object != json_object_get_type(item)) {
+            continue;
+        }
+        json_object_object_foreachC(item, iter) {
+            const char *obj_str = NULL;
+            if (json_iter_extract_string("match", &iter, &obj_str)) {
+                string_safe_assign(&route->match, obj_str);
+                continue;
+            }
+            if (json_iter_extract_string("server", &iter, &obj_str)) {
+                string_safe_assign(&route->server, obj_str);
+                continue;
+            }
+        }
+        if (route->match && route->server) {
+            config->route_count++;
+        } else {
+            object_safe_free((void **)&route->match);
+            object_safe_free((void **)&route->server);
+        }
+    }
+}
+
+static void parse_config_object(struct json_object *jso, struct server_config *config) {
+    struct json_object_iter iter;
+    do {
         json_object_object_foreachC(jso, iter) {
             int obj_int = 0;
             bool obj_bool = false;
@@ -125,6 +207,18 @@ bool parse_config_file(const char *file, struct server_config *config) {
                 string_safe_assign(&config->obfs_param, obj_str);
                 continue;
             }
+            if (json_iter_extract_string("protocol_accept", &iter, &obj_str)) {
+                string_safe_assign(&config->protocol_accept, obj_str);
+                continue;
+            }
+            if (json_iter_extract_string("obfs_accept", &iter, &obj_str)) {
+                string_safe_assign(&config->obfs_accept, obj_str);
+                continue;
+            }
+            if (json_iter_extract_string("crypto_backend", &iter, &obj_str)) {
+                string_safe_assign(&config->crypto_backend, obj_str);
+                continue;
+            }
             if (json_iter_extract_int("timeout", &iter, &obj_int)) {
                 config->idle_timeout = obj_int * SECONDS_PER_MINUTE;
                 continue;
@@ -133,11 +227,54 @@ bool parse_config_file(const char *file, struct server_config *config) {
                 config->udp = obj_bool;
                 continue;
             }
+            if (json_iter_extract_int("quota_daily_mb", &iter, &obj_int)) {
+                config->quota_daily_mb = (unsigned int) obj_int;
+                continue;
+            }
+            if (json_iter_extract_int("quota_monthly_mb", &iter, &obj_int)) {
+                config->quota_monthly_mb = (unsigned int) obj_int;
+                continue;
+            }
+            if (json_iter_extract_int("padding_budget", &iter, &obj_int)) {
+                config->padding_budget = (unsigned int) obj_int;
+                continue;
+            }
+            if (json_iter_extract_int("memory_budget_mb", &iter, &obj_int)) {
+                config->memory_budget_mb = (unsigned int) obj_int;
+                continue;
+            }
+            if (json_iter_extract_int("drain_timeout", &iter, &obj_int)) {
+                config->drain_timeout = (unsigned int) obj_int * SECONDS_PER_MINUTE;
+                continue;
+            }
+            if (json_iter_extract_bool("route_only", &iter, &obj_bool)) {
+                config->route_only = obj_bool;
+                continue;
+            }
+            if (json_iter_extract_int("transparent_port", &iter, &obj_int)) {
+                config->transparent_port = (unsigned short) obj_int;
+                continue;
+            }
+            if (json_iter_extract_int("stripes", &iter, &obj_int)) {
+                config->stripes = (unsigned int) obj_int;
+                continue;
+            }
+            if (json_iter_extract_string("quota_state_file", &iter, &obj_str)) {
+                string_safe_assign(&config->quota_state_file, obj_str);
+                continue;
+            }
+            if (json_iter_extract_string("quota_users", &iter, &obj_str)) {
+                string_safe_assign(&config->quota_users, obj_str);
+                continue;
+            }
+            if (json_iter_extract_string("udp_single_reply_ports", &iter, &obj_str)) {
+                string_safe_assign(&config->udp_single_reply_ports, obj_str);
+                continue;
+            }
+            if (json_iter_extract_int("udp_single_reply_timeout", &iter, &obj_int)) {
+                config->udp_single_reply_timeout = (unsigned int) obj_int * SECONDS_PER_MINUTE;
+                continue;
+            }
         }
-        result = true;
     } while (0);
-    if (jso) {
-        json_object_put(jso);
-    }
-    return result;
 }
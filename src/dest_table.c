@@ -0,0 +1,125 @@
+#include <stdlib.h>
+#include <string.h>
+#include <uv.h>
+
+#include "dest_table.h"
+#include "netutils.h"
+
+struct dest_table {
+    struct dest_entry *slots;
+    size_t mask;  /* Slot count - 1, the count is a power of two, at least 2. */
+    uint64_t lookups;
+    uint64_t misses;
+};
+
+static size_t dest_header_size(const uint8_t *data, size_t len) {
+    switch ((enum SOCKS5_ADDRTYPE)data[0]) {
+    case SOCKS5_ADDRTYPE_IPV4:
+        return 1 + sizeof(struct in_addr) + 2;
+    case SOCKS5_ADDRTYPE_IPV6:
+        return 1 + sizeof(struct in6_addr) + 2;
+    case SOCKS5_ADDRTYPE_DOMAINNAME:
+        return (len >= 2) ? (size_t)(1 + 1 + data[1] + 2) : 0;
+    default:
+        break;
+    }
+    return 0;
+}
+
+static uint32_t dest_header_hash(const uint8_t *data, size_t len) {
+    uint32_t hash = 2166136261u;
+    size_t i;
+    for (i = 0; i < len; ++i) {
+        hash = (hash ^ data[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static bool dest_entry_fill(struct dest_entry *entry, const uint8_t *data, size_t size) {
+    struct dest_entry fresh = { { 0 } };
+
+    if (socks5_address_parse(data, size, &fresh.address) == false) {
+        return false;
+    }
+    memcpy(fresh.header, data, size);
+    fresh.header_len = size;
+
+    if (socks5_address_to_universal(&fresh.address, &fresh.target)) {
+        fresh.has_target = true;
+    } else {
+        const char *host = fresh.address.addr.domainname;
+        uint16_t port = fresh.address.port;
+        if (uv_ip4_addr(host, port, &fresh.target.addr4) == 0 ||
+            uv_ip6_addr(host, port, &fresh.target.addr6) == 0) {
+            fresh.has_target = true;
+        }
+    }
+    fresh.valid = fresh.has_target ||
+        validate_hostname(fresh.address.addr.domainname, strlen(fresh.address.addr.domainname));
+
+    *entry = fresh;
+    return true;
+}
+
+struct dest_table * dest_table_create(size_t capacity) {
+    struct dest_table *table = (struct dest_table *)calloc(1, sizeof(*table));
+    size_t count = 2;
+    while (count < capacity) {
+        count <<= 1;
+    }
+    table->slots = (struct dest_entry *)calloc(count, sizeof(table->slots[0]));
+    table->mask = count - 1;
+    return table;
+}
+
+void dest_table_destroy(struct dest_table *table) {
+    if (table == NULL) {
+        return;
+    }
+    free(table->slots);
+    free(table);
+}
+
+const struct dest_entry * dest_table_intern(struct dest_table *table, const uint8_t *data, size_t len) {
+    struct dest_entry *set, *victim;
+    size_t size, i;
+
+    if (table == NULL || data == NULL || len == 0) {
+        return NULL;
+    }
+    size = dest_header_size(data, len);
+    if (size == 0 || size > len) {
+        return NULL;
+    }
+    table->lookups++;
+
+    set = &table->slots[dest_header_hash(data, size) & table->mask & ~(size_t)1];
+    for (i = 0; i < 2; ++i) {
+        if (set[i].header_len == size && memcmp(set[i].header, data, size) == 0) {
+            set[i].hits++;
+            return &set[i];
+        }
+    }
+
+    table->misses++;
+    victim = (set[0].hits <= set[1].hits) ? &set[0] : &set[1];
+    if (dest_entry_fill(victim, data, size) == false) {
+        return NULL;
+    }
+    victim->hits = 1;
+    if (victim == &set[0]) {
+        set[1].hits >>= 1;
+    } else {
+        set[0].hits >>= 1;
+    }
+    return victim;
+}
+
+void dest_table_stats(const struct dest_table *table, uint64_t *lookups, uint64_t *misses) {
+    if (lookups) {
+        *lookups = table ? table->lookups : 0;
+    }
+    if (misses) {
+        *misses = table ? table->misses : 0;
+    }
+}
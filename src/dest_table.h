@@ -0,0 +1,41 @@
+#if !defined(__dest_table_h__)
+#define __dest_table_h__ 1
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "sockaddr_universal.h"
+
+#define DEST_HEADER_MAX (1 + 1 + 0xFF + 2)  /* ATYP, name length, name, port. */
+
+/* Slots per table, about 600 bytes each. */
+#ifndef DEST_TABLE_DEFAULT_SIZE
+#define DEST_TABLE_DEFAULT_SIZE 1024
+#endif
+
+struct dest_entry {
+    uint8_t header[DEST_HEADER_MAX];  /* Canonical wire form, the lookup key. */
+    size_t header_len;
+    struct socks5_address address;
+    bool valid;       /* An address, or a host name that passed validate_hostname. */
+    bool has_target;  /* |target| is ready to connect, no resolver needed. */
+    union sockaddr_universal target;
+    uint64_t hits;
+};
+
+struct dest_table;
+
+/*
+ * Bounded cache of the destination headers seen on the wire, two-way set
+ * associative. A header that is already interned skips parsing, host name
+ * validation and literal address conversion. On a miss the colder of the
+ * two slots is replaced and the survivor's count halved, so once popular
+ * destinations age out. Entries are only valid until the next intern call.
+ */
+struct dest_table * dest_table_create(size_t capacity);
+void dest_table_destroy(struct dest_table *table);
+const struct dest_entry * dest_table_intern(struct dest_table *table, const uint8_t *data, size_t len);
+void dest_table_stats(const struct dest_table *table, uint64_t *lookups, uint64_t *misses);
+
+#endif // !defined(__dest_table_h__)
@@ -2,6 +2,10 @@
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <uv.h>
 
 #include "dump_info.h"
 
@@ -29,40 +33,225 @@ void set_dump_info_callback(void(*callback)(const char *info, void *p), void *p)
     info_callback_p = p;
 }
 
-static void pr_do(FILE *stream, const char *label, const char *fmt, va_list ap);
+static void pr_do(FILE *stream, const char *label, bool dedup, const char *fmt, va_list ap);
+static void pr_limited(FILE *stream, const char *label, const void *key, const char *fmt, va_list ap);
+static void pr_emit(FILE *stream, const char *label, const char *fmt, ...) ATTRIBUTE_FORMAT_PRINTF(3, 4);
+static bool pr_site_allow(FILE *stream, const char *label, const void *key, const char *fmt, unsigned long *suppressed);
+
+//
+// The rate-limit and repeat state is shared, and an embedding application
+// may log from its own threads besides the loop thread.
+//
+static uv_once_t pr_lock_once = UV_ONCE_INIT;
+static uv_mutex_t pr_lock;
+
+static void pr_lock_init(void) {
+    uv_mutex_init(&pr_lock);
+}
+
+static void pr_lock_acquire(void) {
+    uv_once(&pr_lock_once, pr_lock_init);
+    uv_mutex_lock(&pr_lock);
+}
+
+static void pr_lock_release(void) {
+    uv_mutex_unlock(&pr_lock);
+}
+
+static enum dump_level dump_level_current = dump_level_info;
+
+void set_dump_level(enum dump_level level) {
+    dump_level_current = level;
+}
 
 void pr_info(const char *fmt, ...) {
     va_list ap;
+    if (dump_level_current < dump_level_info) {
+        return;
+    }
     va_start(ap, fmt);
-    pr_do(stdout, "info", fmt, ap);
+    pr_lock_acquire();
+    pr_do(stdout, "info", false, fmt, ap);
+    pr_lock_release();
     va_end(ap);
 }
 
 void pr_warn(const char *fmt, ...) {
     va_list ap;
+    if (dump_level_current < dump_level_warn) {
+        return;
+    }
     va_start(ap, fmt);
-    pr_do(stderr, "warn", fmt, ap);
+    pr_limited(stderr, "warn", fmt, fmt, ap);
     va_end(ap);
 }
 
 void pr_err(const char *fmt, ...) {
     va_list ap;
+    if (dump_level_current < dump_level_err) {
+        return;
+    }
+    va_start(ap, fmt);
+    pr_limited(stderr, "error", fmt, fmt, ap);
+    va_end(ap);
+}
+
+void pr_err_keyed(const void *key, const char *fmt, ...) {
+    va_list ap;
+    if (dump_level_current < dump_level_err) {
+        return;
+    }
     va_start(ap, fmt);
-    pr_do(stderr, "error", fmt, ap);
+    pr_limited(stderr, "error", key, fmt, ap);
     va_end(ap);
 }
 
-static void pr_do(FILE *stream, const char *label, const char *fmt, va_list ap) {
-    static const int size = 1024;
-    char *fmtbuf = (char *) calloc(size, sizeof(fmtbuf[0]));
-    vsnprintf(fmtbuf, size, fmt, ap);
+static void pr_limited(FILE *stream, const char *label, const void *key, const char *fmt, va_list ap) {
+    unsigned long suppressed = 0;
+    pr_lock_acquire();
+    if (pr_site_allow(stream, label, key, fmt, &suppressed)) {
+        if (suppressed) {
+            pr_emit(stream, label, "%lu similar messages suppressed", suppressed);
+        }
+        pr_do(stream, label, true, fmt, ap);
+    }
+    pr_lock_release();
+}
+
+//
+// Every call site, identified by its format string or by the key passed to
+// pr_err_keyed(), gets a token bucket so that a flood of identical errors
+// costs a hash lookup instead of a write. Once all slots are taken, further
+// call sites are not rate-limited.
+//
+#define PR_SITE_SLOTS       64
+#define PR_SITE_BURST       10
+#define PR_SITE_PER_SECOND  2
+
+struct pr_site {
+    const void *key;
+    const char *fmt;
+    FILE *stream;
+    const char *label;
+    time_t stamp;
+    unsigned int tokens;
+    unsigned long suppressed;
+};
+
+static struct pr_site pr_sites[PR_SITE_SLOTS];
+
+static struct pr_site * pr_site_find(const void *key, const char *fmt) {
+    size_t index = (size_t)(((uintptr_t)key >> 3) % PR_SITE_SLOTS);
+    size_t i;
+    for (i = 0; i < PR_SITE_SLOTS; ++i) {
+        struct pr_site *site = &pr_sites[(index + i) % PR_SITE_SLOTS];
+        if (site->key == key) {
+            return site;
+        }
+        if (site->key == NULL) {
+            site->key = key;
+            site->fmt = fmt;
+            site->stamp = time(NULL);
+            site->tokens = PR_SITE_BURST;
+            return site;
+        }
+    }
+    return NULL;
+}
+
+static bool pr_site_allow(FILE *stream, const char *label, const void *key, const char *fmt, unsigned long *suppressed) {
+    struct pr_site *site = pr_site_find(key, fmt);
+    time_t now = time(NULL);
+
+    if (site == NULL) {
+        return true;
+    }
+    if (now > site->stamp) {
+        unsigned long refill = (unsigned long)(now - site->stamp) * PR_SITE_PER_SECOND;
+        site->tokens = (unsigned int)((site->tokens + refill > PR_SITE_BURST) ? PR_SITE_BURST : site->tokens + refill);
+        site->stamp = now;
+    }
+
+    if (site->tokens == 0) {
+        site->stream = stream;
+        site->label = label;
+        site->suppressed++;
+        return false;
+    }
+    site->tokens--;
+    *suppressed = site->suppressed;
+    site->suppressed = 0;
+    return true;
+}
+
+#define PR_MSG_SIZE 1024
+
+static char pr_last_msg[PR_MSG_SIZE] = { 0 };
+static FILE *pr_last_stream = NULL;
+static const char *pr_last_label = NULL;
+static unsigned long pr_last_repeat = 0;
+
+static void pr_write(FILE *stream, const char *label, const char *msg) {
     if (info_callback) {
-        char *p = (char *) calloc(size * 2, sizeof(*p));
-        sprintf(p, "%s:%s: %s\n", get_app_name(), label, fmtbuf);
+        char p[PR_MSG_SIZE * 2] = { 0 };
+        snprintf(p, sizeof(p), "%s:%s: %s\n", get_app_name(), label, msg);
         info_callback(p, info_callback_p);
-        free(p);
     } else {
-        fprintf(stream, "%s:%s: %s\n", get_app_name(), label, fmtbuf);
+        fprintf(stream, "%s:%s: %s\n", get_app_name(), label, msg);
+    }
+}
+
+static void pr_flush_repeat(void) {
+    char note[64] = { 0 };
+    if (pr_last_repeat == 0) {
+        return;
+    }
+    snprintf(note, sizeof(note), "last message repeated %lu times", pr_last_repeat);
+    pr_write(pr_last_stream, pr_last_label, note);
+    pr_last_repeat = 0;
+}
+
+static void pr_do(FILE *stream, const char *label, bool dedup, const char *fmt, va_list ap) {
+    char fmtbuf[PR_MSG_SIZE] = { 0 };
+    vsnprintf(fmtbuf, sizeof(fmtbuf), fmt, ap);
+
+    if (dedup && pr_last_label == label && strcmp(fmtbuf, pr_last_msg) == 0) {
+        pr_last_repeat++;
+        return;
+    }
+    pr_flush_repeat();
+    if (dedup) {
+        strcpy(pr_last_msg, fmtbuf);
+        pr_last_stream = stream;
+        pr_last_label = label;
+    } else {
+        pr_last_label = NULL;
+    }
+
+    pr_write(stream, label, fmtbuf);
+}
+
+static void pr_emit(FILE *stream, const char *label, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    pr_do(stream, label, true, fmt, ap);
+    va_end(ap);
+}
+
+/* Write out the counts still held back, so they are not lost on exit. */
+void pr_flush(void) {
+    size_t i;
+    pr_lock_acquire();
+    pr_flush_repeat();
+    pr_last_label = NULL;
+    for (i = 0; i < PR_SITE_SLOTS; ++i) {
+        struct pr_site *site = &pr_sites[i];
+        if (site->key && site->suppressed) {
+            char note[PR_MSG_SIZE] = { 0 };
+            snprintf(note, sizeof(note), "%lu similar messages suppressed: %s", site->suppressed, site->fmt);
+            pr_write(site->stream, site->label, note);
+            site->suppressed = 0;
+        }
     }
-    free(fmtbuf);
+    pr_lock_release();
 }
@@ -5,6 +5,14 @@ void set_app_name(const char *name);
 const char *get_app_name(void);
 void set_dump_info_callback(void(*callback)(const char *info, void *p), void *p);
 
+enum dump_level {
+    dump_level_none,
+    dump_level_err,
+    dump_level_warn,
+    dump_level_info,
+};
+void set_dump_level(enum dump_level level);
+
 #if defined(__GNUC__)
 # define ATTRIBUTE_FORMAT_PRINTF(a, b) __attribute__((format(printf, a, b)))
 #else
@@ -13,6 +21,9 @@ void set_dump_info_callback(void(*callback)(const char *info, void *p), void *p)
 void pr_info(const char *fmt, ...) ATTRIBUTE_FORMAT_PRINTF(1, 2);
 void pr_warn(const char *fmt, ...) ATTRIBUTE_FORMAT_PRINTF(1, 2);
 void pr_err(const char *fmt, ...) ATTRIBUTE_FORMAT_PRINTF(1, 2);
+/* pr_err() for a shared format, rate-limited per |key| (a string literal) instead. */
+void pr_err_keyed(const void *key, const char *fmt, ...) ATTRIBUTE_FORMAT_PRINTF(2, 3);
+void pr_flush(void);
 
 #if !defined(NDEBUG)
 #define PRINT_INFO(format, ...) \
@@ -51,6 +51,9 @@ typedef EVP_MD digest_type_t;
 #include <mbedtls/ctr_drbg.h>
 #include <mbedtls/version.h>
 #include <mbedtls/aes.h>
+#if defined(MBEDTLS_CHACHA20_C)
+#include <mbedtls/chacha20.h>
+#endif
 #define CIPHER_UNSUPPORTED "unsupported"
 
 #include <time.h>
@@ -78,6 +81,7 @@ typedef mbedtls_md_info_t digest_type_t;
 #endif
 
 #include <sodium.h>
+#include <time.h>
 
 #ifndef __MINGW32__
 #include <arpa/inet.h>
@@ -181,6 +185,204 @@ size_t ss_max_key_length(void) {
     return MAX_KEY_LENGTH;
 }
 
+#if defined(USE_CRYPTO_OPENSSL)
+#define CRYPTO_LIBRARY_NAME "OpenSSL"
+#elif defined(USE_CRYPTO_MBEDTLS)
+#define CRYPTO_LIBRARY_NAME "mbed TLS"
+#endif
+
+/*
+ * Stream cipher backends. libsodium does salsa20 / chacha20 and picks its own
+ * SIMD code at sodium_init(); the linked TLS library may also do chacha20-ietf.
+ * The first use of a method checks every candidate against a known answer
+ * and keeps the fastest one that passes.
+ */
+typedef int (*stream_xor_ic_fn)(uint8_t *c, const uint8_t *m, uint64_t mlen,
+                                const uint8_t *n, uint64_t ic, const uint8_t *k);
+
+struct stream_backend {
+    const char *name;
+    enum ss_cipher_type method;
+    stream_xor_ic_fn xor_ic;
+};
+
+static int
+sodium_salsa20_xor_ic(uint8_t *c, const uint8_t *m, uint64_t mlen,
+                      const uint8_t *n, uint64_t ic, const uint8_t *k)
+{
+    return crypto_stream_salsa20_xor_ic(c, m, mlen, n, ic, k);
+}
+
+static int
+sodium_chacha20_xor_ic(uint8_t *c, const uint8_t *m, uint64_t mlen,
+                       const uint8_t *n, uint64_t ic, const uint8_t *k)
+{
+    return crypto_stream_chacha20_xor_ic(c, m, mlen, n, ic, k);
+}
+
+static int
+sodium_chacha20_ietf_xor_ic(uint8_t *c, const uint8_t *m, uint64_t mlen,
+                            const uint8_t *n, uint64_t ic, const uint8_t *k)
+{
+    return crypto_stream_chacha20_ietf_xor_ic(c, m, mlen, n, (uint32_t)ic, k);
+}
+
+#if defined(USE_CRYPTO_OPENSSL) && OPENSSL_VERSION_NUMBER >= 0x10100000L && !defined(OPENSSL_NO_CHACHA)
+#define HAVE_LIBRARY_CHACHA20_IETF 1
+static int
+library_chacha20_ietf_xor_ic(uint8_t *c, const uint8_t *m, uint64_t mlen,
+                             const uint8_t *n, uint64_t ic, const uint8_t *k)
+{
+    // EVP_chacha20 takes a 32-bit little-endian block counter followed by the 96-bit nonce.
+    uint8_t iv[16];
+    int out_len = 0;
+    int ret = -1;
+    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+    iv[0] = (uint8_t)ic;
+    iv[1] = (uint8_t)(ic >> 8);
+    iv[2] = (uint8_t)(ic >> 16);
+    iv[3] = (uint8_t)(ic >> 24);
+    memcpy(iv + 4, n, 12);
+    if (ctx && EVP_EncryptInit_ex(ctx, EVP_chacha20(), NULL, k, iv) == 1 &&
+        EVP_EncryptUpdate(ctx, c, &out_len, m, (int)mlen) == 1) {
+        ret = 0;
+    }
+    EVP_CIPHER_CTX_free(ctx);
+    return ret;
+}
+#elif defined(USE_CRYPTO_MBEDTLS) && defined(MBEDTLS_CHACHA20_C)
+#define HAVE_LIBRARY_CHACHA20_IETF 1
+static int
+library_chacha20_ietf_xor_ic(uint8_t *c, const uint8_t *m, uint64_t mlen,
+                             const uint8_t *n, uint64_t ic, const uint8_t *k)
+{
+    return mbedtls_chacha20_crypt(k, n, (uint32_t)ic, (size_t)mlen, m, c);
+}
+#endif
+
+static const struct stream_backend stream_backends[] = {
+    { "libsodium", ss_cipher_salsa20, &sodium_salsa20_xor_ic, },
+    { "libsodium", ss_cipher_chacha20, &sodium_chacha20_xor_ic, },
+    { "libsodium", ss_cipher_chacha20ietf, &sodium_chacha20_ietf_xor_ic, },
+#if defined(HAVE_LIBRARY_CHACHA20_IETF)
+    { CRYPTO_LIBRARY_NAME, ss_cipher_chacha20ietf, &library_chacha20_ietf_xor_ic, },
+#endif
+};
+
+#define STREAM_KAT_LEN 72  /* Crosses a block boundary. */
+
+/* Key 00..1f, counter 1, nonce 01 02 .., message m[i] = i * 7. */
+static const uint8_t stream_kat_salsa20[STREAM_KAT_LEN] = {
+    0x09,0xad,0xba,0xd6,0xcc,0x12,0x6c,0x4b,0x8a,0x79,0xe3,0x3e,0x7f,0x95,0x39,0x45,
+    0x38,0x15,0x3d,0xc2,0xd4,0x8a,0xfc,0xca,0x51,0x09,0x2e,0x44,0xc9,0xf7,0x64,0x92,
+    0xab,0xaf,0xc0,0xab,0x11,0x4e,0x09,0x32,0xff,0xc9,0x72,0xa0,0x00,0x7e,0xaf,0xd3,
+    0x1d,0xe5,0x6c,0x0a,0x78,0xae,0xb1,0x2d,0x66,0x1f,0x5c,0x76,0x9e,0x21,0xf9,0x6f,
+    0xa0,0x36,0x2f,0x87,0x5a,0x99,0xcf,0xa2,
+};
+static const uint8_t stream_kat_chacha20[STREAM_KAT_LEN] = {
+    0xef,0xe1,0xab,0xed,0xb9,0xaf,0x82,0xad,0x28,0x80,0xae,0x9b,0xde,0xb7,0x45,0x37,
+    0xe5,0xfb,0x1a,0xd4,0x90,0xde,0xb2,0xbd,0xb3,0x7a,0x82,0x5f,0xa8,0x23,0x77,0x5c,
+    0xd7,0xf7,0xe1,0x78,0x96,0x6c,0x5c,0x9e,0x65,0x06,0xa1,0x23,0xee,0x42,0xac,0xfb,
+    0x1e,0xd7,0xc4,0x1a,0x07,0x6d,0x8d,0x83,0x4f,0x0b,0xac,0xe1,0xb5,0xcc,0x62,0x54,
+    0xef,0x11,0x14,0x02,0xee,0x89,0xaa,0xaa,
+};
+static const uint8_t stream_kat_chacha20ietf[STREAM_KAT_LEN] = {
+    0x64,0x8f,0x4a,0x7f,0x15,0x71,0x8e,0x82,0x70,0xd6,0x03,0x0a,0x80,0xfa,0xee,0x67,
+    0xce,0x8b,0xed,0x1b,0xca,0x1a,0x25,0xea,0xd3,0x72,0x1a,0x74,0x82,0x24,0x3d,0xec,
+    0xf8,0x5c,0x67,0x5d,0x64,0x31,0x2b,0xeb,0x5f,0xa9,0x6c,0xf5,0x52,0x81,0xd7,0x79,
+    0x97,0x10,0xbd,0x8f,0x17,0x42,0x46,0x7a,0x39,0xfb,0xa1,0x85,0xb4,0x97,0xb7,0x6a,
+    0x2f,0x65,0xde,0x65,0x28,0x4e,0x18,0xc2,
+};
+
+#define STREAM_BENCH_SIZE   (16 * 1024)
+#define STREAM_BENCH_ROUNDS 64
+
+static char *preferred_backend = NULL;
+static const struct stream_backend *selected_backends[ss_cipher_max] = { NULL };
+
+void
+ss_crypto_backend_prefer(const char *name)
+{
+    free(preferred_backend);
+    preferred_backend = (name && strlen(name)) ? strdup(name) : NULL;
+    memset(selected_backends, 0, sizeof(selected_backends));
+}
+
+static bool
+stream_backend_verify(const struct stream_backend *backend)
+{
+    uint8_t key[32], nonce[12], msg[STREAM_KAT_LEN], out[STREAM_KAT_LEN];
+    const uint8_t *expected;
+    size_t i;
+
+    switch (backend->method) {
+    case ss_cipher_salsa20: expected = stream_kat_salsa20; break;
+    case ss_cipher_chacha20: expected = stream_kat_chacha20; break;
+    case ss_cipher_chacha20ietf: expected = stream_kat_chacha20ietf; break;
+    default: return false;
+    }
+    for (i = 0; i < sizeof(key); ++i) { key[i] = (uint8_t)i; }
+    for (i = 0; i < sizeof(nonce); ++i) { nonce[i] = (uint8_t)(i + 1); }
+    for (i = 0; i < sizeof(msg); ++i) { msg[i] = (uint8_t)(i * 7); }
+
+    if (backend->xor_ic(out, msg, sizeof(msg), nonce, 1, key) != 0) {
+        return false;
+    }
+    return memcmp(out, expected, sizeof(out)) == 0;
+}
+
+static clock_t
+stream_backend_bench(const struct stream_backend *backend, uint8_t *buf)
+{
+    uint8_t key[32] = { 0 }, nonce[12] = { 0 };
+    clock_t start = clock();
+    int i;
+    for (i = 0; i < STREAM_BENCH_ROUNDS; ++i) {
+        backend->xor_ic(buf, buf, STREAM_BENCH_SIZE, nonce, (uint64_t)i, key);
+    }
+    return clock() - start;
+}
+
+static const struct stream_backend *
+stream_backend_of(enum ss_cipher_type method)
+{
+    const struct stream_backend *best = NULL;
+    clock_t best_time = 0;
+    uint8_t *buf;
+    size_t i;
+
+    if (selected_backends[method]) {
+        return selected_backends[method];
+    }
+    buf = (uint8_t *)calloc(STREAM_BENCH_SIZE, sizeof(uint8_t));
+    for (i = 0; i < sizeof(stream_backends) / sizeof(stream_backends[0]); ++i) {
+        const struct stream_backend *backend = &stream_backends[i];
+        clock_t elapsed;
+        if (backend->method != method) {
+            continue;
+        }
+        if (stream_backend_verify(backend) == false) {
+            LOGE("%s %s failed its known answer test", backend->name, ss_cipher_name_of_type(method));
+            continue;
+        }
+        if (preferred_backend && strcmp(preferred_backend, backend->name) == 0) {
+            best = backend;
+            break;
+        }
+        elapsed = stream_backend_bench(backend, buf);
+        if (best == NULL || elapsed < best_time) {
+            best = backend;
+            best_time = elapsed;
+        }
+    }
+    free(buf);
+    if (best == NULL) {
+        FATAL("No working implementation of the cipher");
+    }
+    selected_backends[method] = best;
+    return best;
+}
+
 static int
 crypto_stream_xor_ic(uint8_t *c, const uint8_t *m, uint64_t mlen,
                      const uint8_t *n, uint64_t ic, const uint8_t *k,
@@ -188,11 +390,9 @@ crypto_stream_xor_ic(uint8_t *c, const uint8_t *m, uint64_t mlen,
 {
     switch (method) {
     case ss_cipher_salsa20:
-        return crypto_stream_salsa20_xor_ic(c, m, mlen, n, ic, k);
     case ss_cipher_chacha20:
-        return crypto_stream_chacha20_xor_ic(c, m, mlen, n, ic, k);
     case ss_cipher_chacha20ietf:
-        return crypto_stream_chacha20_ietf_xor_ic(c, m, mlen, n, (uint32_t)ic, k);
+        return stream_backend_of(method)->xor_ic(c, m, mlen, n, ic, k);
     default:
         break;
     }
@@ -1070,6 +1270,10 @@ const uint8_t * enc_ctx_get_iv(const struct enc_ctx *ctx) {
     return ctx->cipher_ctx.iv;
 }
 
+bool enc_ctx_has_iv(const struct enc_ctx *ctx) {
+    return ctx->init != 0;
+}
+
 struct enc_ctx *
 enc_ctx_new_instance(struct cipher_env_t *env, bool encrypt)
 {
@@ -1224,6 +1428,20 @@ enum ss_cipher_type cipher_env_enc_method(const struct cipher_env_t *env) {
     return env->enc_method;
 }
 
+const char * cipher_env_backend_name(const struct cipher_env_t *env) {
+    switch (env->enc_method) {
+    case ss_cipher_salsa20:
+    case ss_cipher_chacha20:
+    case ss_cipher_chacha20ietf:
+        return stream_backend_of(env->enc_method)->name;
+    case ss_cipher_none:
+    case ss_cipher_table:
+        return "built-in";
+    default:
+        return CRYPTO_LIBRARY_NAME;
+    }
+}
+
 void
 cipher_env_release(struct cipher_env_t *env)
 {
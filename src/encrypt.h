@@ -78,9 +78,12 @@ int ss_decrypt(struct cipher_env_t* env, struct buffer_t *ciphertext, struct enc
 
 struct cipher_env_t * cipher_env_new_instance(const char *pass, const char *method);
 enum ss_cipher_type cipher_env_enc_method(const struct cipher_env_t *env);
+const char * cipher_env_backend_name(const struct cipher_env_t *env);
+void ss_crypto_backend_prefer(const char *name);
 void cipher_env_release(struct cipher_env_t *env);
 
 const uint8_t * enc_ctx_get_iv(const struct enc_ctx *ctx);
+bool enc_ctx_has_iv(const struct enc_ctx *ctx);
 
 struct enc_ctx * enc_ctx_new_instance(struct cipher_env_t *env, bool encrypt);
 void enc_ctx_release_instance(struct cipher_env_t* env, struct enc_ctx *ctx);
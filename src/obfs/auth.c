@@ -44,6 +44,7 @@ typedef struct _auth_simple_local_data {
     int max_time_dif;
     uint32_t client_id;
     uint32_t connection_id;
+    size_t recv_need;  // bytes missing from the frame being reassembled, 0 if unknown
 } auth_simple_local_data;
 
 void
@@ -67,6 +68,13 @@ auth_simple_local_data_init(auth_simple_local_data* local)
         local->extra_wait_size = (size_t) (extra_wait_size % 1024);
     }
     local->max_time_dif = 60 * 60 * 24;
+    local->recv_need = 0;
+}
+
+static size_t auth_simple_get_recv_need(struct obfs_t *obfs, size_t inner_need) {
+    auth_simple_local_data *local = (auth_simple_local_data*)obfs->l_data;
+    (void)inner_need;
+    return local->recv_need;
 }
 
 void *
@@ -137,6 +145,7 @@ struct obfs_t * auth_sha1_v4_new_obfs(void) {
 
     obfs->init_data = auth_simple_init_data;
     obfs->get_overhead = get_overhead;
+    obfs->get_recv_need = auth_simple_get_recv_need;
     obfs->need_feedback = need_feedback_true;
     obfs->get_server_info = get_server_info;
     obfs->set_server_info = set_server_info;
@@ -159,6 +168,7 @@ struct obfs_t * auth_aes128_md5_new_obfs(void) {
 
     obfs->init_data = auth_simple_init_data;
     obfs->get_overhead = auth_aes128_sha1_get_overhead;
+    obfs->get_recv_need = auth_simple_get_recv_need;
     obfs->need_feedback = need_feedback_true;
     obfs->get_server_info = get_server_info;
     obfs->set_server_info = set_server_info;
@@ -211,6 +221,7 @@ auth_aes128_sha1_get_overhead(struct obfs_t *obfs)
 static struct buffer_t * auth_aes128_not_match_return(struct obfs_t *obfs, struct buffer_t *buf, bool *feedback) {
     auth_simple_local_data *local = (auth_simple_local_data*)obfs->l_data;
     obfs->server.overhead = 0;
+    obfs->rejected = true;
     if (feedback) { *feedback = false; }
     if (local->salt && strlen(local->salt)) {
         struct buffer_t *ret = buffer_alloc(SSR_BUFF_SIZE);
@@ -776,6 +787,7 @@ auth_sha1_v4_client_post_decrypt(struct obfs_t *obfs, char **pplaindata, int dat
     out_buffer = (char*)malloc((size_t)local->recv_buffer->len);
     buffer = out_buffer;
     error = 0;
+    local->recv_need = 0;
     while (local->recv_buffer->len > 4) {
         int length;
         int pos;
@@ -793,6 +805,7 @@ auth_sha1_v4_client_post_decrypt(struct obfs_t *obfs, char **pplaindata, int dat
             break;
         }
         if (length > local->recv_buffer->len) {
+            local->recv_need = (size_t)length - local->recv_buffer->len;
             break;
         }
         if (checkadler32((unsigned char*)recv_buffer, (unsigned int)length) == false) {
@@ -852,6 +865,7 @@ struct buffer_t * auth_sha1_v4_server_post_decrypt(struct obfs_t *obfs, struct b
     struct buffer_t *out_buf = buffer_alloc(SSR_BUFF_SIZE);
     do {
         buffer_concatenate2(local->recv_buffer, buf);
+        local->recv_need = 0;
         if (local->has_recv_header == false) {
             uint8_t *buffer = local->recv_buffer->buffer;
             struct buffer_t *crc_src;
@@ -952,6 +966,7 @@ struct buffer_t * auth_sha1_v4_server_post_decrypt(struct obfs_t *obfs, struct b
                 break;
             }
             if (length > local->recv_buffer->len) {
+                local->recv_need = length - local->recv_buffer->len;
                 break;
             }
             if (checkadler32(buffer, length) == false) {
@@ -1237,6 +1252,7 @@ auth_aes128_sha1_client_post_decrypt(struct obfs_t *obfs, char **pplaindata, int
 
     out_buffer = (char*)malloc((size_t)local->recv_buffer->len);
     buffer = out_buffer;
+    local->recv_need = 0;
     while (local->recv_buffer->len > 4) {
         int length;
         int pos;
@@ -1263,6 +1279,7 @@ auth_aes128_sha1_client_post_decrypt(struct obfs_t *obfs, char **pplaindata, int
             break;
         }
         if (length > local->recv_buffer->len) {
+            local->recv_need = (size_t)length - local->recv_buffer->len;
             break;
         }
 
@@ -1427,6 +1444,7 @@ struct buffer_t * auth_aes128_sha1_server_post_decrypt(struct obfs_t *obfs, stru
     bool sendback = false;
     auth_simple_local_data *local = (auth_simple_local_data*)obfs->l_data;
     buffer_concatenate2(local->recv_buffer, buf);
+    local->recv_need = 0;
     out_buf = buffer_alloc(SSR_BUFF_SIZE);
 
     mac_key = buffer_create_from(obfs->server.recv_iv, obfs->server.recv_iv_len);
@@ -1547,6 +1565,7 @@ struct buffer_t * auth_aes128_sha1_server_post_decrypt(struct obfs_t *obfs, stru
             return auth_aes128_not_match_return(obfs, local->recv_buffer, need_feedback);
         }
         if (length > local->recv_buffer->len) {
+            local->recv_need = length - local->recv_buffer->len;
             break;
         }
         {
@@ -16,7 +16,9 @@
 void auth_chain_a_dispose(struct obfs_t *obfs);
 void * auth_chain_a_init_data(void);
 size_t auth_chain_a_get_overhead(struct obfs_t *obfs);
+size_t auth_chain_a_get_recv_need(struct obfs_t *obfs, size_t inner_need);
 void auth_chain_a_set_server_info(struct obfs_t *obfs, struct server_info_t *server);
+bool auth_chain_a_get_user_id(struct obfs_t *obfs, uint32_t *uid);
 
 size_t auth_chain_a_client_pre_encrypt(struct obfs_t *obfs, char **pplaindata, size_t datalength, size_t* capacity);
 ssize_t auth_chain_a_client_post_decrypt(struct obfs_t *obfs, char **pplaindata, int datalength, size_t* capacity);
@@ -175,6 +177,76 @@ struct auth_chain_c_context {
     void *subclass_context;
 };
 
+//
+// Plain RC4 keyed straight from the derived bytes. auth_chain only needs a
+// 16-byte key with no IV, so this stands in for cipher_env_new_instance(.., "rc4")
+// without the env, the IV cache or any heap allocation.
+//
+struct auth_chain_rc4_state {
+    uint8_t perm[256];
+    uint8_t index1;
+    uint8_t index2;
+};
+
+static void auth_chain_rc4_init(struct auth_chain_rc4_state *state, const uint8_t *key, size_t key_len) {
+    size_t i;
+    uint8_t j = 0;
+    uint8_t tmp;
+    for (i = 0; i < 256; ++i) {
+        state->perm[i] = (uint8_t)i;
+    }
+    for (i = 0; i < 256; ++i) {
+        j = (uint8_t)(j + state->perm[i] + key[i % key_len]);
+        tmp = state->perm[i];
+        state->perm[i] = state->perm[j];
+        state->perm[j] = tmp;
+    }
+    state->index1 = 0;
+    state->index2 = 0;
+}
+
+static void auth_chain_rc4_crypt(struct auth_chain_rc4_state *state, uint8_t *data, size_t len) {
+    size_t i;
+    uint8_t tmp;
+    for (i = 0; i < len; ++i) {
+        state->index1 = (uint8_t)(state->index1 + 1);
+        state->index2 = (uint8_t)(state->index2 + state->perm[state->index1]);
+        tmp = state->perm[state->index1];
+        state->perm[state->index1] = state->perm[state->index2];
+        state->perm[state->index2] = tmp;
+        data[i] ^= state->perm[(uint8_t)(state->perm[state->index1] + state->perm[state->index2])];
+    }
+}
+
+//
+// Same key as cipher_env_new_instance(password, "rc4") with the password
+// base64(user_key) + base64(hash).
+//
+static bool auth_chain_rc4_derive(const struct buffer_t *user_key, const uint8_t hash[16], struct auth_chain_rc4_state *state) {
+    char password[256] = { 0 };
+    uint8_t rc4_key[16];
+    int pos;
+
+    if ((size_t)std_base64_encode_len((int)user_key->len) + (size_t)std_base64_encode_len(16) > sizeof(password)) {
+        return false;
+    }
+    pos = std_base64_encode(user_key->buffer, (int)user_key->len, (unsigned char *)password);
+    pos += std_base64_encode(hash, 16, (unsigned char *)(password + pos));
+
+    bytes_to_key_with_size((uint8_t *)password, (size_t)pos, rc4_key, sizeof(rc4_key));
+    auth_chain_rc4_init(state, rc4_key, sizeof(rc4_key));
+    return true;
+}
+
+static bool auth_chain_udp_crypt(const struct buffer_t *user_key, const uint8_t hash[16], uint8_t *data, size_t len) {
+    struct auth_chain_rc4_state rc4;
+    if (auth_chain_rc4_derive(user_key, hash, &rc4) == false) {
+        return false;
+    }
+    auth_chain_rc4_crypt(&rc4, data, len);
+    return true;
+}
+
 struct auth_chain_a_context {
     struct obfs_t * obfs;
     int has_sent_header;
@@ -190,9 +262,9 @@ struct auth_chain_a_context {
     uint8_t last_server_hash[16];
     struct shift128plus_ctx random_client;
     struct shift128plus_ctx random_server;
-    struct cipher_env_t *cipher;
-    struct enc_ctx *encrypt_ctx;
-    struct enc_ctx *decrypt_ctx;
+    bool rc4_ready;
+    struct auth_chain_rc4_state encrypt_rc4;
+    struct auth_chain_rc4_state decrypt_rc4;
     uint32_t user_id_num;
     uint16_t client_over_head;
     size_t unit_len;
@@ -200,6 +272,12 @@ struct auth_chain_a_context {
     uint32_t client_id;
     uint32_t connection_id;
 
+    size_t frame_unit;        // payload bytes per frame, 0 means derive it from tcp_mss
+    size_t max_frame_len;     // largest payload + padding accepted from the peer
+    size_t recv_buffer_limit; // largest backlog the client side keeps while reassembling
+    size_t recv_need;         // bytes missing from the frame being reassembled, 0 if unknown
+    uint16_t padding_budget;  // announced by the client in the auth header, 0 is unbounded
+
     // rnd_data_len
     unsigned int (*get_tcp_rand_len)(struct auth_chain_a_context *local, int datalength, struct shift128plus_ctx *random, const uint8_t last_hash[16]);
     void *subclass_context;
@@ -215,15 +293,18 @@ void auth_chain_a_context_init(struct obfs_t *obfs, struct auth_chain_a_context
     local->user_key = buffer_alloc(SSR_BUFF_SIZE);
     memset(&local->random_client, 0, sizeof(local->random_client));
     memset(&local->random_server, 0, sizeof(local->random_server));
-    local->encrypt_ctx = NULL;
-    local->decrypt_ctx = NULL;
+    local->rc4_ready = false;
     local->get_tcp_rand_len = NULL;
     local->subclass_context = NULL;
     local->max_time_dif = 60 * 60 * 24; // time dif (second) setting
+    local->frame_unit = 0;
+    local->max_frame_len = 4096;
+    local->recv_buffer_limit = 16384;
 }
 
 unsigned int auth_chain_a_get_rand_len(struct auth_chain_a_context *local, int datalength, struct shift128plus_ctx *random, const uint8_t last_hash[16]);
 unsigned int get_rand_start_pos(int rand_len, struct shift128plus_ctx *random);
+unsigned int auth_chain_padding_limit(struct auth_chain_a_context *local, int datalength, uint32_t frame_id, unsigned int rand_len);
 
 int data_size_list_compare(const void *a, const void *b) {
     return (*(int *)a - *(int *)b);
@@ -250,9 +331,11 @@ struct obfs_t * auth_chain_a_new_obfs(void) {
 
     obfs->init_data = auth_chain_a_init_data;
     obfs->get_overhead = auth_chain_a_get_overhead;
+    obfs->get_recv_need = auth_chain_a_get_recv_need;
     obfs->need_feedback = need_feedback_true;
     obfs->get_server_info = get_server_info;
     obfs->set_server_info = auth_chain_a_set_server_info;
+    obfs->get_user_id = auth_chain_a_get_user_id;
     obfs->dispose = auth_chain_a_dispose;
 
     obfs->client_pre_encrypt = auth_chain_a_client_pre_encrypt;
@@ -270,15 +353,16 @@ size_t auth_chain_a_get_overhead(struct obfs_t *obfs) {
     return 4;
 }
 
+size_t auth_chain_a_get_recv_need(struct obfs_t *obfs, size_t inner_need) {
+    struct auth_chain_a_context *local = (struct auth_chain_a_context*)obfs->l_data;
+    (void)inner_need;
+    return local->recv_need;
+}
+
 void auth_chain_a_dispose(struct obfs_t *obfs) {
     struct auth_chain_a_context *local = (struct auth_chain_a_context*)obfs->l_data;
     buffer_free(local->recv_buffer);
     buffer_free(local->user_key);
-    if (local->cipher) {
-        enc_ctx_release_instance(local->cipher, local->encrypt_ctx);
-        enc_ctx_release_instance(local->cipher, local->decrypt_ctx);
-        cipher_env_release(local->cipher);
-    }
     free(local);
     obfs->l_data = NULL;
     dispose_obfs(obfs);
@@ -293,6 +377,15 @@ void auth_chain_a_set_server_info(struct obfs_t * obfs, struct server_info_t * s
     set_server_info(obfs, server);
 }
 
+bool auth_chain_a_get_user_id(struct obfs_t *obfs, uint32_t *uid) {
+    struct auth_chain_a_context *local = (struct auth_chain_a_context*)obfs->l_data;
+    if (local->has_recv_header == false) {
+        return false;
+    }
+    if (uid) { *uid = local->user_id_num; }
+    return true;
+}
+
 unsigned int auth_chain_a_get_rand_len(struct auth_chain_a_context *local, int datalength, struct shift128plus_ctx *random, const uint8_t last_hash[16]) {
     if (datalength > 1440) {
         return 0;
@@ -310,6 +403,29 @@ unsigned int auth_chain_a_get_rand_len(struct auth_chain_a_context *local, int d
     return shift128plus_next(random) % 1021;
 }
 
+// Frames of a connection that always get the full random padding.
+#define AUTH_CHAIN_PADDING_FULL_FRAMES  16
+// Frames shorter than this always get the full random padding.
+#define AUTH_CHAIN_PADDING_SMALL_FRAME  512
+
+//
+// Cap the padding of bulk frames to padding_budget percent of the payload.
+// The random stream is consumed exactly as before and the cap only depends
+// on values both ends know (length, frame id and the budget the client put
+// in the reserved bytes of its auth header), so the peers compute identical
+// lengths. Stock servers ignore those bytes, so a budget needs a server
+// from this tree.
+//
+unsigned int auth_chain_padding_limit(struct auth_chain_a_context *local, int datalength, uint32_t frame_id, unsigned int rand_len) {
+    unsigned int budget = local->padding_budget;
+    unsigned int limit;
+    if (budget == 0 || frame_id <= AUTH_CHAIN_PADDING_FULL_FRAMES || datalength < AUTH_CHAIN_PADDING_SMALL_FRAME) {
+        return rand_len;
+    }
+    limit = (unsigned int)((uint64_t)datalength * budget / 100);
+    return min(rand_len, limit);
+}
+
 struct buffer_t * auth_chain_a_rnd_data(struct obfs_t * obfs, 
     const struct buffer_t *buf, struct shift128plus_ctx *random, 
     const uint8_t last_hash[16])
@@ -317,9 +433,12 @@ struct buffer_t * auth_chain_a_rnd_data(struct obfs_t * obfs,
     struct auth_chain_a_context *local = (struct auth_chain_a_context *) obfs->l_data;
     struct server_info_t *server = &obfs->server;
     size_t rand_len = local->get_tcp_rand_len(local, (int) buf->len, random, last_hash);
-    struct buffer_t *rnd_data_buf = buffer_alloc(rand_len);
+    struct buffer_t *rnd_data_buf = NULL;
     struct buffer_t *ret = NULL;
 
+    rand_len = auth_chain_padding_limit(local, (int) buf->len, local->pack_id, (unsigned int) rand_len);
+    rnd_data_buf = buffer_alloc(rand_len);
+
     rand_bytes(rnd_data_buf->buffer, (int)rand_len);
     rnd_data_buf->len = rand_len;
 
@@ -375,11 +494,13 @@ unsigned int get_rand_start_pos(int rand_len, struct shift128plus_ctx *random) {
 }
 
 unsigned int get_client_rand_len(struct auth_chain_a_context *local, size_t datalength) {
-    return local->get_tcp_rand_len(local, (int)datalength, &local->random_client, local->last_client_hash);
+    unsigned int rand_len = local->get_tcp_rand_len(local, (int)datalength, &local->random_client, local->last_client_hash);
+    return auth_chain_padding_limit(local, (int)datalength, local->pack_id, rand_len);
 }
 
 unsigned int get_server_rand_len(struct auth_chain_a_context *local, int datalength) {
-    return local->get_tcp_rand_len(local, datalength, &local->random_server, local->last_server_hash);
+    unsigned int rand_len = local->get_tcp_rand_len(local, datalength, &local->random_server, local->last_server_hash);
+    return auth_chain_padding_limit(local, datalength, local->recv_id, rand_len);
 }
 
 size_t auth_chain_a_pack_client_data(struct obfs_t *obfs, char *data, size_t datalength, char *outdata) {
@@ -398,9 +519,8 @@ size_t auth_chain_a_pack_client_data(struct obfs_t *obfs, char *data, size_t dat
         rand_bytes(rnd_data, (int)rand_len);
         if (datalength > 0) {
             unsigned int start_pos = get_rand_start_pos((int)rand_len, &local->random_client);
-            size_t out_len;
-            ss_encrypt_buffer(local->cipher, local->encrypt_ctx,
-                    data, (size_t)datalength, &outdata[2 + start_pos], &out_len);
+            memcpy(&outdata[2 + start_pos], data, (size_t)datalength);
+            auth_chain_rc4_crypt(&local->encrypt_rc4, (uint8_t *)&outdata[2 + start_pos], (size_t)datalength);
             memcpy(outdata + 2, rnd_data, start_pos);
             memcpy(outdata + 2 + start_pos + datalength, rnd_data + start_pos, rand_len - start_pos);
         } else {
@@ -434,15 +554,8 @@ struct buffer_t * auth_chain_a_pack_server_data(struct obfs_t *obfs, const struc
     uint16_t length = 0;
     uint16_t length2 = 0;
 
-    {
-        size_t out_len = 0;
-        uint8_t *buffer = (uint8_t *)calloc(buf->len + 4, sizeof(uint8_t));
-        ss_encrypt_buffer(local->cipher, local->encrypt_ctx,
-            (char*)buf->buffer, (size_t)buf->len, 
-            (char *)buffer, &out_len);
-        in_buf = buffer_create_from(buffer, out_len);
-        free(buffer);
-    }
+    in_buf = buffer_clone(buf);
+    auth_chain_rc4_crypt(&local->encrypt_rc4, in_buf->buffer, in_buf->len);
 
     data = auth_chain_a_rnd_data(obfs, in_buf, &local->random_server, local->last_server_hash);
 
@@ -480,7 +593,6 @@ size_t auth_chain_a_pack_auth_data(struct obfs_t *obfs, char *data, size_t datal
     uint8_t key_len;
     uint8_t *key;
     time_t t;
-    char password[256] = {0};
 
     ++global->connection_id;
     if (global->connection_id > 0xFF000000) {
@@ -500,8 +612,9 @@ size_t auth_chain_a_pack_auth_data(struct obfs_t *obfs, char *data, size_t datal
     memintcopy_lt(encrypt + 8, global->connection_id);
     encrypt[12] = (uint8_t)server->overhead;
     encrypt[13] = (uint8_t)(server->overhead >> 8);
-    encrypt[14] = 0;
-    encrypt[15] = 0;
+    local->padding_budget = server->padding_budget;
+    encrypt[14] = (uint8_t)local->padding_budget;
+    encrypt[15] = (uint8_t)(local->padding_budget >> 8);
 
     // first 12 bytes
     {
@@ -568,11 +681,11 @@ size_t auth_chain_a_pack_auth_data(struct obfs_t *obfs, char *data, size_t datal
         memcpy(outdata + 12 + 20, local->last_server_hash, 4);
     }
 
-    std_base64_encode(local->user_key->buffer, (int)local->user_key->len, (unsigned char *)password);
-    std_base64_encode(local->last_client_hash, 16, (unsigned char *)(password + strlen(password)));
-    local->cipher = cipher_env_new_instance(password, "rc4");
-    local->encrypt_ctx = enc_ctx_new_instance(local->cipher, true);
-    local->decrypt_ctx = enc_ctx_new_instance(local->cipher, false);
+    local->rc4_ready = auth_chain_rc4_derive(local->user_key, local->last_client_hash, &local->encrypt_rc4);
+    if (local->rc4_ready == false) {
+        return 0;
+    }
+    local->decrypt_rc4 = local->encrypt_rc4;
 
     out_size += auth_chain_a_pack_client_data(obfs, data, datalength, outdata + out_size);
 
@@ -595,12 +708,21 @@ size_t auth_chain_a_client_pre_encrypt(struct obfs_t *obfs, char **pplaindata, s
             head_size = datalength;
         }
         pack_len = auth_chain_a_pack_auth_data(obfs, data, head_size, buffer);
+        if (pack_len == 0) {
+            free(out_buffer);
+            return 0;
+        }
         buffer += pack_len;
         data += head_size;
         len -= head_size;
         local->has_sent_header = 1;
     }
-    unit_size = server->tcp_mss - server->overhead;
+    if (len > 0 && local->rc4_ready == false) {
+        // Never send payload under a keystream that was not set up.
+        free(out_buffer);
+        return 0;
+    }
+    unit_size = local->frame_unit ? local->frame_unit : (size_t)(server->tcp_mss - server->overhead);
     while ( len > unit_size ) {
         pack_len = auth_chain_a_pack_client_data(obfs, data, unit_size, buffer);
         buffer += pack_len;
@@ -634,7 +756,7 @@ ssize_t auth_chain_a_client_post_decrypt(struct obfs_t *obfs, char **pplaindata,
     uint8_t * buffer;
     char error = 0;
 
-    if (local->recv_buffer->len + datalength > 16384) {
+    if (local->recv_buffer->len + datalength > local->recv_buffer_limit) {
         return -1;
     }
     buffer_concatenate(local->recv_buffer, plaindata, datalength);
@@ -645,6 +767,7 @@ ssize_t auth_chain_a_client_post_decrypt(struct obfs_t *obfs, char **pplaindata,
 
     out_buffer = (uint8_t *)malloc((size_t)local->recv_buffer->len);
     buffer = out_buffer;
+    local->recv_need = 0;
     while (local->recv_buffer->len > 4) {
         uint8_t hash[16];
         int data_len;
@@ -659,12 +782,13 @@ ssize_t auth_chain_a_client_post_decrypt(struct obfs_t *obfs, char **pplaindata,
         data_len = (int)(((unsigned)(recv_buffer[1] ^ local->last_server_hash[15]) << 8) + (recv_buffer[0] ^ local->last_server_hash[14]));
         rand_len = (int)get_server_rand_len(local, data_len);
         len = rand_len + data_len;
-        if (len >= (SSR_BUFF_SIZE * 2)) {
+        if (len >= (int)local->max_frame_len) {
             local->recv_buffer->len = 0;
             error = 1;
             break;
         }
         if ((len += 4) > local->recv_buffer->len) {
+            local->recv_need = (size_t)len - local->recv_buffer->len;
             break;
         }
         {
@@ -683,8 +807,9 @@ ssize_t auth_chain_a_client_post_decrypt(struct obfs_t *obfs, char **pplaindata,
         } else {
             pos = 2;
         }
-        ss_decrypt_buffer(local->cipher, local->decrypt_ctx,
-                (char*)recv_buffer + pos, (size_t)data_len, (char *)buffer, &out_len);
+        memmove(buffer, recv_buffer + pos, (size_t)data_len);
+        auth_chain_rc4_crypt(&local->decrypt_rc4, buffer, (size_t)data_len);
+        out_len = (size_t)data_len;
 
         if (local->recv_id == 1) {
             server->tcp_mss = (uint16_t)(buffer[0] | (buffer[1] << 8));
@@ -720,7 +845,6 @@ ssize_t auth_chain_a_client_udp_pre_encrypt(struct obfs_t *obfs, char **pplainda
     int rand_len;
     uint8_t *rnd_data;
     size_t outlength;
-    char password[256] = {0};
     uint8_t uid[4];
     int i = 0;
 
@@ -756,24 +880,11 @@ ssize_t auth_chain_a_client_udp_pre_encrypt(struct obfs_t *obfs, char **pplainda
     rand_bytes(rnd_data, (int)rand_len);
     outlength = datalength + rand_len + 8;
 
-    std_base64_encode(local->user_key->buffer, (int)local->user_key->len, (unsigned char *)password);
-    std_base64_encode(hash, 16, (unsigned char *)(password + strlen(password)));
-
-    {
-#if 1
-        BUFFER_CONSTANT_INSTANCE(in_obj, plaindata, datalength);
-        struct buffer_t *ret = cipher_simple_update_data(password, "rc4", true, in_obj);
-        memcpy(out_buffer, ret->buffer, ret->len);
-        buffer_free(ret);
-#else
-        struct cipher_env_t *cipher = cipher_env_new_instance(password, "rc4");
-        struct enc_ctx *ctx = enc_ctx_new_instance(cipher, true);
-        size_t out_len;
-        ss_encrypt_buffer(cipher, ctx,
-                plaindata, (size_t)datalength, out_buffer, &out_len);
-        enc_ctx_release_instance(cipher, ctx);
-        cipher_env_release(cipher);
-#endif
+    memcpy(out_buffer, plaindata, datalength);
+    if (auth_chain_udp_crypt(local->user_key, hash, out_buffer, datalength) == false) {
+        free(out_buffer);
+        free(rnd_data);
+        return 0;
     }
     for (i = 0; i < 4; ++i) {
         uid[i] = ((uint8_t)local->uid[i]) ^ hash[i];
@@ -806,7 +917,6 @@ ssize_t auth_chain_a_client_udp_post_decrypt(struct obfs_t *obfs, char **pplaind
     uint8_t hash[16];
     int rand_len;
     size_t outlength;
-    char password[256] = {0};
 
     if (datalength <= 8) {
         return 0;
@@ -827,24 +937,8 @@ ssize_t auth_chain_a_client_udp_post_decrypt(struct obfs_t *obfs, char **pplaind
     rand_len = (int)udp_get_rand_len(&local->random_server, hash);
     outlength = datalength - rand_len - 8;
 
-    std_base64_encode(local->user_key->buffer, (int)local->user_key->len, (unsigned char *)password);
-    std_base64_encode(hash, 16, (unsigned char *)(password + strlen(password)));
-
-    {
-#if 1
-        BUFFER_CONSTANT_INSTANCE(in_obj, plaindata, outlength);
-        struct buffer_t *ret = cipher_simple_update_data(password, "rc4", false, in_obj);
-        memcpy(plaindata, ret->buffer, ret->len);
-        buffer_free(ret);
-#else
-        struct cipher_env_t *cipher = cipher_env_new_instance(password, "rc4");
-        struct enc_ctx *ctx = enc_ctx_new_instance(cipher, false);
-        size_t out_len;
-        ss_decrypt_buffer(cipher, ctx,
-                plaindata, (size_t)outlength, plaindata, &out_len);
-        enc_ctx_release_instance(cipher, ctx);
-        cipher_env_release(cipher);
-#endif
+    if (auth_chain_udp_crypt(local->user_key, hash, (uint8_t *)plaindata, outlength) == false) {
+        return 0;
     }
 
     return (ssize_t)outlength;
@@ -860,7 +954,7 @@ struct buffer_t * auth_chain_a_server_pre_encrypt(struct obfs_t *obfs, const str
         uint16_t tcp_mss = server->tcp_mss; // TODO: htons
         tmp_buf = buffer_create_from((const uint8_t *)&tcp_mss, sizeof(uint16_t));
         buffer_concatenate2(tmp_buf, buf);
-        local->unit_len = server->tcp_mss - local->client_over_head;
+        local->unit_len = local->frame_unit ? local->frame_unit : (size_t)(server->tcp_mss - local->client_over_head);
     } else {
         tmp_buf = buffer_clone(buf);
     }
@@ -891,6 +985,7 @@ struct buffer_t * auth_chain_a_server_post_decrypt(struct obfs_t *obfs, struct b
     if (need_feedback) { *need_feedback = false; }
 
     buffer_concatenate2(local->recv_buffer, buf);
+    local->recv_need = 0;
 
     if (local->has_recv_header == false) {
         uint8_t md5data[16 + 1] = { 0 };
@@ -901,7 +996,6 @@ struct buffer_t * auth_chain_a_server_post_decrypt(struct obfs_t *obfs, struct b
         uint32_t client_id = 0;
         uint32_t connection_id = 0;
         int time_diff;
-        uint8_t *password = NULL;
 
         if (len>=12 || len==7 || len==8) {
             size_t recv_len = min(len, 12);
@@ -913,6 +1007,7 @@ struct buffer_t * auth_chain_a_server_post_decrypt(struct obfs_t *obfs, struct b
             }
             buffer_free(mac_key);
             if (memcmp(md5data, local->recv_buffer->buffer+4, recv_len-4) != 0) {
+                obfs->rejected = true;
                 return out_buf;
             }
         }
@@ -933,6 +1028,7 @@ struct buffer_t * auth_chain_a_server_post_decrypt(struct obfs_t *obfs, struct b
         }
         if (memcmp(md5data, local->recv_buffer->buffer+32, 4) != 0) {
             // logging.error('%s data incorrect auth HMAC-MD5 from %s:%d, data %s' % (self.no_compatible_method, self.server_info.client, self.server_info.client_port, binascii.hexlify(self.recv_buf)))
+            obfs->rejected = true;
             return out_buf;
         }
 
@@ -949,6 +1045,7 @@ struct buffer_t * auth_chain_a_server_post_decrypt(struct obfs_t *obfs, struct b
             free(key);
         }
         local->client_over_head = (uint16_t) (*((uint16_t *)(head + 12))); // TODO: ntohs
+        local->padding_budget = (uint16_t) (head[14] | (head[15] << 8));
 
         utc_time = (uint32_t) (*((uint32_t *)(head + 0))); // TODO: ntohl
         client_id = (uint32_t) (*((uint32_t *)(head + 4))); // TODO: ntohl
@@ -957,27 +1054,24 @@ struct buffer_t * auth_chain_a_server_post_decrypt(struct obfs_t *obfs, struct b
         time_diff = abs((int)time(NULL) - (int)utc_time);
         if (time_diff > local->max_time_dif) {
             // logging.info('%s: wrong timestamp, time_dif %d, data %s' % (self.no_compatible_method, time_dif, binascii.hexlify(head)))
+            obfs->rejected = true;
             return out_buf;
         }
 
         local->client_id = client_id;
         local->connection_id = connection_id;
-        {
-            size_t b64len1 = (size_t) std_base64_encode_len((int) local->user_key->len);
-            size_t b64len2 = (size_t) std_base64_encode_len((int) sizeof(local->last_client_hash));
-            password = (uint8_t *)calloc(b64len1 + b64len2, sizeof(uint8_t));
-            b64len1 = std_base64_encode(local->user_key->buffer, (int)local->user_key->len, password);
-            b64len2 = std_base64_encode(local->last_client_hash, (int)sizeof(local->last_client_hash), password + b64len1);
-        }
         buffer_shorten(local->recv_buffer, 36, local->recv_buffer->len - 36);
         local->has_recv_header = true;
         if (need_feedback) { *need_feedback = true; }
 
-        assert(local->cipher == NULL);
-        local->cipher = cipher_env_new_instance((char *)password, "rc4");
-        local->encrypt_ctx = enc_ctx_new_instance(local->cipher, true);
-        local->decrypt_ctx = enc_ctx_new_instance(local->cipher, false);
-        free(password);
+        assert(local->rc4_ready == false);
+        if (auth_chain_rc4_derive(local->user_key, local->last_client_hash, &local->decrypt_rc4) == false) {
+            if (need_feedback) { *need_feedback = false; }
+            obfs->rejected = true;
+            return out_buf;
+        }
+        local->encrypt_rc4 = local->decrypt_rc4;
+        local->rc4_ready = true;
     }
 
     mac_key2 = buffer_alloc(SSR_BUFF_SIZE);
@@ -995,8 +1089,9 @@ struct buffer_t * auth_chain_a_server_post_decrypt(struct obfs_t *obfs, struct b
         data_len = data_len ^ (*((uint16_t *)(local->last_client_hash + 14))); // TODO: ntohs
 
         rand_len = local->get_tcp_rand_len(local, data_len, &local->random_client, local->last_client_hash);
+        rand_len = auth_chain_padding_limit(local, data_len, local->recv_id, (unsigned int)rand_len);
         length = data_len + rand_len;
-        if (length >= 4096) {
+        if (length >= local->max_frame_len) {
             // logging.info(self.no_compatible_method + ': over size')
             buffer_reset(local->recv_buffer);
             if (local->recv_id == 0) {
@@ -1007,6 +1102,9 @@ struct buffer_t * auth_chain_a_server_post_decrypt(struct obfs_t *obfs, struct b
             break;
         }
         if (length + 4 > local->recv_buffer->len) {
+            if (local->recv_buffer->len >= 2) {
+                local->recv_need = length + 4 - local->recv_buffer->len;
+            }
             break;
         }
         {
@@ -1032,15 +1130,9 @@ struct buffer_t * auth_chain_a_server_post_decrypt(struct obfs_t *obfs, struct b
             pos = 2;
         }
 
-        {
-            size_t out_len = 0;
-            char *buffer = (char *)calloc(local->recv_buffer->len, sizeof(char));
-            ss_decrypt_buffer(local->cipher, local->decrypt_ctx,
-                (char*)local->recv_buffer->buffer + pos, (size_t)data_len, 
-                (char *)buffer, &out_len);
-            buffer_concatenate(out_buf, (uint8_t *)buffer, out_len);
-            free(buffer);
-        }
+        // The frame is dropped from recv_buffer right below, so decrypt it in place.
+        auth_chain_rc4_crypt(&local->decrypt_rc4, local->recv_buffer->buffer + pos, (size_t)data_len);
+        buffer_concatenate(out_buf, local->recv_buffer->buffer + pos, (size_t)data_len);
         memcpy(local->last_client_hash, client_hash, 16);
         buffer_shorten(local->recv_buffer, length + 4, local->recv_buffer->len - (length + 4));
 
@@ -1504,3 +1596,28 @@ void auth_chain_f_set_server_info(struct obfs_t *obfs, struct server_info_t *ser
     free(key_change_datetime_key_bytes);
     key_change_datetime_key_bytes = NULL;
 }
+
+
+//============================ auth_chain_jumbo ===============================
+
+//
+// auth_chain_a handshake and framing with frames of up to 16 KiB instead of
+// one TCP segment, so bulk transfers pay for one HMAC and header per 16 KiB.
+// The 2-byte length field caps a frame at 64 KiB, which is what the receiving
+// side accepts. Frames above 1440 bytes carry no padding (auth_chain_a's
+// length rule), smaller ones are padded as usual.
+//
+#define AUTH_CHAIN_JUMBO_FRAME      (16 * 1024)
+#define AUTH_CHAIN_JUMBO_MAX_FRAME  (64 * 1024)
+
+struct obfs_t * auth_chain_jumbo_new_obfs(void) {
+    struct obfs_t *obfs = auth_chain_a_new_obfs();
+    struct auth_chain_a_context *auth_chain_a = (struct auth_chain_a_context *)obfs->l_data;
+
+    auth_chain_a->salt = "auth_chain_jumbo";
+    auth_chain_a->frame_unit = AUTH_CHAIN_JUMBO_FRAME;
+    auth_chain_a->max_frame_len = AUTH_CHAIN_JUMBO_MAX_FRAME;
+    auth_chain_a->recv_buffer_limit = AUTH_CHAIN_JUMBO_MAX_FRAME * 2;
+
+    return obfs;
+}
@@ -27,5 +27,8 @@ struct obfs_t * auth_chain_e_new_obfs(void);
 //============================= auth_chain_f ==================================
 struct obfs_t * auth_chain_f_new_obfs(void);
 
+//============================ auth_chain_jumbo ===============================
+struct obfs_t * auth_chain_jumbo_new_obfs(void);
+
 
 #endif // _OBFS_AUTH_CHAIN_H
@@ -11,6 +11,7 @@
 
 size_t http_simple_client_encode(struct obfs_t *obfs, char **pencryptdata, size_t datalength, size_t* capacity);
 ssize_t http_simple_client_decode(struct obfs_t *obfs, char **pencryptdata, size_t datalength, size_t* capacity, int *needsendback);
+size_t http_simple_get_recv_need(struct obfs_t *obfs, size_t inner_need);
 
 struct buffer_t * http_simple_server_encode(struct obfs_t *obfs, const struct buffer_t *buf);
 struct buffer_t * http_simple_server_decode(struct obfs_t *obfs, const struct buffer_t *buf, bool *need_decrypt, bool *need_feedback);
@@ -56,6 +57,7 @@ struct obfs_t * http_simple_new_obfs(void) {
     struct obfs_t * obfs = (struct obfs_t *)calloc(1, sizeof(struct obfs_t));
     obfs->init_data = init_data;
     obfs->get_overhead = get_overhead;
+    obfs->get_recv_need = http_simple_get_recv_need;
     obfs->need_feedback = need_feedback_false;
     obfs->get_server_info = get_server_info;
     obfs->set_server_info = set_server_info;
@@ -255,6 +257,12 @@ size_t http_simple_client_encode(struct obfs_t *obfs, char **pencryptdata, size_
     return outlength;
 }
 
+size_t http_simple_get_recv_need(struct obfs_t *obfs, size_t inner_need) {
+    struct http_simple_local_data *local = (struct http_simple_local_data*)obfs->l_data;
+    // Past the request or response head the data goes through as it is.
+    return local->has_recv_header ? inner_need : 0;
+}
+
 ssize_t http_simple_client_decode(struct obfs_t *obfs, char **pencryptdata, size_t datalength, size_t* capacity, int *needsendback) {
     char *encryptdata = *pencryptdata;
     struct http_simple_local_data *local = (struct http_simple_local_data*)obfs->l_data;
@@ -167,6 +167,9 @@ new_obfs_instance(const char *plugin_name)
     } else if (ssr_protocol_auth_chain_f == protocol_type) {
         // auth_chain_f
         return auth_chain_f_new_obfs();
+    } else if (ssr_protocol_auth_chain_jumbo == protocol_type) {
+        // auth_chain_jumbo
+        return auth_chain_jumbo_new_obfs();
     }
     assert(0); // LOGE("Load obfs '%s' failed", plugin_name);
     return NULL;
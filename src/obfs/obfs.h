@@ -36,18 +36,26 @@ struct server_info_t {
     uint16_t overhead;
     uint32_t buffer_size;
     struct cipher_env_t *cipher_env;
+    uint16_t padding_budget; /* Percent of payload spent on padding in bulk frames, 0 is unbounded. */
 };
 
 struct obfs_t {
     struct server_info_t server;
     void *l_data;
+    bool rejected;  /* Server: the client handshake failed verification, not just incomplete. */
 
     void * (*init_data)(void);
     size_t (*get_overhead)(struct obfs_t *obfs);
     bool (*need_feedback)(struct obfs_t *obfs);
     struct server_info_t * (*get_server_info)(struct obfs_t *obfs);
+    bool (*get_user_id)(struct obfs_t *obfs, uint32_t *uid);
     void (*set_server_info)(struct obfs_t *obfs, struct server_info_t *server);
     void (*dispose)(struct obfs_t *obfs);
+    /*
+     * Bytes this layer must still receive before it can pass anything on,
+     * given the layer inside waits for |inner_need| more. 0 when unknown.
+     */
+    size_t (*get_recv_need)(struct obfs_t *obfs, size_t inner_need);
 
     size_t (*client_pre_encrypt)(struct obfs_t *obfs, char **pplaindata, size_t datalength, size_t* capacity);
     ssize_t (*client_post_decrypt)(struct obfs_t *obfs, char **pplaindata, int datalength, size_t* capacity);
@@ -53,6 +53,7 @@ void tls12_ticket_auth_new_obfs(struct obfs_t * obfs) {
     struct tls12_ticket_auth_local_data *l_data = NULL;
     obfs->init_data = tls12_ticket_auth_init_data;
     obfs->get_overhead = tls12_ticket_auth_get_overhead;
+    obfs->get_recv_need = tls12_ticket_auth_get_recv_need;
     obfs->need_feedback = need_feedback_true;
     obfs->get_server_info = get_server_info;
     obfs->set_server_info = set_server_info;
@@ -77,6 +78,27 @@ size_t tls12_ticket_auth_get_overhead(struct obfs_t *obfs) {
     return 5;
 }
 
+size_t tls12_ticket_auth_get_recv_need(struct obfs_t *obfs, size_t inner_need) {
+    struct tls12_ticket_auth_local_data *local = (struct tls12_ticket_auth_local_data*)obfs->l_data;
+    size_t len = local->recv_buffer->len;
+    size_t rest, payload;
+
+    // Only application data records are reassembled, 8 on the client, the 4 bit on the server.
+    if (local->handshake_status == -1 || (local->handshake_status != 8 && (local->handshake_status & 4) == 0)) {
+        return 0;
+    }
+    if (len <= 5) {
+        if (len == 0) {
+            return inner_need ? inner_need + 5 : 0;
+        }
+        return (5 - len) + inner_need;
+    }
+    rest = (size_t)ntohs(*((uint16_t *)(local->recv_buffer->buffer + 3))) + 5;
+    rest = (rest > len) ? rest - len : 0;
+    payload = len - 5;
+    return max(rest, (inner_need > payload) ? inner_need - payload : 0);
+}
+
 void tls12_ticket_auth_dispose(struct obfs_t *obfs) {
     struct tls12_ticket_auth_local_data *local = (struct tls12_ticket_auth_local_data*)obfs->l_data;
     if (local->send_buffer != NULL) {
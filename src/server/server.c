@@ -16,11 +16,40 @@
 #include "tunnel.h"
 #include "daemon_wrapper.h"
 #include "cmd_line_parser.h"
+#include "traffic_quota.h"
+#include "encrypt.h"
+#include "dest_table.h"
+#include "stripe.h"
+#include "zerocopy.h"
 
 #ifndef SSR_MAX_CONN
 #define SSR_MAX_CONN 1024
 #endif
 
+/* Upper bounds for collecting a target address header split across reads. */
+#ifndef SSR_HEADER_REASSEMBLY_MAX_SIZE
+#define SSR_HEADER_REASSEMBLY_MAX_SIZE (TCP_BUF_SIZE_MAX)
+#endif
+
+#ifndef SSR_HEADER_REASSEMBLY_TIMEOUT
+#define SSR_HEADER_REASSEMBLY_TIMEOUT (10 * SECONDS_PER_MINUTE)
+#endif
+
+/* How often quotas are re-checked for open tunnels and counters are flushed. */
+#ifndef SSR_QUOTA_CHECK_INTERVAL
+#define SSR_QUOTA_CHECK_INTERVAL (60 * SECONDS_PER_MINUTE)
+#endif
+
+/* Seconds the kernel may hold a connection that has not sent anything yet. */
+#ifndef SSR_DEFER_ACCEPT_TIMEOUT
+#define SSR_DEFER_ACCEPT_TIMEOUT 10
+#endif
+
+/* How often a draining server reports the tunnels still open. */
+#ifndef SSR_DRAIN_REPORT_INTERVAL
+#define SSR_DRAIN_REPORT_INTERVAL (5 * SECONDS_PER_MINUTE)
+#endif
+
 struct ssr_server_state {
     struct server_env_t *env;
 
@@ -28,10 +57,21 @@ struct ssr_server_state {
     uv_signal_t *sigterm_watcher;
 
     bool shutting_down;
+    bool draining;
+    uv_timer_t *drain_timer;  /* One-shot, fires at |drain_timeout|. */
+    uv_timer_t *drain_report_timer;
+    size_t tunnel_count;  /* Tunnels in env->tunnel_set. */
 
     uv_tcp_t *tcp_listener;
     struct udp_listener_ctx_t *udp_listener;
     struct cstl_map *resolved_ips;
+    struct cstl_map *dns_inflight;  /* Hostname -> struct dns_lookup still waiting for the resolver. */
+    uint64_t dns_coalesced;  /* Tunnels that rode along on another tunnel's lookup. */
+    struct dest_table *destinations;
+    struct cstl_map *stripes;  /* Session name -> struct stripe_session, until its last subflow is gone. */
+
+    struct traffic_quota *quota;
+    uv_timer_t *quota_timer;
 };
 
 enum session_state {
@@ -39,10 +79,13 @@ enum session_state {
     session_receipt_done,
     session_client_feedback,
     session_confirm_done,
-    session_resolve_host = 4,  /* Resolve the hostname             */
+    session_header_reassembly, /* Wait for the rest of the address header */
+    session_resolve_host,  /* Resolve the hostname             */
     session_connect_host,
     session_launch_streaming,
     session_streaming,  /* Stream between client and server */
+    session_stripe_header,  /* Subflow 0, wait for the destination in the first chunk */
+    session_stripe_streaming,  /* One subflow of a striped connection */
 };
 
 struct server_ctx {
@@ -54,6 +97,24 @@ struct server_ctx {
     size_t _overhead;
     size_t _recv_buffer_size;
     size_t _recv_d_max_size;
+    uint64_t header_deadline;
+    struct user_traffic *user;
+    struct dns_lookup *dns_wait;  /* The lookup this tunnel waits for, in session_resolve_host. */
+    struct stripe_session *stripe;
+    size_t stripe_index;  /* Subflow 0 also owns the connection to the destination. */
+};
+
+/*
+ * One resolver request per hostname. Tunnels asking for a name that is
+ * already being looked up wait on that request instead of starting another.
+ */
+struct dns_lookup {
+    struct ssr_server_state *state;
+    char *host;
+    uv_getaddrinfo_t req;
+    struct tunnel_ctx **waiters;
+    size_t waiter_count;
+    size_t waiter_capacity;
 };
 
 struct address_timestamp {
@@ -63,6 +124,9 @@ struct address_timestamp {
 
 static int ssr_server_run_loop(struct server_config *config);
 void ssr_server_run_loop_shutdown(struct ssr_server_state *state);
+static void ssr_server_run_loop_drain(struct ssr_server_state *state);
+static void drain_timer_cb(uv_timer_t *handle);
+static void drain_report_timer_cb(uv_timer_t *handle);
 
 void server_tunnel_initialize(uv_tcp_t *listener, unsigned int idle_timeout);
 void server_shutdown(struct server_env_t *env);
@@ -77,11 +141,17 @@ static void tunnel_read_done(struct tunnel_ctx *tunnel, struct socket_ctx *socke
 static void tunnel_getaddrinfo_done(struct tunnel_ctx *tunnel, struct socket_ctx *socket);
 static void tunnel_write_done(struct tunnel_ctx *tunnel, struct socket_ctx *socket);
 static size_t tunnel_get_alloc_size(struct tunnel_ctx *tunnel, struct socket_ctx *socket, size_t suggested_size);
+static size_t tunnel_get_recv_need(struct tunnel_ctx *tunnel, struct socket_ctx *socket);
 static bool tunnel_is_in_streaming(struct tunnel_ctx *tunnel);
 static uint8_t* tunnel_extract_data(struct socket_ctx *socket, void*(*allocator)(size_t size), size_t *size);
 
 static bool is_incoming_ip_legal(struct tunnel_ctx *tunnel);
+static bool is_user_within_quota(struct tunnel_ctx *tunnel);
+static uint32_t _peer_address_hash(struct socket_ctx *socket);
+static void quota_timer_cb(uv_timer_t *handle);
 static bool is_header_complete(const struct buffer_t *buf);
+static bool is_header_partial(const struct buffer_t *buf);
+static bool header_reassembly_continue(struct tunnel_ctx *tunnel);
 static size_t _get_read_size(struct tunnel_ctx *tunnel, struct socket_ctx *socket, size_t suggested_size);
 static void do_init_package(struct tunnel_ctx *tunnel, struct socket_ctx *socket);
 static void do_prepare_parse(struct tunnel_ctx *tunnel, struct socket_ctx *socket);
@@ -92,13 +162,30 @@ static void do_resolve_host_done(struct tunnel_ctx *tunnel, struct socket_ctx *s
 static void do_connect_host_start(struct tunnel_ctx *tunnel, struct socket_ctx *socket);
 static void do_connect_host_done(struct tunnel_ctx *tunnel, struct socket_ctx *socket);
 static void do_launch_streaming(struct tunnel_ctx *tunnel, struct socket_ctx *socket);
-
+static void do_stripe_join(struct tunnel_ctx *tunnel, const uint8_t *id, const uint8_t *token, size_t index, size_t count);
+static void do_stripe_header(struct tunnel_ctx *tunnel, struct socket_ctx *socket);
+static void do_launch_stripe_streaming(struct tunnel_ctx *tunnel);
+static void do_stripe_streaming(struct tunnel_ctx *tunnel, struct socket_ctx *socket);
+static void tunnel_stripe_read_eof(struct tunnel_ctx *tunnel, struct socket_ctx *socket);
+static struct socket_ctx * stripe_server_wire(struct tunnel_ctx *subflow);
+static bool stripe_server_seal(struct tunnel_ctx *subflow, struct buffer_t *buf);
+static void stripe_server_deliver(struct stripe_session *session, const uint8_t *data, size_t len);
+
+static void dns_lookup_join(struct tunnel_ctx *tunnel, const char *host);
+static void dns_lookup_leave(struct tunnel_ctx *tunnel);
+static void dns_lookup_done_cb(uv_getaddrinfo_t *req, int status, struct addrinfo *ai);
 static int resolved_ips_compare_key(void *left, void *right);
 static void resolved_ips_destroy_object(void *obj);
 
 void print_server_info(const struct server_config *config);
 static void usage(void);
 
+static const struct stripe_ops server_stripe_ops = {
+    &stripe_server_wire,
+    &stripe_server_seal,
+    &stripe_server_deliver,
+};
+
 int main(int argc, char * const argv[]) {
     struct server_config *config = NULL;
     int err = -1;
@@ -125,6 +212,8 @@ int main(int argc, char * const argv[]) {
             break;
         }
 
+        set_dump_level((enum dump_level)cmds->log_level);
+
         if (cmds->cfg_file == NULL) {
             string_safe_assign(&cmds->cfg_file, DEFAULT_CONF_PATH);
         }
@@ -146,7 +235,7 @@ int main(int argc, char * const argv[]) {
 
         if (cmds->daemon_flag) {
             char param[257] = { 0 };
-            sprintf(param, "-c \"%s\"", cmds->cfg_file);
+            sprintf(param, "-c \"%s\" -l %d", cmds->cfg_file, cmds->log_level);
             daemon_wrapper(argv[0], param);
         }
 
@@ -159,6 +248,8 @@ int main(int argc, char * const argv[]) {
 
     cmd_line_info_destroy(cmds);
 
+    pr_flush();
+
     config_release(config);
 
     if (err != 0) {
@@ -181,6 +272,9 @@ static int ssr_server_run_loop(struct server_config *config) {
     state = (struct ssr_server_state *) calloc(1, sizeof(*state));
     state->env = ssr_cipher_env_create(config, state);
     loop->data = state->env;
+    pr_info("crypto backend   %s", cipher_env_backend_name(state->env->cipher));
+
+    tunnel_set_memory_budget((size_t)config->memory_budget_mb * 1024 * 1024);
 
     {
         union sockaddr_universal addr = { 0 };
@@ -194,6 +288,17 @@ static int ssr_server_run_loop(struct server_config *config) {
         addr.addr4.sin_addr.s_addr = htonl(INADDR_ANY);
         uv_tcp_bind(listener, &addr.addr, 0);
 
+#if defined(TCP_DEFER_ACCEPT)
+        {
+            // Only wake up for connections that already carry their first packet,
+            // so port scanners and idle connects never reach userspace.
+            int defer = SSR_DEFER_ACCEPT_TIMEOUT;
+            if (setsockopt(uv_stream_fd(listener), IPPROTO_TCP, TCP_DEFER_ACCEPT, (const char *)&defer, sizeof(defer)) != 0) {
+                pr_warn("TCP_DEFER_ACCEPT is not available on the listener");
+            }
+        }
+#endif // defined(TCP_DEFER_ACCEPT)
+
         error = uv_listen((uv_stream_t *)listener, SSR_MAX_CONN, tunnel_establish_init_cb);
 
         if (error != 0) {
@@ -204,6 +309,26 @@ static int ssr_server_run_loop(struct server_config *config) {
         state->resolved_ips = obj_map_create(resolved_ips_compare_key,
                                              resolved_ips_destroy_object,
                                              resolved_ips_destroy_object);
+        // Keys and values belong to the struct dns_lookup entries.
+        state->dns_inflight = obj_map_create(resolved_ips_compare_key, NULL, NULL);
+        state->destinations = dest_table_create(DEST_TABLE_DEFAULT_SIZE);
+        // Keys belong to the sessions.
+        state->stripes = obj_map_create(resolved_ips_compare_key, NULL, NULL);
+    }
+
+    {
+        state->quota = traffic_quota_create((uint64_t)config->quota_daily_mb * 1024 * 1024,
+                                            (uint64_t)config->quota_monthly_mb * 1024 * 1024,
+                                            config->quota_state_file,
+                                            config->quota_users);
+        traffic_quota_load(state->quota);
+        if (config->quota_daily_mb || config->quota_monthly_mb) {
+            pr_warn("traffic quotas are advisory, the uid a client sends is not authenticated");
+        }
+
+        state->quota_timer = (uv_timer_t *)calloc(1, sizeof(uv_timer_t));
+        uv_timer_init(loop, state->quota_timer);
+        uv_timer_start(state->quota_timer, quota_timer_cb, SSR_QUOTA_CHECK_INTERVAL, SSR_QUOTA_CHECK_INTERVAL);
     }
 
     {
@@ -226,6 +351,31 @@ static int ssr_server_run_loop(struct server_config *config) {
         free(state->sigterm_watcher);
 
         obj_map_destroy(state->resolved_ips);
+        obj_map_destroy(state->dns_inflight);
+        obj_map_destroy(state->stripes);
+        if (state->dns_coalesced) {
+            pr_info("dns lookups shared by %llu tunnels", (unsigned long long)state->dns_coalesced);
+        }
+        {
+            uint64_t lookups = 0, misses = 0;
+            dest_table_stats(state->destinations, &lookups, &misses);
+            if (lookups) {
+                pr_info("destination headers: %llu lookups, %llu parsed",
+                        (unsigned long long)lookups, (unsigned long long)misses);
+            }
+        }
+        {
+            uint64_t sent = 0, copied = 0;
+            zerocopy_stats(&sent, &copied);
+            if (sent) {
+                pr_info("zero-copy sends: %llu bytes, %llu of them copied by the kernel",
+                        (unsigned long long)sent, (unsigned long long)copied);
+            }
+        }
+        dest_table_destroy(state->destinations);
+
+        traffic_quota_save(state->quota);
+        traffic_quota_destroy(state->quota);
 
         free(state);
     }
@@ -239,6 +389,66 @@ static void listener_close_done_cb(uv_handle_t* handle) {
     free((void *)((uv_tcp_t *)handle));
 }
 
+static void quota_timer_close_done_cb(uv_handle_t* handle) {
+    free((void *)((uv_timer_t *)handle));
+}
+
+static void drain_timer_close_done_cb(uv_handle_t* handle) {
+    free((void *)((uv_timer_t *)handle));
+}
+
+/*
+ * Stop taking new connections but leave the open tunnels alone until they
+ * finish or |drain_timeout| runs out, then shut down whatever is left.
+ */
+static void ssr_server_run_loop_drain(struct ssr_server_state *state) {
+    struct server_env_t *env = state->env;
+    uv_loop_t *loop;
+    size_t count;
+
+    if (state->shutting_down || state->draining) {
+        return;
+    }
+    ASSERT(state->tcp_listener);
+    loop = state->tcp_listener->loop;
+
+    state->draining = true;
+    uv_close((uv_handle_t *)state->tcp_listener, listener_close_done_cb);
+    state->tcp_listener = NULL;
+
+    count = state->tunnel_count;
+    if (count == 0) {
+        ssr_server_run_loop_shutdown(state);
+        return;
+    }
+
+    state->drain_timer = (uv_timer_t *)calloc(1, sizeof(uv_timer_t));
+    uv_timer_init(loop, state->drain_timer);
+    uv_timer_start(state->drain_timer, drain_timer_cb, env->config->drain_timeout, 0);
+
+    state->drain_report_timer = (uv_timer_t *)calloc(1, sizeof(uv_timer_t));
+    uv_timer_init(loop, state->drain_report_timer);
+    uv_timer_start(state->drain_report_timer, drain_report_timer_cb, SSR_DRAIN_REPORT_INTERVAL, SSR_DRAIN_REPORT_INTERVAL);
+
+    pr_info("draining %u connection(s), up to %u seconds. signal again to quit now.",
+        (unsigned int)count, env->config->drain_timeout / SECONDS_PER_MINUTE);
+}
+
+static void drain_timer_cb(uv_timer_t *handle) {
+    struct server_env_t *env = (struct server_env_t *)handle->loop->data;
+    struct ssr_server_state *state = (struct ssr_server_state *)env->data;
+
+    pr_warn("drain timeout, closing %u remaining connection(s)", (unsigned int)state->tunnel_count);
+    ssr_server_run_loop_shutdown(state);
+}
+
+static void drain_report_timer_cb(uv_timer_t *handle) {
+    struct server_env_t *env = (struct server_env_t *)handle->loop->data;
+    struct ssr_server_state *state = (struct ssr_server_state *)env->data;
+
+    pr_info("draining, %u connection(s) remaining", (unsigned int)state->tunnel_count);
+}
+
 void ssr_server_run_loop_shutdown(struct ssr_server_state *state) {
     if (state == NULL) {
         return;
@@ -254,6 +464,21 @@ void ssr_server_run_loop_shutdown(struct ssr_server_state *state) {
 
     if (state->tcp_listener) {
         uv_close((uv_handle_t *)state->tcp_listener, listener_close_done_cb);
+        state->tcp_listener = NULL;
+    }
+
+    if (state->drain_timer) {
+        uv_close((uv_handle_t *)state->drain_timer, drain_timer_close_done_cb);
+        state->drain_timer = NULL;
+    }
+    if (state->drain_report_timer) {
+        uv_close((uv_handle_t *)state->drain_report_timer, drain_timer_close_done_cb);
+        state->drain_report_timer = NULL;
+    }
+
+    if (state->quota_timer) {
+        uv_close((uv_handle_t *)state->quota_timer, quota_timer_close_done_cb);
+        state->quota_timer = NULL;
     }
 
 #if UDP_RELAY_ENABLE
@@ -284,10 +509,15 @@ bool _init_done_cb(struct tunnel_ctx *tunnel, void *p) {
     tunnel->tunnel_getaddrinfo_done = &tunnel_getaddrinfo_done;
     tunnel->tunnel_write_done = &tunnel_write_done;
     tunnel->tunnel_get_alloc_size = &tunnel_get_alloc_size;
+    tunnel->tunnel_get_recv_need = &tunnel_get_recv_need;
     tunnel->tunnel_is_in_streaming = &tunnel_is_in_streaming;
     tunnel->tunnel_extract_data = &tunnel_extract_data;
+#if defined(TCP_DEFER_ACCEPT)
+    tunnel->read_on_accept = true;
+#endif // defined(TCP_DEFER_ACCEPT)
 
     objects_container_add(ctx->env->tunnel_set, tunnel);
+    ((struct ssr_server_state *)env->data)->tunnel_count++;
 
     ctx->cipher = NULL;
     ctx->state = session_initial;
@@ -311,6 +541,23 @@ void server_shutdown(struct server_env_t *env) {
     objects_container_traverse(env->tunnel_set, &_do_shutdown_tunnel, NULL);
 }
 
+static void _do_enforce_quota(void *obj, void *p) {
+    struct tunnel_ctx *tunnel = (struct tunnel_ctx *)obj;
+    struct server_ctx *ctx = (struct server_ctx *) tunnel->data;
+    if (ctx->user && traffic_quota_exceeded((struct traffic_quota *)p, ctx->user)) {
+        tunnel_shutdown(tunnel);
+    }
+}
+
+static void quota_timer_cb(uv_timer_t *handle) {
+    struct server_env_t *env = (struct server_env_t *)handle->loop->data;
+    struct ssr_server_state *state = (struct ssr_server_state *)env->data;
+
+    traffic_quota_refresh(state->quota);
+    objects_container_traverse(env->tunnel_set, &_do_enforce_quota, state->quota);
+    traffic_quota_save(state->quota);
+}
+
 void signal_quit_cb(uv_signal_t *handle, int signum) {
     struct server_env_t *env;
     ASSERT(handle);
@@ -324,7 +571,11 @@ void signal_quit_cb(uv_signal_t *handle, int signum) {
     {
     struct ssr_server_state *state = (struct ssr_server_state *)env->data;
         ASSERT(state);
-        ssr_server_run_loop_shutdown(state);
+        if (env->config->drain_timeout && state->draining == false) {
+            ssr_server_run_loop_drain(state);
+        } else {
+            ssr_server_run_loop_shutdown(state);
+        }
     }
     break;
     default:
@@ -343,8 +594,21 @@ void tunnel_establish_init_cb(uv_stream_t *server, int status) {
 
 static void tunnel_dying(struct tunnel_ctx *tunnel) {
     struct server_ctx *ctx = (struct server_ctx *) tunnel->data;
+    struct ssr_server_state *state = (struct ssr_server_state *)ctx->env->data;
 
     objects_container_remove(ctx->env->tunnel_set, tunnel);
+    state->tunnel_count--;
+    dns_lookup_leave(tunnel);
+    if (ctx->stripe && stripe_session_detach(ctx->stripe, ctx->stripe_index)) {
+        const char *name = stripe_session_name(ctx->stripe);
+        obj_map_remove(state->stripes, &name);
+        stripe_session_destroy(ctx->stripe);
+    }
+    if (state->draining && state->shutting_down == false && state->tunnel_count == 0) {
+        pr_info("all connections drained");
+        ssr_server_run_loop_shutdown(state);
+    }
+    traffic_quota_release(ctx->user);
     if (ctx->cipher) {
         tunnel_cipher_release(ctx->cipher);
     }
@@ -371,6 +635,7 @@ static void do_next(struct tunnel_ctx *tunnel, struct socket_ctx *socket) {
         ctx->state = session_client_feedback;
         break;
     case session_client_feedback:
+    case session_header_reassembly:
         ASSERT(incoming->rdstate == socket_done);
         ASSERT(incoming->wrstate == socket_stop);
         incoming->rdstate = socket_stop;
@@ -394,6 +659,14 @@ static void do_next(struct tunnel_ctx *tunnel, struct socket_ctx *socket) {
     case session_streaming:
         tunnel_traditional_streaming(tunnel, socket);
         break;
+    case session_stripe_header:
+        ASSERT(incoming->rdstate == socket_done);
+        incoming->rdstate = socket_stop;
+        do_stripe_header(tunnel, socket);
+        break;
+    case session_stripe_streaming:
+        do_stripe_streaming(tunnel, socket);
+        break;
     default:
         UNREACHABLE();
         break;
@@ -438,10 +711,19 @@ static size_t tunnel_get_alloc_size(struct tunnel_ctx *tunnel, struct socket_ctx
     return suggested_size;
 }
 
+static size_t tunnel_get_recv_need(struct tunnel_ctx *tunnel, struct socket_ctx *socket) {
+    struct server_ctx *ctx = (struct server_ctx *) tunnel->data;
+    // Only the client's side is framed, the destination sends a plain stream.
+    if (socket != tunnel->incoming) {
+        return 0;
+    }
+    return tunnel_cipher_recv_need(ctx->cipher);
+}
+
 static bool tunnel_is_in_streaming(struct tunnel_ctx *tunnel) {
-    // struct server_ctx *ctx = (struct server_ctx *) tunnel->data;
-    // return (ctx->state == session_streaming);
-    return false;
+    struct server_ctx *ctx = (struct server_ctx *) tunnel->data;
+    // Only striped tunnels read continuously, see do_stripe_streaming().
+    return (ctx->state == session_stripe_streaming);
 }
 
 static bool is_incoming_ip_legal(struct tunnel_ctx *tunnel) {
@@ -450,6 +732,51 @@ static bool is_incoming_ip_legal(struct tunnel_ctx *tunnel) {
     return true;
 }
 
+// FNV-1a over the peer IP, without the port, so reconnects share a hint slot.
+static uint32_t _peer_address_hash(struct socket_ctx *socket) {
+    union sockaddr_universal addr = { 0 };
+    int len = sizeof(addr);
+    const uint8_t *p = NULL;
+    size_t n = 0, i;
+    uint32_t hash = 2166136261u;
+
+    if (uv_tcp_getpeername(&socket->handle.tcp, &addr.addr, &len) != 0) {
+        return 0;
+    }
+    if (addr.addr.sa_family == AF_INET) {
+        p = (const uint8_t *) &addr.addr4.sin_addr;
+        n = sizeof(addr.addr4.sin_addr);
+    } else if (addr.addr.sa_family == AF_INET6) {
+        p = (const uint8_t *) &addr.addr6.sin6_addr;
+        n = sizeof(addr.addr6.sin6_addr);
+    }
+    for (i = 0; i < n; ++i) {
+        hash = (hash ^ p[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static bool is_user_within_quota(struct tunnel_ctx *tunnel) {
+    struct server_ctx *ctx = (struct server_ctx *) tunnel->data;
+    struct ssr_server_state *state = (struct ssr_server_state *)ctx->env->data;
+    uint32_t uid = 0;
+
+    if (ctx->user == NULL) {
+        // Protocols without user identification are all accounted to uid 0.
+        tunnel_cipher_server_user_id(ctx->cipher, &uid);
+        ctx->user = traffic_quota_acquire(state->quota, uid);
+        if (ctx->user == NULL) {
+            pr_warn("user %u is unknown or the quota table is full", (unsigned int)uid);
+            return false;
+        }
+    }
+    if (traffic_quota_exceeded(state->quota, ctx->user)) {
+        pr_warn("user %u is over its traffic quota", (unsigned int)ctx->user->uid);
+        return false;
+    }
+    return true;
+}
+
 static bool is_legal_header(const struct buffer_t *buf) {
     bool result = false;
     enum SOCKS5_ADDRTYPE addr_type;
@@ -476,6 +803,69 @@ static bool is_header_complete(const struct buffer_t *buf) {
     return socks5_address_parse(buf->buffer, buf->len, &addr);
 }
 
+// The decoded bytes so far are only the beginning of a header, not a broken one.
+static bool is_header_partial(const struct buffer_t *buf) {
+    size_t need = 0;
+    if (buf->len == 0) {
+        return true;
+    }
+    // pre_parse_header() keeps a random data prefix until all of it arrived,
+    // wait only while the length it announces is still missing and possible.
+    switch (buf->buffer[0]) {
+    case 0x80:
+        if (buf->len <= 2) {
+            return true;
+        }
+        need = (size_t)buf->buffer[1] + 2 + 1;
+        break;
+    case 0x82:
+        if (buf->len <= 3) {
+            return true;
+        }
+        need = (size_t)ntohs(*((uint16_t *)(buf->buffer + 1))) + 3 + 1;
+        break;
+    case 0x88:
+        if (buf->len <= 3) {
+            return true;
+        }
+        need = (size_t)ntohs(*((uint16_t *)(buf->buffer + 1)));
+        if (need < 7 + 7 + 1) {
+            return false;
+        }
+        break;
+    case SOCKS5_ADDRTYPE_IPV4:
+    case SOCKS5_ADDRTYPE_DOMAINNAME:
+    case SOCKS5_ADDRTYPE_IPV6:
+        return (is_header_complete(buf) == false);
+    default:
+        return false;
+    }
+    // Once the prefix is all here and still in place, it is a broken one.
+    return (need <= SSR_HEADER_REASSEMBLY_MAX_SIZE && buf->len < need);
+}
+
+static bool header_reassembly_continue(struct tunnel_ctx *tunnel) {
+    struct server_ctx *ctx = (struct server_ctx *) tunnel->data;
+    struct socket_ctx *incoming = tunnel->incoming;
+    uint64_t now = uv_now(incoming->handle.handle.loop);
+
+    if (ctx->init_pkg->len >= SSR_HEADER_REASSEMBLY_MAX_SIZE) {
+        return false;
+    }
+    if (ctx->state != session_header_reassembly) {
+        ctx->header_deadline = now + SSR_HEADER_REASSEMBLY_TIMEOUT;
+    }
+    if (now >= ctx->header_deadline) {
+        return false;
+    }
+
+    // The idle timer of the pending read doubles as the reassembly deadline.
+    incoming->idle_timeout = (unsigned int) min(ctx->header_deadline - now, (uint64_t)ctx->env->config->idle_timeout);
+    socket_read(incoming);
+    ctx->state = session_header_reassembly;
+    return true;
+}
+
 static size_t _get_read_size(struct tunnel_ctx *tunnel, struct socket_ctx *socket, size_t suggested_size) {
     // https://github.com/ShadowsocksR-Live/shadowsocksr/blob/manyuser/shadowsocks/tcprelay.py#L812
     struct server_ctx *ctx = (struct server_ctx *) tunnel->data;
@@ -522,6 +912,7 @@ static void do_init_package(struct tunnel_ctx *tunnel, struct socket_ctx *socket
         ASSERT(ctx->cipher == NULL);
         ctx->cipher = tunnel_cipher_create(ctx->env, tcp_mss);
         ctx->_tcp_mss = tcp_mss;
+        tunnel_cipher_server_set_peer(ctx->cipher, _peer_address_hash(incoming));
 
         result = tunnel_cipher_server_decrypt(ctx->cipher, buf, &receipt, &confirm);
 
@@ -532,7 +923,11 @@ static void do_init_package(struct tunnel_ctx *tunnel, struct socket_ctx *socket
             break;
         }
 
-        ASSERT(result /* && result->len!=0 */);
+        if (result == NULL) {
+            // None of the accepted obfs / protocols recognize this client.
+            tunnel_shutdown(tunnel);
+            break;
+        }
         buffer_replace(ctx->init_pkg, result);
 
         if (confirm) {
@@ -553,6 +948,7 @@ static void do_init_package(struct tunnel_ctx *tunnel, struct socket_ctx *socket
 
 static void do_prepare_parse(struct tunnel_ctx *tunnel, struct socket_ctx *socket) {
     struct server_ctx *ctx = (struct server_ctx *) tunnel->data;
+    struct socket_ctx *incoming = tunnel->incoming;
     struct buffer_t *init_pkg = ctx->init_pkg;
     do {
         struct server_info_t *info;
@@ -564,6 +960,14 @@ static void do_prepare_parse(struct tunnel_ctx *tunnel, struct socket_ctx *socke
 
         pre_parse_header(init_pkg);
 
+        if (is_header_partial(init_pkg)) {
+            if (header_reassembly_continue(tunnel) == false) {
+                tunnel_shutdown(tunnel);
+            }
+            break;
+        }
+        incoming->idle_timeout = ctx->env->config->idle_timeout;
+
         info = protocol ? protocol->get_server_info(protocol) : (obfs ? obfs->get_server_info(obfs) : NULL);
         if (info) {
             info->head_len = (int) get_s5_head_size(init_pkg->buffer, init_pkg->len, 30);
@@ -605,11 +1009,12 @@ static void do_client_feedback(struct tunnel_ctx *tunnel, struct socket_ctx *soc
 
         result = tunnel_cipher_server_decrypt(ctx->cipher, buf, &receipt, &confirm);
         ASSERT(receipt == NULL);
-        if (result==NULL || result->len==0) {
+        if (result == NULL) {
             tunnel_shutdown(tunnel);
             break;
         }
 
+        // An empty result only means the protocol frame is still incomplete.
         buffer_concatenate2(ctx->init_pkg, result);
 
         if (confirm) {
@@ -656,38 +1061,50 @@ static void do_parse(struct tunnel_ctx *tunnel, struct socket_ctx *socket) {
     struct socket_ctx *outgoing = tunnel->outgoing;
     size_t offset     = 0;
     const char *host = NULL;
+    struct ssr_server_state *state = (struct ssr_server_state *)ctx->env->data;
+    const struct dest_entry *entry;
     struct socks5_address *s5addr;
     union sockaddr_universal target;
     bool ipFound = true;
+    uint8_t stripe_id[STRIPE_ID_SIZE];
+    uint8_t stripe_token[STRIPE_TOKEN_SIZE];
+    size_t stripe_index = 0, stripe_count = 0;
 
     ASSERT(incoming == socket);
 
+    if (is_user_within_quota(tunnel) == false) {
+        tunnel_shutdown(tunnel);
+        return;
+    }
+
     // get remote addr and port
-    s5addr = tunnel->desired_addr;
-    memset(s5addr, 0, sizeof(*s5addr));
-    if (socks5_address_parse(ctx->init_pkg->buffer, ctx->init_pkg->len, s5addr) == false) {
+    entry = dest_table_intern(state->destinations, ctx->init_pkg->buffer, ctx->init_pkg->len);
+    if (entry == NULL) {
         // report_addr(server->fd, MALFORMED);
         tunnel_shutdown(tunnel);
         return;
     }
+    s5addr = tunnel->desired_addr;
+    *s5addr = entry->address;
 
-    offset = socks5_address_size(s5addr);
+    offset = entry->header_len;
     buffer_shorten(ctx->init_pkg, offset, ctx->init_pkg->len - offset);
 
+    if (ctx->stripe == NULL && stripe_header_parse(s5addr, stripe_id, stripe_token, &stripe_index, &stripe_count)) {
+        do_stripe_join(tunnel, stripe_id, stripe_token, stripe_index, stripe_count);
+        return;
+    }
+
     host = s5addr->addr.domainname;
 
-    if (socks5_address_to_universal(s5addr, &target) == false) {
+    if (entry->has_target) {
+        target = entry->target;
+    } else {
         ASSERT(s5addr->addr_type == SOCKS5_ADDRTYPE_DOMAINNAME);
-
-        if (uv_ip4_addr(host, s5addr->port, &target.addr4) != 0) {
-            if (uv_ip6_addr(host, s5addr->port, &target.addr6) != 0) {
-                ipFound = false;
-            }
-        }
+        ipFound = false;
     }
 
     if (ipFound == false) {
-        struct ssr_server_state *state = (struct ssr_server_state *)ctx->env->data;
         struct address_timestamp **addr = NULL;
         addr = (struct address_timestamp **)obj_map_find(state->resolved_ips, &host);
         if (addr && *addr) {
@@ -698,14 +1115,14 @@ static void do_parse(struct tunnel_ctx *tunnel, struct socket_ctx *socket) {
     }
 
     if (ipFound == false) {
-        if (!validate_hostname(host, strlen(host))) {
+        if (entry->valid == false) {
             // report_addr(server->fd, MALFORMED);
             tunnel_shutdown(tunnel);
             return;
         }
         ctx->state = session_resolve_host;
         outgoing->addr.addr4.sin_port = htons(s5addr->port);
-        socket_getaddrinfo(outgoing, host);
+        dns_lookup_join(tunnel, host);
     } else {
         outgoing->addr = target;
         do_connect_host_start(tunnel, socket);
@@ -822,11 +1239,212 @@ static void do_launch_streaming(struct tunnel_ctx *tunnel, struct socket_ctx *so
         return;
     }
 
+    if (ctx->stripe) {
+        do_launch_stripe_streaming(tunnel);
+        return;
+    }
+
+    tunnel->half_close_allowed = true;
     socket_read(incoming);
     socket_read(outgoing);
     ctx->state = session_streaming;
 }
 
+/* A subflow of a striped connection asked for its pseudo destination. */
+static void do_stripe_join(struct tunnel_ctx *tunnel, const uint8_t *id, const uint8_t *token, size_t index, size_t count) {
+    struct server_ctx *ctx = (struct server_ctx *) tunnel->data;
+    struct ssr_server_state *state = (struct ssr_server_state *)ctx->env->data;
+    struct stripe_session *stripe = NULL;
+    struct stripe_session **found;
+    char name[STRIPE_NAME_SIZE];
+    const char *key = name;
+
+    if (ctx->env->config->stripes < count) {
+        pr_warn("striped connection over %u subflows refused", (unsigned int)count);
+        tunnel_shutdown(tunnel);
+        return;
+    }
+
+    stripe_id_to_name(id, name);
+    found = (struct stripe_session **)obj_map_find(state->stripes, &key);
+    if (found && *found) {
+        stripe = *found;
+        if (stripe_session_token_matches(stripe, token) == false) {
+            pr_warn("subflow with a wrong token refused by striped connection %s", name);
+            tunnel_shutdown(tunnel);
+            return;
+        }
+    } else {
+        stripe = stripe_session_create(id, token, count, &server_stripe_ops, state);
+        key = stripe_session_name(stripe);
+        obj_map_add(state->stripes, &key, sizeof(void *), &stripe, sizeof(void *));
+    }
+    if (stripe_session_count(stripe) != count || stripe_session_attach(stripe, index, tunnel) == false) {
+        tunnel_shutdown(tunnel);
+        return;
+    }
+    ctx->stripe = stripe;
+    ctx->stripe_index = index;
+
+    if (ctx->init_pkg->len > 0) {
+        bool ok = stripe_session_receive(stripe, index, ctx->init_pkg->buffer, ctx->init_pkg->len);
+        ctx->init_pkg->len = 0;
+        if (ok == false) {
+            stripe_session_abort(stripe);
+            return;
+        }
+    }
+
+    if (index == 0) {
+        do_stripe_header(tunnel, NULL);
+        return;
+    }
+
+    // Only subflow 0 connects to the destination.
+    tunnel->outgoing->sdstate = socket_done;
+    tunnel->outgoing->rd_eof = true;
+    tunnel->tunnel_read_eof = &tunnel_stripe_read_eof;
+    ctx->state = session_stripe_streaming;
+    socket_read(tunnel->incoming);
+    stripe_session_ready(stripe, index);
+}
+
+/* Subflow 0 takes the destination from the first chunk, then connects like any tunnel. */
+static void do_stripe_header(struct tunnel_ctx *tunnel, struct socket_ctx *socket) {
+    struct server_ctx *ctx = (struct server_ctx *) tunnel->data;
+    struct socket_ctx *incoming = tunnel->incoming;
+    const struct buffer_t *held;
+
+    if (socket) {
+        BUFFER_CONSTANT_INSTANCE(buf, incoming->buf->base, incoming->result);
+        struct buffer_t *result = NULL;
+        struct buffer_t *receipt = NULL;
+        struct buffer_t *confirm = NULL;
+        bool ok;
+
+        ASSERT(incoming == socket);
+        result = tunnel_cipher_server_decrypt(ctx->cipher, buf, &receipt, &confirm);
+        ok = (result && stripe_session_receive(ctx->stripe, 0, result->buffer, result->len));
+        buffer_free(result);
+        buffer_free(receipt);
+        buffer_free(confirm);
+        if (ok == false) {
+            stripe_session_abort(ctx->stripe);
+            return;
+        }
+        if (ctx->user) {
+            traffic_quota_account(ctx->user, (size_t)incoming->result);
+        }
+    }
+
+    held = stripe_session_held(ctx->stripe);
+    if (held->len == 0 || (is_legal_header(held) && is_header_complete(held) == false)) {
+        ctx->state = session_stripe_header;
+        socket_read(incoming);
+        return;
+    }
+    if (is_legal_header(held) == false) {
+        stripe_session_abort(ctx->stripe);
+        return;
+    }
+    stripe_session_take_held(ctx->stripe, ctx->init_pkg);
+    do_parse(tunnel, incoming);
+}
+
+/* Subflows read continuously, the session decides when a read has to wait. */
+static void do_launch_stripe_streaming(struct tunnel_ctx *tunnel) {
+    struct server_ctx *ctx = (struct server_ctx *) tunnel->data;
+
+    tunnel->tunnel_read_eof = &tunnel_stripe_read_eof;
+    ctx->state = session_stripe_streaming;
+    socket_read(tunnel->incoming);
+    socket_read(tunnel->outgoing);
+    stripe_session_ready(ctx->stripe, 0);
+    // The destination can take what arrived over the faster subflows meanwhile.
+    stripe_session_release(ctx->stripe);
+}
+
+static void do_stripe_streaming(struct tunnel_ctx *tunnel, struct socket_ctx *socket) {
+    struct server_ctx *ctx = (struct server_ctx *) tunnel->data;
+    struct stripe_session *stripe = ctx->stripe;
+    struct socket_ctx *target = NULL;
+    bool ok = false;
+    BUFFER_CONSTANT_INSTANCE(src, socket->buf->base, socket->result);
+
+    if (socket == tunnel->outgoing) {
+        ok = stripe_session_send(stripe, src->buffer, src->len);
+        target = stripe_session_drain_wire(stripe);
+    } else {
+        struct buffer_t *receipt = NULL;
+        struct buffer_t *confirm = NULL;
+        struct buffer_t *buf = tunnel_cipher_server_decrypt(ctx->cipher, src, &receipt, &confirm);
+        if (buf) {
+            ok = stripe_session_receive(stripe, ctx->stripe_index, buf->buffer, buf->len);
+        }
+        buffer_free(buf);
+        buffer_free(receipt);
+        buffer_free(confirm);
+        if (stripe_session_subflow(stripe, 0)) {
+            target = stripe_session_subflow(stripe, 0)->outgoing;
+        }
+    }
+    if (ctx->user) {
+        traffic_quota_account(ctx->user, (size_t)socket->result);
+    }
+
+    if (ok == false || target == NULL) {
+        stripe_session_abort(stripe);
+        return;
+    }
+    socket_throttle(socket, target);
+}
+
+/* The destination finished sending, or the client closed one subflow. */
+static void tunnel_stripe_read_eof(struct tunnel_ctx *tunnel, struct socket_ctx *socket) {
+    struct server_ctx *ctx = (struct server_ctx *) tunnel->data;
+    bool ok;
+
+    if (socket == tunnel->outgoing) {
+        ok = stripe_session_send(ctx->stripe, NULL, 0);
+    } else {
+        ok = stripe_session_eof(ctx->stripe, ctx->stripe_index);
+    }
+    if (ok == false) {
+        stripe_session_abort(ctx->stripe);
+    }
+}
+
+static struct socket_ctx * stripe_server_wire(struct tunnel_ctx *subflow) {
+    return subflow->incoming;
+}
+
+static bool stripe_server_seal(struct tunnel_ctx *subflow, struct buffer_t *buf) {
+    struct server_ctx *ctx = (struct server_ctx *) subflow->data;
+    struct buffer_t *sealed = tunnel_cipher_server_encrypt(ctx->cipher, buf);
+    if (sealed == NULL) {
+        return false;
+    }
+    buffer_replace(buf, sealed);
+    buffer_free(sealed);
+    return true;
+}
+
+/* Everything goes out to the destination on subflow 0. */
+static void stripe_server_deliver(struct stripe_session *session, const uint8_t *data, size_t len) {
+    struct tunnel_ctx *tunnel = stripe_session_subflow(session, 0);
+    struct socket_ctx *outgoing;
+
+    if (tunnel == NULL || tunnel->terminated) {
+        return;
+    }
+    outgoing = tunnel->outgoing;
+    if (len) {
+        socket_write(outgoing, data, len);
+    } else if (outgoing->sdstate == socket_stop) {
+        socket_shutdown(outgoing);
+    }
+}
+
 static uint8_t* tunnel_extract_data(struct socket_ctx *socket, void*(*allocator)(size_t size), size_t *size) {
     struct tunnel_ctx *tunnel = socket->tunnel;
     struct server_ctx *ctx = (struct server_ctx *) tunnel->data;
@@ -855,6 +1473,10 @@ static uint8_t* tunnel_extract_data(struct socket_ctx *socket, void*(*allocator)
         }
     }
 
+    if (ctx->user) {
+        traffic_quota_account(ctx->user, (size_t)socket->result);
+    }
+
     if (buf) {
         size_t len = buf->len;
         *size = len;
@@ -867,6 +1489,114 @@ static uint8_t* tunnel_extract_data(struct socket_ctx *socket, void*(*allocator)
     return result;
 }
 
+static void dns_lookup_join(struct tunnel_ctx *tunnel, const char *host) {
+    struct server_ctx *ctx = (struct server_ctx *) tunnel->data;
+    struct ssr_server_state *state = (struct ssr_server_state *)ctx->env->data;
+    struct dns_lookup *lookup = NULL;
+    struct dns_lookup **found;
+
+    found = (struct dns_lookup **)obj_map_find(state->dns_inflight, &host);
+    if (found && *found) {
+        lookup = *found;
+        state->dns_coalesced++;
+    } else {
+        struct addrinfo hints;
+        int err;
+
+        lookup = (struct dns_lookup *)calloc(1, sizeof(*lookup));
+        lookup->state = state;
+        lookup->host = strdup(host);
+
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_protocol = IPPROTO_TCP;
+        err = uv_getaddrinfo(tunnel->incoming->handle.handle.loop, &lookup->req, dns_lookup_done_cb, lookup->host, NULL, &hints);
+        if (err != 0) {
+            pr_err("getaddrinfo: %s", uv_strerror(err));
+            free(lookup->host);
+            free(lookup);
+            tunnel_shutdown(tunnel);
+            return;
+        }
+        obj_map_add(state->dns_inflight, &lookup->host, sizeof(void *), &lookup, sizeof(void *));
+    }
+
+    if (lookup->waiter_count == lookup->waiter_capacity) {
+        lookup->waiter_capacity = lookup->waiter_capacity ? lookup->waiter_capacity * 2 : 4;
+        lookup->waiters = (struct tunnel_ctx **)realloc(lookup->waiters, lookup->waiter_capacity * sizeof(lookup->waiters[0]));
+    }
+    lookup->waiters[lookup->waiter_count++] = tunnel;
+    ctx->dns_wait = lookup;
+    // A stuck resolver must not hold the tunnel forever.
+    socket_timer_start(tunnel->outgoing);
+}
+
+/* A dying tunnel must not be woken up by the lookup it was waiting for. */
+static void dns_lookup_leave(struct tunnel_ctx *tunnel) {
+    struct server_ctx *ctx = (struct server_ctx *) tunnel->data;
+    struct dns_lookup *lookup = ctx->dns_wait;
+    size_t i;
+
+    if (lookup == NULL) {
+        return;
+    }
+    for (i = 0; i < lookup->waiter_count; ++i) {
+        if (lookup->waiters[i] == tunnel) {
+            lookup->waiters[i] = NULL;
+        }
+    }
+    ctx->dns_wait = NULL;
+    if (tunnel->terminated == false) {
+        socket_timer_stop(tunnel->outgoing);
+    }
+}
+
+static void dns_lookup_done_cb(uv_getaddrinfo_t *req, int status, struct addrinfo *ai) {
+    struct dns_lookup *lookup = CONTAINER_OF(req, struct dns_lookup, req);
+    size_t i;
+
+    obj_map_remove(lookup->state->dns_inflight, &lookup->host);
+
+    for (i = 0; i < lookup->waiter_count; ++i) {
+        struct tunnel_ctx *tunnel = lookup->waiters[i];
+        struct server_ctx *ctx;
+        struct socket_ctx *outgoing;
+
+        if (tunnel == NULL) {
+            continue;
+        }
+        ctx = (struct server_ctx *) tunnel->data;
+        ctx->dns_wait = NULL;
+        if (tunnel->terminated) {
+            continue;
+        }
+        outgoing = tunnel->outgoing;
+        socket_timer_stop(outgoing);
+        outgoing->result = status;
+        if (status == 0) {
+            /* FIXME(bnoordhuis) Should try all addresses. */
+            uint16_t port = outgoing->addr.addr4.sin_port;
+            if (ai->ai_family == AF_INET) {
+                outgoing->addr.addr4 = *(const struct sockaddr_in *) ai->ai_addr;
+            } else if (ai->ai_family == AF_INET6) {
+                outgoing->addr.addr6 = *(const struct sockaddr_in6 *) ai->ai_addr;
+            } else {
+                UNREACHABLE();
+            }
+            outgoing->addr.addr4.sin_port = port;
+        } else {
+            socket_dump_error_info("resolve address failed", outgoing);
+        }
+        do_next(tunnel, outgoing);
+    }
+
+    uv_freeaddrinfo(ai);
+    free(lookup->waiters);
+    free(lookup->host);
+    free(lookup);
+}
+
 static int resolved_ips_compare_key(void *left, void *right) {
     char *l = *(char **)left;
     char *r = *(char **)right;
@@ -895,6 +1625,24 @@ void print_server_info(const struct server_config *config) {
     if (config->obfs_param && strlen(config->obfs_param)) {
         pr_info("obfs_param       %s", config->obfs_param);
     }
+    if (config->protocol_accept && strlen(config->protocol_accept)) {
+        pr_info("protocol_accept  %s", config->protocol_accept);
+    }
+    if (config->obfs_accept && strlen(config->obfs_accept)) {
+        pr_info("obfs_accept      %s", config->obfs_accept);
+    }
+    if (config->quota_daily_mb) {
+        pr_info("daily quota      %u MB per user", config->quota_daily_mb);
+    }
+    if (config->quota_monthly_mb) {
+        pr_info("monthly quota    %u MB per user", config->quota_monthly_mb);
+    }
+    if (config->drain_timeout) {
+        pr_info("drain timeout    %u seconds", config->drain_timeout / SECONDS_PER_MINUTE);
+    }
+    if (config->stripes > 1) {
+        pr_info("stripes          up to %u", config->stripes);
+    }
     pr_info("udp relay        %s\n", config->udp ? "yes" : "no");
 }
 
@@ -903,13 +1651,15 @@ static void usage(void) {
         "\n"
         "Usage:\n"
         "\n"
-        "  %s [-d] [-c <config file>] [-h]\n"
+        "  %s [-d] [-c <config file>] [-l <level>] [-h]\n"
         "\n"
         "Options:\n"
         "\n"
         "  -d                     Run in background as a daemon.\n"
         "  -c <config file>       Configure file path.\n"
         "                         Default: " DEFAULT_CONF_PATH "\n"
+        "  -l <level>             Log level, 0 none, 1 errors, 2 warnings, 3 info.\n"
+        "                         Default: 3\n"
         "  -h                     Show this help message.\n"
         "",
         get_app_name());
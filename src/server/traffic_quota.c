@@ -0,0 +1,289 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#if !defined(_WIN32)
+#include <unistd.h>
+#endif // !defined(_WIN32)
+
+#include "traffic_quota.h"
+#include "dump_info.h"
+
+#define TRAFFIC_QUOTA_FILE_TAG "ssr-traffic-quota 1"
+
+struct traffic_quota {
+    uint64_t daily_limit;    /* Bytes, 0 means unlimited. */
+    uint64_t monthly_limit;  /* Bytes, 0 means unlimited. */
+    char *state_file;
+    bool restricted;         /* Only uids listed in the config are accounted. */
+    struct user_traffic users[TRAFFIC_QUOTA_MAX_USERS];
+};
+
+static void current_period(uint32_t *day, uint32_t *month) {
+    time_t now = time(NULL);
+    struct tm *tm_now = gmtime(&now);
+    *day = (uint32_t)(now / (24 * 60 * 60));
+    *month = tm_now ? (uint32_t)((tm_now->tm_year + 1900) * 12 + tm_now->tm_mon) : 0;
+}
+
+static void user_traffic_roll(struct user_traffic *user, uint32_t day, uint32_t month) {
+    if (user->day != day) {
+        user->day = day;
+        user->daily_bytes = 0;
+    }
+    if (user->month != month) {
+        user->month = month;
+        user->monthly_bytes = 0;
+    }
+}
+
+/* Nothing to lose: no tunnel open and nothing counted in the current periods. */
+static bool user_traffic_is_blank(struct user_traffic *user, uint32_t day, uint32_t month) {
+    if (user->connections != 0) {
+        return false;
+    }
+    user_traffic_roll(user, day, month);
+    return (user->daily_bytes == 0 && user->monthly_bytes == 0);
+}
+
+static struct user_traffic * traffic_quota_slot(struct traffic_quota *quota, uint32_t uid, bool insert) {
+    size_t mask = TRAFFIC_QUOTA_MAX_USERS - 1;
+    size_t index = (size_t)((uid * 2654435761u) & mask);
+    size_t i;
+    uint32_t day = 0, month = 0;
+    struct user_traffic *idle = NULL;
+    current_period(&day, &month);
+    for (i = 0; i < TRAFFIC_QUOTA_MAX_USERS; ++i) {
+        struct user_traffic *user = &quota->users[(index + i) & mask];
+        if (user->in_use == false) {
+            if (insert == false) {
+                return NULL;
+            }
+            memset(user, 0, sizeof(*user));
+            user->uid = uid;
+            user->in_use = true;
+            return user;
+        }
+        if (user->uid == uid) {
+            return user;
+        }
+        if (idle == NULL && insert && quota->restricted == false && user_traffic_is_blank(user, day, month)) {
+            idle = user;
+        }
+    }
+    // The table is full. Slots are never emptied again, so every lookup scans
+    // the whole table and still finds a uid moved into a blank user's slot.
+    // A user with traffic counted is never dropped, or reconnecting under
+    // enough new uids would wipe its counters.
+    if (idle) {
+        memset(idle, 0, sizeof(*idle));
+        idle->uid = uid;
+        idle->in_use = true;
+        return idle;
+    }
+    return NULL;
+}
+
+static void traffic_quota_add_users(struct traffic_quota *quota, const char *users) {
+    const char *p = users;
+    while (*p) {
+        char *end = NULL;
+        unsigned long uid;
+        if (*p == ',' || *p == ' ') {
+            ++p;
+            continue;
+        }
+        uid = strtoul(p, &end, 10);
+        if (end == p || (*end && *end != ',' && *end != ' ') || uid > UINT32_MAX) {
+            pr_warn("traffic quota user list \"%s\" is malformed", users);
+            break;
+        }
+        if (traffic_quota_slot(quota, (uint32_t)uid, true) == NULL) {
+            pr_warn("traffic quota user list is longer than %d users", TRAFFIC_QUOTA_MAX_USERS);
+            break;
+        }
+        quota->restricted = true;
+        p = end;
+    }
+}
+
+struct traffic_quota * traffic_quota_create(uint64_t daily_limit, uint64_t monthly_limit, const char *state_file, const char *users) {
+    struct traffic_quota *quota = (struct traffic_quota *) calloc(1, sizeof(*quota));
+    quota->daily_limit = daily_limit;
+    quota->monthly_limit = monthly_limit;
+    if (state_file && strlen(state_file)) {
+        quota->state_file = strdup(state_file);
+    }
+    if (users && strlen(users)) {
+        traffic_quota_add_users(quota, users);
+    }
+    return quota;
+}
+
+void traffic_quota_destroy(struct traffic_quota *quota) {
+    if (quota == NULL) {
+        return;
+    }
+    free(quota->state_file);
+    free(quota);
+}
+
+bool traffic_quota_load(struct traffic_quota *quota) {
+    FILE *fp = NULL;
+    char line[256] = { 0 };
+    bool result = false;
+    do {
+        if (quota == NULL || quota->state_file == NULL) {
+            break;
+        }
+        fp = fopen(quota->state_file, "r");
+        if (fp == NULL) {
+            break;
+        }
+        if (fgets(line, sizeof(line), fp) == NULL ||
+            strncmp(line, TRAFFIC_QUOTA_FILE_TAG, strlen(TRAFFIC_QUOTA_FILE_TAG)) != 0)
+        {
+            pr_warn("traffic quota file \"%s\" is not recognized", quota->state_file);
+            break;
+        }
+        while (fgets(line, sizeof(line), fp)) {
+            unsigned long uid = 0, day = 0, month = 0;
+            unsigned long long daily = 0, monthly = 0, total_conn = 0;
+            struct user_traffic *user;
+            if (sscanf(line, "%lu %lu %llu %lu %llu %llu",
+                &uid, &day, &daily, &month, &monthly, &total_conn) != 6)
+            {
+                continue;
+            }
+            user = traffic_quota_slot(quota, (uint32_t)uid, quota->restricted == false);
+            if (user == NULL) {
+                continue;
+            }
+            user->day = (uint32_t)day;
+            user->daily_bytes = (uint64_t)daily;
+            user->month = (uint32_t)month;
+            user->monthly_bytes = (uint64_t)monthly;
+            user->total_connections = (uint64_t)total_conn;
+        }
+        result = true;
+    } while (0);
+    if (fp) {
+        fclose(fp);
+    }
+    return result;
+}
+
+/* Write to a side file and rename it over the old one, so a crash never leaves half a file. */
+bool traffic_quota_save(const struct traffic_quota *quota) {
+    FILE *fp = NULL;
+    char *tmp_file = NULL;
+    bool result = false;
+    size_t i;
+    do {
+        if (quota == NULL || quota->state_file == NULL) {
+            break;
+        }
+        tmp_file = (char *) calloc(strlen(quota->state_file) + 8, sizeof(char));
+        sprintf(tmp_file, "%s.tmp", quota->state_file);
+
+        fp = fopen(tmp_file, "w");
+        if (fp == NULL) {
+            pr_err("can not write traffic quota file \"%s\"", tmp_file);
+            break;
+        }
+        fprintf(fp, "%s\n", TRAFFIC_QUOTA_FILE_TAG);
+        for (i = 0; i < TRAFFIC_QUOTA_MAX_USERS; ++i) {
+            const struct user_traffic *user = &quota->users[i];
+            if (user->in_use == false) {
+                continue;
+            }
+            fprintf(fp, "%lu %lu %llu %lu %llu %llu\n",
+                (unsigned long)user->uid,
+                (unsigned long)user->day, (unsigned long long)user->daily_bytes,
+                (unsigned long)user->month, (unsigned long long)user->monthly_bytes,
+                (unsigned long long)user->total_connections);
+        }
+        if (fflush(fp) != 0) {
+            break;
+        }
+#if !defined(_WIN32)
+        fsync(fileno(fp));
+#endif // !defined(_WIN32)
+        fclose(fp);
+        fp = NULL;
+
+#if defined(_WIN32)
+        remove(quota->state_file);
+#endif // defined(_WIN32)
+        if (rename(tmp_file, quota->state_file) != 0) {
+            pr_err("can not replace traffic quota file \"%s\"", quota->state_file);
+            break;
+        }
+        result = true;
+    } while (0);
+    if (fp) {
+        fclose(fp);
+        remove(tmp_file);
+    }
+    free(tmp_file);
+    return result;
+}
+
+struct user_traffic * traffic_quota_acquire(struct traffic_quota *quota, uint32_t uid) {
+    struct user_traffic *user;
+    uint32_t day = 0, month = 0;
+    if (quota == NULL) {
+        return NULL;
+    }
+    // The uid is picked by the client, so an open table could be filled
+    // with made-up ones. With a user list, anything else is refused.
+    user = traffic_quota_slot(quota, uid, quota->restricted == false);
+    if (user == NULL) {
+        return NULL;
+    }
+    current_period(&day, &month);
+    user_traffic_roll(user, day, month);
+    user->connections++;
+    user->total_connections++;
+    return user;
+}
+
+void traffic_quota_release(struct user_traffic *user) {
+    if (user && user->connections) {
+        user->connections--;
+    }
+}
+
+void traffic_quota_account(struct user_traffic *user, size_t bytes) {
+    user->daily_bytes += bytes;
+    user->monthly_bytes += bytes;
+}
+
+bool traffic_quota_exceeded(const struct traffic_quota *quota, const struct user_traffic *user) {
+    if (quota == NULL || user == NULL) {
+        return false;
+    }
+    if (quota->daily_limit && user->daily_bytes >= quota->daily_limit) {
+        return true;
+    }
+    if (quota->monthly_limit && user->monthly_bytes >= quota->monthly_limit) {
+        return true;
+    }
+    return false;
+}
+
+/* Start new day / month periods. Called from a timer, never from the relay path. */
+void traffic_quota_refresh(struct traffic_quota *quota) {
+    uint32_t day = 0, month = 0;
+    size_t i;
+    if (quota == NULL) {
+        return;
+    }
+    current_period(&day, &month);
+    for (i = 0; i < TRAFFIC_QUOTA_MAX_USERS; ++i) {
+        struct user_traffic *user = &quota->users[i];
+        if (user->in_use) {
+            user_traffic_roll(user, day, month);
+        }
+    }
+}
@@ -0,0 +1,42 @@
+#if !defined(__traffic_quota_h__)
+#define __traffic_quota_h__ 1
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifndef TRAFFIC_QUOTA_MAX_USERS
+#define TRAFFIC_QUOTA_MAX_USERS 1024  /* Must be a power of two. */
+#endif
+
+/*
+ * One slot of the fixed-size user table. The relay path only ever touches
+ * the two byte counters, which share a cache line with the uid.
+ */
+struct user_traffic {
+    uint32_t uid;
+    bool in_use;
+    uint32_t connections;   /* Tunnels currently open for this user. */
+    uint32_t day;           /* Period that |daily_bytes| belongs to.   */
+    uint32_t month;         /* Period that |monthly_bytes| belongs to. */
+    uint64_t daily_bytes;
+    uint64_t monthly_bytes;
+    uint64_t total_connections;
+};
+
+struct traffic_quota;
+
+struct traffic_quota * traffic_quota_create(uint64_t daily_limit, uint64_t monthly_limit, const char *state_file, const char *users);
+void traffic_quota_destroy(struct traffic_quota *quota);
+
+bool traffic_quota_load(struct traffic_quota *quota);
+bool traffic_quota_save(const struct traffic_quota *quota);
+
+/* NULL means the uid is not accounted, and the connection must be refused. */
+struct user_traffic * traffic_quota_acquire(struct traffic_quota *quota, uint32_t uid);
+void traffic_quota_release(struct user_traffic *user);
+void traffic_quota_account(struct user_traffic *user, size_t bytes);
+bool traffic_quota_exceeded(const struct traffic_quota *quota, const struct user_traffic *user);
+void traffic_quota_refresh(struct traffic_quota *quota);
+
+#endif // !defined(__traffic_quota_h__)
@@ -69,6 +69,7 @@ enum ss_cipher_type ss_cipher_type_of_name(const char *name);
     V(12, ssr_protocol_auth_chain_d,    "auth_chain_d")                        \
     V(13, ssr_protocol_auth_chain_e,    "auth_chain_e")                        \
     V(14, ssr_protocol_auth_chain_f,    "auth_chain_f")                        \
+    V(15, ssr_protocol_auth_chain_jumbo,"auth_chain_jumbo")                    \
 //    V( 2, ssr_protocol_verify_sha1,     "verify_sha1")                         \
 
 typedef enum ssr_protocol {
@@ -40,6 +40,15 @@
 #include "obfs.h"
 #include "crc32.h"
 #include "cstl_lib.h"
+#include "ssr_cipher_names.h"
+
+/* Give up on protocol detection when this much data matched no candidate. */
+#ifndef SSR_PROTOCOL_TRIAL_MAX
+#define SSR_PROTOCOL_TRIAL_MAX 2048
+#endif
+
+/* Bytes needed to tell a TLS record, an HTTP request line and plain data apart. */
+#define SSR_OBFS_PICK_MIN 3
 
 const char * ssr_strerror(enum ssr_error err) {
 #define SSR_ERR_GEN(_, name, errmsg) case (name): return errmsg;
@@ -52,6 +61,12 @@ const char * ssr_strerror(enum ssr_error err) {
 }
 
 void init_obfs(struct server_env_t *env, const char *protocol, const char *obfs);
+static size_t parse_candidates(const char *list, const char *fallback, char *names[SSR_MAX_CANDIDATES]);
+static void * plugin_global_data(const char *name);
+static struct obfs_t * tunnel_cipher_new_plugin(struct tunnel_cipher_ctx *tc, const char *name, char *param, void *g_data);
+static void tunnel_cipher_update_overhead(struct tunnel_cipher_ctx *tc);
+static bool tunnel_cipher_server_pick_obfs(struct tunnel_cipher_ctx *tc, const struct buffer_t *buf);
+static struct buffer_t * tunnel_cipher_server_pick_protocol(struct tunnel_cipher_ctx *tc, const struct buffer_t *plain, bool *feedback);
 
 void object_safe_free(void **obj) {
     if (obj && *obj) {
@@ -79,10 +94,42 @@ struct server_config * config_create(void) {
     return config;
 }
 
+#define SERVER_CONFIG_STRINGS(V)                                            \
+    V(listen_host) V(remote_host) V(password) V(method)                     \
+    V(protocol) V(protocol_param) V(obfs) V(obfs_param) V(remarks)          \
+    V(quota_state_file) V(quota_users) V(protocol_accept) V(obfs_accept)   \
+    V(crypto_backend) V(udp_single_reply_ports)                             \
+
+/* Deep copy of one config, without the bindings chained after it. */
+struct server_config * config_clone(const struct server_config *src) {
+    struct server_config *config;
+
+    config = (struct server_config *) calloc(1, sizeof(*config));
+    *config = *src;
+    config->next_binding = NULL;
+    config->routes = NULL;
+    config->route_count = 0;
+#define SERVER_CONFIG_STRING_COPY(field) \
+    config->field = NULL; string_safe_assign(&config->field, src->field);
+    SERVER_CONFIG_STRINGS(SERVER_CONFIG_STRING_COPY)
+#undef SERVER_CONFIG_STRING_COPY
+
+    return config;
+}
+
 void config_release(struct server_config *cf) {
     if (cf == NULL) {
         return;
     }
+    config_release(cf->next_binding);
+    {
+        size_t i;
+        for (i = 0; i < cf->route_count; ++i) {
+            object_safe_free((void **)&cf->routes[i].match);
+            object_safe_free((void **)&cf->routes[i].server);
+        }
+        object_safe_free((void **)&cf->routes);
+    }
     object_safe_free((void **)&cf->listen_host);
     object_safe_free((void **)&cf->remote_host);
     object_safe_free((void **)&cf->password);
@@ -92,6 +139,12 @@ void config_release(struct server_config *cf) {
     object_safe_free((void **)&cf->obfs);
     object_safe_free((void **)&cf->obfs_param);
     object_safe_free((void **)&cf->remarks);
+    object_safe_free((void **)&cf->quota_state_file);
+    object_safe_free((void **)&cf->quota_users);
+    object_safe_free((void **)&cf->protocol_accept);
+    object_safe_free((void **)&cf->obfs_accept);
+    object_safe_free((void **)&cf->crypto_backend);
+    object_safe_free((void **)&cf->udp_single_reply_ports);
 
     object_safe_free((void **)&cf);
 }
@@ -121,6 +174,7 @@ struct server_env_t * ssr_cipher_env_create(struct server_config *config, void *
     srand((unsigned int)time(NULL));
 
     env = (struct server_env_t *) calloc(1, sizeof(struct server_env_t));
+    ss_crypto_backend_prefer(config->crypto_backend);
     env->cipher = cipher_env_new_instance(config->password, config->method);
     env->config = config;
     env->data = data;
@@ -128,6 +182,18 @@ struct server_env_t * ssr_cipher_env_create(struct server_config *config, void *
     // init obfs
     init_obfs(env, config->protocol, config->obfs);
 
+    env->protocol_count = parse_candidates(config->protocol_accept, config->protocol, env->protocol_names);
+    env->obfs_count = parse_candidates(config->obfs_accept, config->obfs, env->obfs_names);
+    {
+        size_t i;
+        for (i = 0; i < env->protocol_count; ++i) {
+            env->protocol_globals[i] = plugin_global_data(env->protocol_names[i]);
+        }
+        for (i = 0; i < env->obfs_count; ++i) {
+            env->obfs_globals[i] = plugin_global_data(env->obfs_names[i]);
+        }
+    }
+
     env->tunnel_set = objects_container_create();
     
     return env;
@@ -139,6 +205,17 @@ void ssr_cipher_env_release(struct server_env_t *env) {
     }
     object_safe_free(&env->protocol_global);
     object_safe_free(&env->obfs_global);
+    {
+        size_t i;
+        for (i = 0; i < env->protocol_count; ++i) {
+            object_safe_free((void **)&env->protocol_names[i]);
+            object_safe_free(&env->protocol_globals[i]);
+        }
+        for (i = 0; i < env->obfs_count; ++i) {
+            object_safe_free((void **)&env->obfs_names[i]);
+            object_safe_free(&env->obfs_globals[i]);
+        }
+    }
     cipher_env_release(env->cipher);
 
     objects_container_destroy(env->tunnel_set);
@@ -249,6 +326,76 @@ void init_obfs(struct server_env_t *env, const char *protocol, const char *obfs)
     }
 }
 
+/*
+ * Split a comma separated name list. "origin" accepts anything, so it is
+ * always moved to the end where it only catches what nothing else claimed.
+ */
+static size_t parse_candidates(const char *list, const char *fallback, char *names[SSR_MAX_CANDIDATES]) {
+    size_t count = 0;
+    size_t i;
+    if (list && strlen(list)) {
+        char *copy = strdup(list);
+        char *token = strtok(copy, ", ");
+        while (token && count < SSR_MAX_CANDIDATES) {
+            names[count++] = strdup(token);
+            token = strtok(NULL, ", ");
+        }
+        free(copy);
+    }
+    if (count == 0 && fallback) {
+        names[count++] = strdup(fallback);
+    }
+    for (i = 0; i + 1 < count; ++i) {
+        if (ssr_protocol_type_of_name(names[i]) == ssr_protocol_origin) {
+            char *origin = names[i];
+            memmove(&names[i], &names[i + 1], (count - i - 1) * sizeof(names[0]));
+            names[count - 1] = origin;
+            break;
+        }
+    }
+    return count;
+}
+
+static void * plugin_global_data(const char *name) {
+    void *g_data = NULL;
+    struct obfs_t *plugin = new_obfs_instance(name);
+    if (plugin) {
+        g_data = plugin->init_data();
+        free_obfs_instance(plugin);
+    }
+    return g_data;
+}
+
+static struct obfs_t * tunnel_cipher_new_plugin(struct tunnel_cipher_ctx *tc, const char *name, char *param, void *g_data) {
+    struct obfs_t *plugin = new_obfs_instance(name);
+    if (plugin) {
+        struct server_info_t server_info = *tc->info_template;
+        server_info.param = param;
+        server_info.g_data = g_data;
+        plugin->set_server_info(plugin, &server_info);
+    }
+    return plugin;
+}
+
+static void tunnel_cipher_update_overhead(struct tunnel_cipher_ctx *tc) {
+    struct obfs_t *protocol = tc->protocol;
+    struct obfs_t *obfs = tc->obfs;
+    size_t total_overhead = 
+        (protocol ? protocol->get_overhead(protocol) : 0) +
+        (obfs ? obfs->get_overhead(obfs) : 0);
+
+    if (protocol) {
+        struct server_info_t *info = protocol->get_server_info(protocol);
+        info->overhead = (uint16_t)total_overhead;
+        info->buffer_size = (uint32_t)(TCP_BUF_SIZE_MAX - total_overhead);
+    }
+    if (obfs) {
+        struct server_info_t *info = obfs->get_server_info(obfs);
+        info->overhead = (uint16_t)total_overhead;
+        info->buffer_size = (uint32_t)(TCP_BUF_SIZE_MAX - total_overhead);
+    }
+}
+
 struct tunnel_cipher_ctx * tunnel_cipher_create(struct server_env_t *env, size_t tcp_mss) {
     struct server_info_t server_info = { {0}, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
 
@@ -276,43 +423,35 @@ struct tunnel_cipher_ctx * tunnel_cipher_create(struct server_env_t *env, size_t
     server_info.tcp_mss = (uint16_t) tcp_mss;
     server_info.buffer_size = SSR_BUFF_SIZE;
     server_info.cipher_env = env->cipher;
-    {
-        server_info.param = config->obfs_param;
-        server_info.g_data = env->obfs_global;
+    server_info.padding_budget = (uint16_t) config->padding_budget;
 
-        tc->obfs = new_obfs_instance(config->obfs);
-        if (tc->obfs) {
-            tc->obfs->set_server_info(tc->obfs, &server_info);
-        }
-    }
-    {
-        server_info.param = config->protocol_param;
-        server_info.g_data = env->protocol_global;
+    tc->info_template = (struct server_info_t *) calloc(1, sizeof(struct server_info_t));
+    *tc->info_template = server_info;
 
-        tc->protocol = new_obfs_instance(config->protocol);
-        if (tc->protocol) {
-            tc->protocol->set_server_info(tc->protocol, &server_info);
+    if (env->obfs_count > 1) {
+        // Several obfs on this port, the first bytes from the client decide.
+        tc->obfs_pending = true;
+    } else if (env->obfs_count == 1) {
+        tc->obfs = tunnel_cipher_new_plugin(tc, env->obfs_names[0], config->obfs_param, env->obfs_globals[0]);
+    } else {
+        tc->obfs = tunnel_cipher_new_plugin(tc, config->obfs, config->obfs_param, env->obfs_global);
+    }
+    if (env->protocol_count > 1) {
+        size_t i;
+        for (i = 0; i < env->protocol_count; ++i) {
+            tc->protocol_candidates[i] = tunnel_cipher_new_plugin(tc, env->protocol_names[i],
+                config->protocol_param, env->protocol_globals[i]);
+            tc->protocol_candidate_index[i] = i;
         }
+        tc->protocol_candidate_count = env->protocol_count;
+        tc->protocol_pending = true;
+    } else if (env->protocol_count == 1) {
+        tc->protocol = tunnel_cipher_new_plugin(tc, env->protocol_names[0], config->protocol_param, env->protocol_globals[0]);
+    } else {
+        tc->protocol = tunnel_cipher_new_plugin(tc, config->protocol, config->protocol_param, env->protocol_global);
     }
 
-    {
-        struct obfs_t *protocol = tc->protocol;
-        struct obfs_t *obfs = tc->obfs;
-        size_t total_overhead = 
-            (protocol ? protocol->get_overhead(protocol) : 0) +
-            (obfs ? obfs->get_overhead(obfs) : 0);
-
-        if (protocol) {
-            struct server_info_t *info = protocol->get_server_info(protocol);
-            info->overhead = (uint16_t)total_overhead;
-            info->buffer_size = (uint32_t)(TCP_BUF_SIZE_MAX - total_overhead);
-        }
-        if (obfs) {
-            struct server_info_t *info = obfs->get_server_info(obfs);
-            info->overhead = (uint16_t)total_overhead;
-            info->buffer_size = (uint32_t)(TCP_BUF_SIZE_MAX - total_overhead);
-        }
-    }
+    tunnel_cipher_update_overhead(tc);
     // SSR end
 
    return tc;
@@ -333,10 +472,45 @@ void tunnel_cipher_release(struct tunnel_cipher_ctx *tc) {
 
     free_obfs_instance(tc->protocol);
     free_obfs_instance(tc->obfs);
+    {
+        size_t i;
+        for (i = 0; i < tc->protocol_candidate_count; ++i) {
+            free_obfs_instance(tc->protocol_candidates[i]);
+        }
+    }
+    buffer_free(tc->protocol_trial);
+    buffer_free(tc->obfs_trial);
+    free(tc->info_template);
 
     free(tc);
 }
 
+/* Put the protocol this client address used last time at the head of the candidate list. */
+void tunnel_cipher_server_set_peer(struct tunnel_cipher_ctx *tc, uint32_t peer_hash) {
+    uint8_t hint;
+    size_t i;
+    tc->peer_hash = peer_hash;
+    if (tc->protocol_pending == false) {
+        return;
+    }
+    hint = tc->env->protocol_hint[peer_hash % SSR_PROTOCOL_HINT_SLOTS];
+    if (hint == 0) {
+        return;
+    }
+    for (i = 1; i < tc->protocol_candidate_count; ++i) {
+        // "origin" takes anything, it must stay the last resort.
+        if (tc->protocol_candidates[i] && tc->protocol_candidate_index[i] == (size_t)(hint - 1)) {
+            struct obfs_t *plugin = tc->protocol_candidates[i];
+            size_t index = tc->protocol_candidate_index[i];
+            memmove(&tc->protocol_candidates[1], &tc->protocol_candidates[0], i * sizeof(tc->protocol_candidates[0]));
+            memmove(&tc->protocol_candidate_index[1], &tc->protocol_candidate_index[0], i * sizeof(tc->protocol_candidate_index[0]));
+            tc->protocol_candidates[0] = plugin;
+            tc->protocol_candidate_index[0] = index;
+            break;
+        }
+    }
+}
+
 bool tunnel_cipher_client_need_feedback(struct tunnel_cipher_ctx *tc) {
     bool protocol = false;
     bool obfs = false;
@@ -352,6 +526,29 @@ bool tunnel_cipher_client_need_feedback(struct tunnel_cipher_ctx *tc) {
     return (protocol || obfs);
 }
 
+/*
+ * Bytes still to be received before the decoders can hand on more data.
+ * A lower bound, never more than the peer is bound to send. 0 when the
+ * plugins can't tell, before the IV arrived or while plugins are chosen.
+ */
+size_t tunnel_cipher_recv_need(struct tunnel_cipher_ctx *tc) {
+    size_t need = 0;
+    if (tc == NULL || tc->obfs_pending || tc->protocol_pending) {
+        return 0;
+    }
+    if (tc->d_ctx && enc_ctx_has_iv(tc->d_ctx) == false) {
+        return 0;
+    }
+    // The stream cipher in between keeps lengths, the obfs wraps what the protocol waits for.
+    if (tc->protocol && tc->protocol->get_recv_need) {
+        need = tc->protocol->get_recv_need(tc->protocol, 0);
+    }
+    if (tc->obfs) {
+        need = tc->obfs->get_recv_need ? tc->obfs->get_recv_need(tc->obfs, need) : 0;
+    }
+    return need;
+}
+
 // insert shadowsocks header
 enum ssr_error tunnel_cipher_client_encrypt(struct tunnel_cipher_ctx *tc, struct buffer_t *buf) {
     int err;
@@ -361,8 +558,13 @@ enum ssr_error tunnel_cipher_client_encrypt(struct tunnel_cipher_ctx *tc, struct
     struct obfs_t *protocol_plugin = tc->protocol;
     ASSERT(buf->capacity >= SSR_BUFF_SIZE);
     if (protocol_plugin && protocol_plugin->client_pre_encrypt) {
+        size_t len = buf->len;
         buf->len = (size_t)protocol_plugin->client_pre_encrypt(
             tc->protocol, (char **)&buf->buffer, (int)buf->len, &buf->capacity);
+        if (len && buf->len == 0) {
+            // The protocol refused to pack the data, e.g. it has no session key.
+            return ssr_error_client_pre_encrypt;
+        }
     }
     err = ss_encrypt(env->cipher, buf, tc->e_ctx, SSR_BUFF_SIZE);
     if (err != 0) {
@@ -459,14 +661,33 @@ tunnel_cipher_server_decrypt(struct tunnel_cipher_ctx *tc,
     bool need_decrypt = true;
     int err;
     struct server_env_t *env = tc->env;
-    struct obfs_t *obfs = tc->obfs;
-    struct obfs_t *protocol = tc->protocol;
+    struct obfs_t *obfs;
+    struct obfs_t *protocol;
     struct buffer_t *ret = NULL;
     BUFFER_CONSTANT_INSTANCE(empty, "", 0);
 
     if (receipt) { *receipt = NULL; }
     if (confirm) { *confirm = NULL; }
 
+    if (tc->obfs_pending) {
+        if (tc->obfs_trial || buf->len < SSR_OBFS_PICK_MIN) {
+            if (tc->obfs_trial == NULL) {
+                tc->obfs_trial = buffer_alloc(SSR_BUFF_SIZE);
+            }
+            buffer_concatenate2(tc->obfs_trial, buf);
+            if (tc->obfs_trial->len < SSR_OBFS_PICK_MIN) {
+                // Keep the choice open until there is enough to tell.
+                return buffer_alloc(SSR_BUFF_SIZE);
+            }
+            buf = tc->obfs_trial;
+        }
+        if (tunnel_cipher_server_pick_obfs(tc, buf) == false) {
+            return NULL;
+        }
+    }
+    obfs = tc->obfs;
+    protocol = tc->protocol;
+
     if (obfs && obfs->server_decode) {
         bool need_feedback = false;
         ret = obfs->server_decode(obfs, buf, &need_decrypt, &need_feedback);
@@ -496,16 +717,41 @@ tunnel_cipher_server_decrypt(struct tunnel_cipher_ctx *tc,
             memmove(protocol->server.recv_iv, ret->buffer, iv_len);
             protocol->server.recv_iv_len = iv_len;
         }
+        if (tc->protocol_pending) {
+            size_t i;
+            for (i = 0; i < tc->protocol_candidate_count; ++i) {
+                struct obfs_t *candidate = tc->protocol_candidates[i];
+                if (candidate && candidate->server.recv_iv[0] == 0) {
+                    size_t iv_len = (size_t) candidate->server.iv_len;
+                    memmove(candidate->server.recv_iv, ret->buffer, iv_len);
+                    candidate->server.recv_iv_len = iv_len;
+                }
+            }
+        }
 
         err = ss_decrypt(env->cipher, ret, tc->d_ctx, max(SSR_BUFF_SIZE, ret->capacity));
         if (err != 0) {
             return NULL;
         }
     }
-    if (protocol && protocol->server_post_decrypt) {
+    if (tc->protocol_pending && ret) {
+        bool feedback = false;
+        struct buffer_t *tmp = tunnel_cipher_server_pick_protocol(tc, ret, &feedback);
+        buffer_free(ret); ret = tmp;
+        if (feedback) {
+            if (confirm) {
+                *confirm  = tunnel_cipher_server_encrypt(tc, empty);
+            }
+        }
+    } else if (protocol && protocol->server_post_decrypt) {
         bool feedback = false;
         struct buffer_t *tmp = protocol->server_post_decrypt(protocol, ret, &feedback);
         buffer_free(ret); ret = tmp;
+        if (protocol->rejected) {
+            // An empty result means "not enough yet", a rejected client is dropped now.
+            buffer_free(ret);
+            return NULL;
+        }
         if (feedback) {
             if (confirm) {
                 *confirm  = tunnel_cipher_server_encrypt(tc, empty);
@@ -515,6 +761,127 @@ tunnel_cipher_server_decrypt(struct tunnel_cipher_ctx *tc,
     return ret;
 }
 
+//
+// Pick the obfs from the first bytes: a TLS handshake record, an HTTP request
+// line, or anything else for plain. The first accepted obfs of that kind wins.
+//
+static bool tunnel_cipher_server_pick_obfs(struct tunnel_cipher_ctx *tc, const struct buffer_t *buf) {
+    static const char *http_methods[] = { "GET ", "POST ", "HEAD ", "PUT ", "OPTIONS ", "CONNECT " };
+    struct server_env_t *env = tc->env;
+    bool is_tls = false;
+    bool is_http = false;
+    size_t i;
+
+    if (buf->len < SSR_OBFS_PICK_MIN) {
+        return false;
+    }
+    is_tls = (buf->buffer[0] == 0x16 && buf->buffer[1] == 0x03);
+    for (i = 0; is_tls == false && i < sizeof(http_methods) / sizeof(http_methods[0]); ++i) {
+        size_t len = strlen(http_methods[i]);
+        if (buf->len >= len && memcmp(buf->buffer, http_methods[i], len) == 0) {
+            is_http = true;
+        }
+    }
+    for (i = 0; i < env->obfs_count; ++i) {
+        enum ssr_obfs type = ssr_obfs_type_of_name(env->obfs_names[i]);
+        bool tls = (type == ssr_obfs_tls_1_2_ticket_auth || type == ssr_obfs_tls_1_2_ticket_fastauth);
+        bool http = (type == ssr_obfs_http_simple || type == ssr_obfs_http_post);
+        bool plain = (type == ssr_obfs_plain);
+        if ((is_tls && tls) || (is_http && http) || (!is_tls && !is_http && plain)) {
+            tc->obfs = tunnel_cipher_new_plugin(tc, env->obfs_names[i], env->config->obfs_param, env->obfs_globals[i]);
+            tc->obfs_pending = false;
+            tunnel_cipher_update_overhead(tc);
+            return true;
+        }
+    }
+    return false;
+}
+
+//
+// Feed the decrypted data to every candidate protocol, in order. The first
+// one whose MAC verifies (it returns data or asks for feedback) wins; the
+// ones that reject it are dropped, the undecided ones wait for more data.
+// "origin" takes anything, so it only wins once every other candidate has
+// rejected the client, or the trial limit is reached.
+//
+static struct buffer_t * tunnel_cipher_server_pick_protocol(struct tunnel_cipher_ctx *tc, const struct buffer_t *plain, bool *feedback) {
+    struct server_env_t *env = tc->env;
+    struct buffer_t *out = NULL;
+    size_t count = 0;
+    size_t i;
+
+    if (tc->protocol_trial == NULL) {
+        tc->protocol_trial = buffer_alloc(SSR_BUFF_SIZE);
+    }
+    buffer_concatenate2(tc->protocol_trial, plain);
+
+    for (i = 0; i < tc->protocol_candidate_count; ++i) {
+        struct obfs_t *candidate = tc->protocol_candidates[i];
+        size_t index = tc->protocol_candidate_index[i];
+        bool fb = false;
+
+        if (out) {
+            free_obfs_instance(candidate);
+            continue;
+        }
+        if (candidate == NULL || candidate->server_post_decrypt == NULL) {
+            if (count && tc->protocol_trial->len <= SSR_PROTOCOL_TRIAL_MAX) {
+                tc->protocol_candidates[count] = candidate;
+                tc->protocol_candidate_index[count] = index;
+                ++count;
+                continue;
+            }
+            out = buffer_clone(tc->protocol_trial);
+        } else {
+            // A protocol may consume its input, so each one gets its own copy.
+            struct buffer_t *copy = buffer_clone(plain);
+            out = candidate->server_post_decrypt(candidate, copy, &fb);
+            buffer_free(copy);
+            if (out == NULL || candidate->rejected) {
+                buffer_free(out); out = NULL;
+                free_obfs_instance(candidate);
+                continue;
+            }
+            if (out->len == 0 && fb == false) {
+                buffer_free(out); out = NULL;
+                tc->protocol_candidates[count] = candidate;
+                tc->protocol_candidate_index[count] = index;
+                ++count;
+                continue;
+            }
+        }
+        tc->protocol = candidate;
+        tc->protocol_pending = false;
+        env->protocol_hint[tc->peer_hash % SSR_PROTOCOL_HINT_SLOTS] = (uint8_t)(index + 1);
+        *feedback = fb;
+    }
+
+    if (out) {
+        // Candidates after the winner are already gone, drop the undecided ones before it.
+        for (i = 0; i < count; ++i) {
+            free_obfs_instance(tc->protocol_candidates[i]);
+        }
+        tc->protocol_candidate_count = 0;
+        buffer_free(tc->protocol_trial);
+        tc->protocol_trial = NULL;
+        tunnel_cipher_update_overhead(tc);
+        return out;
+    }
+    tc->protocol_candidate_count = count;
+    if (count == 0 || tc->protocol_trial->len > SSR_PROTOCOL_TRIAL_MAX) {
+        return NULL;
+    }
+    return buffer_alloc(SSR_BUFF_SIZE);
+}
+
+bool tunnel_cipher_server_user_id(struct tunnel_cipher_ctx *tc, uint32_t *uid) {
+    struct obfs_t *protocol = tc ? tc->protocol : NULL;
+    if (protocol && protocol->get_user_id) {
+        return protocol->get_user_id(protocol, uid);
+    }
+    return false;
+}
+
 bool pre_parse_header(struct buffer_t *data) {
     uint8_t datatype = 0;
     size_t rand_data_size = 0;
@@ -571,12 +938,16 @@ bool pre_parse_header(struct buffer_t *data) {
             return false;
         }
         data_size = (size_t) ntohs( *((uint16_t *)(data->buffer+1)) );
+        start_pos = (size_t)(3 + data->buffer[3]);
+        if (data_size > data->len || data_size < start_pos + 4) {
+            // not all here yet, or a length no header can have
+            return false;
+        }
         crc = crc32_imp(data->buffer, data_size);
         if (crc != 0xffffffff) {
             // uncorrect CRC32, maybe wrong password or encryption method
             return false;
         }
-        start_pos = (size_t)(3 + data->buffer[3]);
 
         data->len = data_size - (4 + start_pos);
         memmove(data->buffer, data->buffer + start_pos, data->len);
@@ -13,6 +13,18 @@ struct cipher_env_t;
 struct obfs_t;
 struct tunnel_ctx;
 struct cstl_set;
+struct server_info_t;
+
+/* Upper bound for the obfs / protocol sets one server port accepts. */
+#define SSR_MAX_CANDIDATES 8
+
+/* Remembered protocol choices, keyed by a hash of the client address. */
+#define SSR_PROTOCOL_HINT_SLOTS 1024
+
+struct server_route {
+    char *match;  /* Destination rule, see client/route.h. */
+    char *server;  /* "remarks" of the binding that carries it. */
+};
 
 struct server_config {
     char *listen_host;
@@ -28,6 +40,28 @@ struct server_config {
     bool udp;
     unsigned int idle_timeout; /* Connection idle timeout in ms. */
     char *remarks;
+    /*
+     * Per-user traffic quotas, 0 is unlimited. They are advisory: every uid
+     * shares the server password, so a client can claim any uid it likes.
+     */
+    unsigned int quota_daily_mb;
+    unsigned int quota_monthly_mb;
+    char *quota_state_file;
+    char *quota_users; /* Comma separated uids that are accounted, empty takes any uid. */
+    unsigned int padding_budget; /* Client: announced to the server in the auth_chain header. */
+    char *protocol_accept; /* Server: comma separated protocols taken on the same port. */
+    char *obfs_accept; /* Server: comma separated obfs taken on the same port. */
+    unsigned int memory_budget_mb; /* Cap on buffered relay data, 0 uses the built-in default. */
+    unsigned int drain_timeout; /* Grace period for open tunnels on shutdown in ms, 0 closes them at once. */
+    unsigned short transparent_port; /* Client: port for iptables-redirected connections, 0 is off. */
+    unsigned int stripes; /* Upstream connections per tunnel on the client, most accepted on the server. 0 or 1 is off. */
+    char *crypto_backend; /* Preferred cipher implementation, empty picks the fastest. */
+    char *udp_single_reply_ports; /* Client: comma separated UDP ports closed after their reply, NULL is DNS and NTP. */
+    unsigned int udp_single_reply_timeout; /* Client: how long those wait for the reply in ms, 0 uses the built-in default. */
+    struct server_config *next_binding; /* Client: another listener -> server pair in this process. */
+    bool route_only; /* Client: binding reached through "routes" only, no listener of its own. */
+    struct server_route *routes; /* Client: destination rules, top level config only. */
+    size_t route_count;
 };
 
 #if !defined(_LOCAL_H)
@@ -42,6 +76,14 @@ struct server_env_t {
 
     void *protocol_global;
     void *obfs_global;
+
+    size_t protocol_count;
+    char *protocol_names[SSR_MAX_CANDIDATES];
+    void *protocol_globals[SSR_MAX_CANDIDATES];
+    size_t obfs_count;
+    char *obfs_names[SSR_MAX_CANDIDATES];
+    void *obfs_globals[SSR_MAX_CANDIDATES];
+    uint8_t protocol_hint[SSR_PROTOCOL_HINT_SLOTS]; /* Candidate index + 1, 0 is unknown. */
 };
 #endif // _LOCAL_H
 
@@ -51,6 +93,17 @@ struct tunnel_cipher_ctx {
     struct enc_ctx *d_ctx;
     struct obfs_t *protocol; // __strong_ptr
     struct obfs_t *obfs; // __strong_ptr
+
+    // Server side with several accepted protocols / obfs: chosen on the first packets.
+    struct server_info_t *info_template;
+    bool obfs_pending;
+    bool protocol_pending;
+    size_t protocol_candidate_count;
+    size_t protocol_candidate_index[SSR_MAX_CANDIDATES];
+    struct obfs_t *protocol_candidates[SSR_MAX_CANDIDATES];
+    struct buffer_t *obfs_trial; // First bytes, kept while too few to pick the obfs.
+    struct buffer_t *protocol_trial; // Decrypted bytes seen while picking, replayed to "origin".
+    uint32_t peer_hash;
 };
 
 #define SSR_ERR_MAP(V)                                                         \
@@ -58,6 +111,7 @@ struct tunnel_cipher_ctx {
   V(-1, ssr_error_client_decode,      "client decode error.")                  \
   V(-2, ssr_error_invalid_password,   "invalid password or cipher.")           \
   V(-3, ssr_error_client_post_decrypt,"client post decrypt error.")            \
+  V(-4, ssr_error_client_pre_encrypt, "client pre encrypt error.")             \
 
 typedef enum ssr_error {
 #define SSR_ERR_GEN(code, name, _) name = code,
@@ -86,6 +140,7 @@ void string_safe_assign(char **target, const char *value);
 #endif
 
 struct server_config * config_create(void);
+struct server_config * config_clone(const struct server_config *src);
 void config_release(struct server_config *cf);
 void config_change_for_server(struct server_config *config);
 
@@ -111,12 +166,15 @@ void obj_map_traverse(struct cstl_map *map, void(*fn)(const void *key, const voi
 
 struct tunnel_cipher_ctx * tunnel_cipher_create(struct server_env_t *env, size_t tcp_mss);
 void tunnel_cipher_release(struct tunnel_cipher_ctx *tc);
+void tunnel_cipher_server_set_peer(struct tunnel_cipher_ctx *tc, uint32_t peer_hash);
 bool tunnel_cipher_client_need_feedback(struct tunnel_cipher_ctx *tc);
+size_t tunnel_cipher_recv_need(struct tunnel_cipher_ctx *tc);
 enum ssr_error tunnel_cipher_client_encrypt(struct tunnel_cipher_ctx *tc, struct buffer_t *buf);
 enum ssr_error tunnel_cipher_client_decrypt(struct tunnel_cipher_ctx *tc, struct buffer_t *buf, struct buffer_t **feedback);
 
 struct buffer_t * tunnel_cipher_server_encrypt(struct tunnel_cipher_ctx *tc, const struct buffer_t *buf);
 struct buffer_t * tunnel_cipher_server_decrypt(struct tunnel_cipher_ctx *tc, const struct buffer_t *buf, struct buffer_t **receipt, struct buffer_t **confirm);
+bool tunnel_cipher_server_user_id(struct tunnel_cipher_ctx *tc, uint32_t *uid);
 
 bool pre_parse_header(struct buffer_t *data);
 
@@ -0,0 +1,688 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <uv.h>
+#if defined(__linux__)
+#include <netinet/tcp.h>
+#endif // defined(__linux__)
+
+#include "common.h"
+#include "dump_info.h"
+#include "stripe.h"
+#include "tunnel.h"
+#include "ssrbuffer.h"
+#include "sockaddr_universal.h"
+
+#define STRIPE_DOMAIN_SUFFIX ".stripe.invalid"
+
+/* How often a subflow that saw no traffic has its idle timer pushed back (ms). */
+#ifndef STRIPE_KEEPALIVE_INTERVAL
+#define STRIPE_KEEPALIVE_INTERVAL 1000
+#endif
+
+struct stripe_chunk {
+    struct stripe_chunk *next;
+    uint32_t seq;
+    size_t len;
+    uint8_t data[1];
+};
+
+struct stripe_subflow {
+    struct tunnel_ctx *tunnel;
+    bool ready;
+    bool eof;
+    struct buffer_t *partial;  /* Received bytes short of a whole chunk. */
+    struct stripe_chunk *head;  /* Whole chunks waiting for their turn, in SEQ order. */
+    struct stripe_chunk *tail;
+    uint64_t sample_stamp;  /* Loop time of the last TCP_INFO read. */
+    bool sampled;
+    uint32_t cwnd;
+    uint32_t mss;
+    uint32_t unacked;
+    unsigned int penalty;  /* Cost shift while the kernel is recovering from loss. */
+    struct stripe_subflow_stats stats;
+};
+
+struct stripe_session {
+    uint8_t id[STRIPE_ID_SIZE];
+    uint8_t token[STRIPE_TOKEN_SIZE];
+    char name[STRIPE_NAME_SIZE];
+    size_t count;
+    size_t attached;
+    const struct stripe_ops *ops;
+    void *data;
+    uint32_t tx_seq;
+    uint32_t rx_seq;
+    bool fin_sent;
+    bool fin_received;
+    bool aborted;
+    bool held;
+    bool held_fin;
+    struct buffer_t *held_data;
+    size_t buffered;  /* Out of order chunks plus held data. */
+    size_t next_pick;
+    uint64_t keepalive_stamp;
+    struct stripe_subflow subflows[STRIPE_MAX_SUBFLOWS];
+};
+
+static void stripe_hex_encode(const uint8_t *data, size_t size, char *out) {
+    static const char digits[] = "0123456789abcdef";
+    size_t i;
+    for (i = 0; i < size; ++i) {
+        out[i * 2] = digits[data[i] >> 4];
+        out[i * 2 + 1] = digits[data[i] & 0x0F];
+    }
+    out[size * 2] = '\0';
+}
+
+void stripe_id_to_name(const uint8_t *id, char *out) {
+    stripe_hex_encode(id, STRIPE_ID_SIZE, out);
+}
+
+static int stripe_hex_value(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    return -1;
+}
+
+static bool stripe_hex_decode(const char *text, size_t size, uint8_t *out) {
+    size_t i;
+    for (i = 0; i < size; ++i) {
+        int hi = stripe_hex_value(text[i * 2]);
+        int lo = stripe_hex_value(text[i * 2 + 1]);
+        if (hi < 0 || lo < 0) {
+            return false;
+        }
+        out[i] = (uint8_t)((hi << 4) | lo);
+    }
+    return true;
+}
+
+struct buffer_t * stripe_header_create(const uint8_t *id, const uint8_t *token, size_t index, size_t count) {
+    char hex[STRIPE_NAME_SIZE];
+    char hex_token[STRIPE_TOKEN_SIZE * 2 + 1];
+    char name[0x100];
+    struct buffer_t *buf;
+    int len;
+
+    stripe_id_to_name(id, hex);
+    stripe_hex_encode(token, STRIPE_TOKEN_SIZE, hex_token);
+    len = snprintf(name, sizeof(name), "%s-%s-%u-%u" STRIPE_DOMAIN_SUFFIX,
+        hex, hex_token, (unsigned int)index, (unsigned int)count);
+    ASSERT(len > 0 && len < 0x100);
+
+    buf = buffer_alloc((size_t)len + 4);
+    buf->buffer[0] = (uint8_t)SOCKS5_ADDRTYPE_DOMAINNAME;
+    buf->buffer[1] = (uint8_t)len;
+    memcpy(buf->buffer + 2, name, (size_t)len);
+    buf->buffer[2 + len] = 0;
+    buf->buffer[3 + len] = 0;
+    buf->len = (size_t)len + 4;
+    return buf;
+}
+
+bool stripe_header_parse(const struct socks5_address *addr, uint8_t *id, uint8_t *token, size_t *index, size_t *count) {
+    const char *name = addr->addr.domainname;
+    size_t suffix = strlen(STRIPE_DOMAIN_SUFFIX);
+    size_t prefix = STRIPE_ID_SIZE * 2 + 1 + STRIPE_TOKEN_SIZE * 2 + 1;
+    size_t len;
+    unsigned int n = 0, total = 0;
+    char tail = 0;
+
+    if (addr->addr_type != SOCKS5_ADDRTYPE_DOMAINNAME || addr->port != 0) {
+        return false;
+    }
+    len = strlen(name);
+    if (len <= prefix + suffix || strcmp(name + len - suffix, STRIPE_DOMAIN_SUFFIX) != 0) {
+        return false;
+    }
+    if (!stripe_hex_decode(name, STRIPE_ID_SIZE, id) || name[STRIPE_ID_SIZE * 2] != '-') {
+        return false;
+    }
+    name += STRIPE_ID_SIZE * 2 + 1;
+    if (!stripe_hex_decode(name, STRIPE_TOKEN_SIZE, token) || name[STRIPE_TOKEN_SIZE * 2] != '-') {
+        return false;
+    }
+    if (sscanf(name + STRIPE_TOKEN_SIZE * 2 + 1, "%u-%u%c", &n, &total, &tail) != 3 || tail != '.') {
+        return false;
+    }
+    if (total < 2 || total > STRIPE_MAX_SUBFLOWS || n >= total) {
+        return false;
+    }
+    *index = n;
+    *count = total;
+    return true;
+}
+
+struct stripe_session * stripe_session_create(const uint8_t *id, const uint8_t *token, size_t count, const struct stripe_ops *ops, void *data) {
+    struct stripe_session *s;
+
+    if (count < 2 || count > STRIPE_MAX_SUBFLOWS) {
+        return NULL;
+    }
+    s = (struct stripe_session *)calloc(1, sizeof(*s));
+    memcpy(s->id, id, STRIPE_ID_SIZE);
+    memcpy(s->token, token, STRIPE_TOKEN_SIZE);
+    stripe_id_to_name(id, s->name);
+    s->count = count;
+    s->ops = ops;
+    s->data = data;
+    s->held = true;
+    s->held_data = buffer_alloc(STRIPE_CHUNK_SIZE);
+    return s;
+}
+
+static void stripe_subflow_clear(struct stripe_session *s, struct stripe_subflow *f) {
+    while (f->head) {
+        struct stripe_chunk *c = f->head;
+        f->head = c->next;
+        s->buffered -= c->len;
+        free(c);
+    }
+    f->tail = NULL;
+    buffer_free(f->partial);
+    f->partial = NULL;
+}
+
+void stripe_session_destroy(struct stripe_session *s) {
+    size_t i;
+    if (s == NULL) {
+        return;
+    }
+    for (i = 0; i < s->count; ++i) {
+        struct stripe_subflow *f = &s->subflows[i];
+        const struct stripe_subflow_stats *st = &f->stats;
+        if (st->chunks_sent || st->chunks_received) {
+            pr_info("stripe %s/%u: sent %llu bytes in %llu chunks, received %llu bytes in %llu chunks, rtt %u us, %u retransmits",
+                s->name, (unsigned int)i,
+                (unsigned long long)st->bytes_sent, (unsigned long long)st->chunks_sent,
+                (unsigned long long)st->bytes_received, (unsigned long long)st->chunks_received,
+                (unsigned int)st->rtt_us, (unsigned int)st->retransmits);
+        }
+        stripe_subflow_clear(s, f);
+    }
+    buffer_free(s->held_data);
+    free(s);
+}
+
+void * stripe_session_data(const struct stripe_session *s) {
+    return s->data;
+}
+
+const char * stripe_session_name(const struct stripe_session *s) {
+    return s->name;
+}
+
+bool stripe_session_token_matches(const struct stripe_session *s, const uint8_t *token) {
+    uint8_t diff = 0;
+    size_t i;
+    for (i = 0; i < STRIPE_TOKEN_SIZE; ++i) {
+        diff |= (uint8_t)(s->token[i] ^ token[i]);
+    }
+    return diff == 0;
+}
+
+size_t stripe_session_count(const struct stripe_session *s) {
+    return s->count;
+}
+
+struct tunnel_ctx * stripe_session_subflow(const struct stripe_session *s, size_t index) {
+    return (index < s->count) ? s->subflows[index].tunnel : NULL;
+}
+
+static bool stripe_finished(const struct stripe_session *s) {
+    return s->fin_sent && s->fin_received;
+}
+
+/* Both directions ended, FIN every wire once what is queued on it is out. */
+static void stripe_close_wires(struct stripe_session *s) {
+    size_t i;
+    if (stripe_finished(s) == false) {
+        return;
+    }
+    for (i = 0; i < s->count; ++i) {
+        struct stripe_subflow *f = &s->subflows[i];
+        struct socket_ctx *wire;
+        if (f->tunnel == NULL || f->ready == false || f->tunnel->terminated) {
+            continue;
+        }
+        wire = s->ops->wire(f->tunnel);
+        if (wire->sdstate == socket_stop) {
+            socket_shutdown(wire);
+        }
+    }
+}
+
+/*
+ * A subflow that is ahead of the others stops being read once too much sits
+ * in the reorder queues. The chunk due next is always on a subflow with an
+ * empty queue, so those keep reading and the session cannot wedge itself.
+ */
+static void stripe_pump(struct stripe_session *s) {
+    size_t i;
+    for (i = 0; i < s->count; ++i) {
+        struct stripe_subflow *f = &s->subflows[i];
+        struct socket_ctx *wire;
+        bool hold_back;
+        if (f->tunnel == NULL || f->ready == false || f->eof || f->tunnel->terminated) {
+            continue;
+        }
+        wire = s->ops->wire(f->tunnel);
+        if (s->held) {
+            hold_back = (s->buffered >= STRIPE_BUFFER_HIGH);
+        } else {
+            hold_back = (s->buffered >= STRIPE_BUFFER_HIGH && f->head != NULL);
+        }
+        if (hold_back) {
+            socket_stall(wire);
+        } else {
+            socket_unstall(wire);
+        }
+    }
+}
+
+bool stripe_session_attach(struct stripe_session *s, size_t index, struct tunnel_ctx *tunnel) {
+    struct stripe_subflow *f;
+    if (index >= s->count || s->aborted || stripe_finished(s)) {
+        return false;
+    }
+    f = &s->subflows[index];
+    if (f->tunnel != NULL || f->partial != NULL) {
+        return false;  /* Taken, or already used once. */
+    }
+    f->tunnel = tunnel;
+    f->partial = buffer_alloc(STRIPE_CHUNK_HEADER_SIZE + STRIPE_CHUNK_SIZE);
+    s->attached++;
+    return true;
+}
+
+void stripe_session_ready(struct stripe_session *s, size_t index) {
+    struct stripe_subflow *f = &s->subflows[index];
+    ASSERT(index < s->count && f->tunnel);
+    f->ready = true;
+    if (stripe_finished(s)) {
+        stripe_close_wires(s);
+    } else {
+        stripe_pump(s);
+    }
+}
+
+bool stripe_session_detach(struct stripe_session *s, size_t index) {
+    struct stripe_subflow *f = &s->subflows[index];
+    bool benign;
+
+    ASSERT(index < s->count && f->tunnel);
+    // A subflow that never got to streaming carried nothing, the rest can do without it.
+    benign = (index != 0 && f->ready == false);
+
+    stripe_subflow_clear(s, f);
+    f->partial = buffer_alloc(0);  /* Keeps the slot from being attached again. */
+    f->tunnel = NULL;
+    f->ready = false;
+    s->attached--;
+
+    if (benign == false && stripe_finished(s) == false) {
+        stripe_session_abort(s);
+    }
+    return (s->attached == 0);
+}
+
+void stripe_session_abort(struct stripe_session *s) {
+    size_t i;
+    s->aborted = true;
+    for (i = 0; i < s->count; ++i) {
+        if (s->subflows[i].tunnel) {
+            tunnel_shutdown(s->subflows[i].tunnel);
+        }
+    }
+}
+
+static void stripe_chunk_write(struct buffer_t *buf, uint32_t seq, const uint8_t *data, size_t len) {
+    uint8_t header[STRIPE_CHUNK_HEADER_SIZE];
+    header[0] = (uint8_t)(seq >> 24);
+    header[1] = (uint8_t)(seq >> 16);
+    header[2] = (uint8_t)(seq >> 8);
+    header[3] = (uint8_t)seq;
+    header[4] = (uint8_t)(len >> 8);
+    header[5] = (uint8_t)len;
+    buffer_concatenate(buf, header, sizeof(header));
+    if (len) {
+        buffer_concatenate(buf, data, len);
+    }
+}
+
+void stripe_session_append(struct stripe_session *s, struct buffer_t *buf, const uint8_t *data, size_t len) {
+    ASSERT(len > 0 && len <= STRIPE_CHUNK_SIZE);
+    stripe_chunk_write(buf, s->tx_seq++, data, len);
+}
+
+/* Reads the kernel's view of the connection, at most once per loop tick. */
+static void stripe_subflow_sample(struct stripe_subflow *f, struct socket_ctx *wire) {
+#if defined(__linux__) && defined(TCP_INFO)
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+    uint64_t now = uv_now(wire->handle.handle.loop);
+
+    if (f->sampled && f->sample_stamp == now) {
+        return;
+    }
+    f->sample_stamp = now;
+    memset(&info, 0, sizeof(info));
+    if (getsockopt(uv_stream_fd(&wire->handle.tcp), IPPROTO_TCP, TCP_INFO, &info, &len) != 0) {
+        return;
+    }
+    f->sampled = true;
+    f->cwnd = info.tcpi_snd_cwnd;
+    f->mss = info.tcpi_snd_mss;
+    f->unacked = info.tcpi_unacked;
+    f->stats.rtt_us = info.tcpi_rtt;
+    f->stats.retransmits = info.tcpi_total_retrans;
+    if (info.tcpi_ca_state >= TCP_CA_Recovery) {
+        f->penalty = 2;
+    } else if (info.tcpi_ca_state != TCP_CA_Open) {
+        f->penalty = 1;
+    } else {
+        f->penalty = 0;
+    }
+#else
+    (void)f; (void)wire;
+#endif
+}
+
+/*
+ * Estimated time until |pending| more bytes are through the subflow: the
+ * backlog in congestion windows, times the round trip. A subflow the kernel
+ * is recovering on costs double or quadruple. Without TCP_INFO the write
+ * queue alone decides.
+ */
+static uint64_t stripe_subflow_cost(struct stripe_subflow *f, struct socket_ctx *wire, size_t pending) {
+    uint64_t backlog = (uint64_t)uv_stream_get_write_queue_size(&wire->handle.stream) + pending;
+    uint64_t window, rtt;
+
+    stripe_subflow_sample(f, wire);
+    if (f->sampled == false || f->cwnd == 0 || f->mss == 0) {
+        return backlog;
+    }
+    window = (uint64_t)f->cwnd * f->mss;
+    backlog += (uint64_t)f->unacked * f->mss;
+    rtt = f->stats.rtt_us ? f->stats.rtt_us : 1000;
+    return (rtt + rtt * backlog / window) << f->penalty;
+}
+
+static bool stripe_subflow_usable(const struct stripe_session *s, const struct stripe_subflow *f) {
+    if (f->tunnel == NULL || f->ready == false || f->tunnel->terminated) {
+        return false;
+    }
+    return (s->ops->wire(f->tunnel)->sdstate == socket_stop);
+}
+
+static int stripe_pick(struct stripe_session *s, struct buffer_t **batch, size_t len) {
+    int best = -1;
+    uint64_t best_cost = 0;
+    size_t k;
+
+    // Ties go round robin, so quiet sessions still touch every subflow.
+    for (k = 0; k < s->count; ++k) {
+        size_t i = (s->next_pick + k) % s->count;
+        struct stripe_subflow *f = &s->subflows[i];
+        uint64_t cost;
+        if (stripe_subflow_usable(s, f) == false) {
+            continue;
+        }
+        cost = stripe_subflow_cost(f, s->ops->wire(f->tunnel), (batch[i] ? batch[i]->len : 0) + STRIPE_CHUNK_HEADER_SIZE + len);
+        if (best < 0 || cost < best_cost) {
+            best = (int)i;
+            best_cost = cost;
+        }
+    }
+    if (best >= 0) {
+        s->next_pick = ((size_t)best + 1) % s->count;
+    }
+    return best;
+}
+
+bool stripe_session_send(struct stripe_session *s, const uint8_t *data, size_t len) {
+    struct buffer_t *batch[STRIPE_MAX_SUBFLOWS] = { NULL };
+    bool fin = (len == 0);
+    bool ok = true;
+    size_t offset = 0, i;
+
+    if (s->aborted || s->fin_sent) {
+        return false;
+    }
+    // Chunks picked for the same subflow in one call go out as one write.
+    do {
+        size_t n = min(len - offset, (size_t)STRIPE_CHUNK_SIZE);
+        int pick = stripe_pick(s, batch, n);
+        if (pick < 0) {
+            ok = false;
+            break;
+        }
+        if (batch[pick] == NULL) {
+            batch[pick] = buffer_alloc(STRIPE_CHUNK_HEADER_SIZE + n);
+        }
+        stripe_chunk_write(batch[pick], s->tx_seq++, data + offset, n);
+        s->subflows[pick].stats.chunks_sent++;
+        s->subflows[pick].stats.bytes_sent += n;
+        offset += n;
+    } while (offset < len);
+
+    for (i = 0; i < s->count; ++i) {
+        struct tunnel_ctx *tunnel = s->subflows[i].tunnel;
+        if (batch[i] == NULL) {
+            continue;
+        }
+        if (ok && s->ops->seal(tunnel, batch[i])) {
+            socket_write(s->ops->wire(tunnel), batch[i]->buffer, batch[i]->len);
+        } else {
+            ok = false;
+        }
+        buffer_free(batch[i]);
+    }
+
+    if (ok && fin) {
+        s->fin_sent = true;
+        stripe_close_wires(s);
+    }
+    return ok;
+}
+
+static void stripe_deliver(struct stripe_session *s, const uint8_t *data, size_t len) {
+    s->rx_seq++;
+    if (len == 0) {
+        s->fin_received = true;
+    }
+    if (s->held) {
+        if (len) {
+            buffer_concatenate(s->held_data, data, len);
+            s->buffered += len;
+        } else {
+            s->held_fin = true;
+        }
+        return;
+    }
+    s->ops->deliver(s, data, len);
+    if (len == 0) {
+        stripe_close_wires(s);
+    }
+}
+
+/* Hands over queued chunks for as long as the head of some subflow is the one due. */
+static void stripe_drain(struct stripe_session *s) {
+    bool progress = true;
+    while (progress && s->fin_received == false) {
+        size_t i;
+        progress = false;
+        for (i = 0; i < s->count; ++i) {
+            struct stripe_subflow *f = &s->subflows[i];
+            struct stripe_chunk *c = f->head;
+            if (c == NULL || c->seq != s->rx_seq) {
+                continue;
+            }
+            f->head = c->next;
+            if (f->head == NULL) {
+                f->tail = NULL;
+            }
+            s->buffered -= c->len;
+            stripe_deliver(s, c->data, c->len);
+            free(c);
+            progress = true;
+        }
+    }
+}
+
+static void stripe_keepalive(struct stripe_session *s, struct socket_ctx *wire) {
+    uint64_t now = uv_now(wire->handle.handle.loop);
+    size_t i;
+    if (now - s->keepalive_stamp < STRIPE_KEEPALIVE_INTERVAL) {
+        return;
+    }
+    s->keepalive_stamp = now;
+    for (i = 0; i < s->count; ++i) {
+        struct stripe_subflow *f = &s->subflows[i];
+        if (f->tunnel && f->ready && f->tunnel->terminated == false) {
+            socket_keepalive(s->ops->wire(f->tunnel));
+        }
+    }
+}
+
+bool stripe_session_receive(struct stripe_session *s, size_t index, const uint8_t *data, size_t len) {
+    struct stripe_subflow *f = &s->subflows[index];
+    const uint8_t *p;
+    size_t remain;
+
+    ASSERT(index < s->count && f->tunnel);
+    if (s->aborted) {
+        return false;
+    }
+    f->stats.bytes_received += len;
+    buffer_concatenate(f->partial, data, len);
+
+    p = f->partial->buffer;
+    remain = f->partial->len;
+    while (remain >= STRIPE_CHUNK_HEADER_SIZE) {
+        uint32_t seq = ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+        size_t n = ((size_t)p[4] << 8) | p[5];
+        if (n > STRIPE_CHUNK_SIZE) {
+            return false;
+        }
+        if (remain < STRIPE_CHUNK_HEADER_SIZE + n) {
+            break;
+        }
+        // Nothing after the end, no replays, and in order within one subflow.
+        if (s->fin_received || (int32_t)(seq - s->rx_seq) < 0 ||
+            (f->tail && (int32_t)(seq - f->tail->seq) <= 0)) {
+            return false;
+        }
+        f->stats.chunks_received++;
+        if (seq == s->rx_seq && f->head == NULL) {
+            stripe_deliver(s, p + STRIPE_CHUNK_HEADER_SIZE, n);
+            stripe_drain(s);
+        } else {
+            struct stripe_chunk *c = (struct stripe_chunk *)malloc(sizeof(*c) + n);
+            c->next = NULL;
+            c->seq = seq;
+            c->len = n;
+            memcpy(c->data, p + STRIPE_CHUNK_HEADER_SIZE, n);
+            if (f->tail) {
+                f->tail->next = c;
+            } else {
+                f->head = c;
+            }
+            f->tail = c;
+            s->buffered += n;
+        }
+        p += STRIPE_CHUNK_HEADER_SIZE + n;
+        remain -= STRIPE_CHUNK_HEADER_SIZE + n;
+    }
+    buffer_shorten(f->partial, f->partial->len - remain, remain);
+
+    if (s->aborted) {
+        return false;
+    }
+    stripe_keepalive(s, s->ops->wire(f->tunnel));
+    stripe_pump(s);
+    return true;
+}
+
+bool stripe_session_eof(struct stripe_session *s, size_t index) {
+    struct stripe_subflow *f = &s->subflows[index];
+    size_t i;
+
+    ASSERT(index < s->count && f->tunnel);
+    f->eof = true;
+    if (f->partial->len != 0) {
+        return false;
+    }
+    if (s->fin_received) {
+        return true;
+    }
+    // The end may still be on its way over another subflow.
+    for (i = 0; i < s->count; ++i) {
+        struct stripe_subflow *other = &s->subflows[i];
+        if (other->tunnel && other->ready && other->eof == false) {
+            return true;
+        }
+    }
+    return false;
+}
+
+const struct buffer_t * stripe_session_held(const struct stripe_session *s) {
+    return s->held_data;
+}
+
+size_t stripe_session_take_held(struct stripe_session *s, struct buffer_t *dst) {
+    size_t len = s->held_data->len;
+    buffer_concatenate2(dst, s->held_data);
+    s->buffered -= len;
+    s->held_data->len = 0;
+    stripe_pump(s);
+    return len;
+}
+
+void stripe_session_release(struct stripe_session *s) {
+    if (s->held == false) {
+        return;
+    }
+    s->held = false;
+    if (s->held_data->len) {
+        s->buffered -= s->held_data->len;
+        s->ops->deliver(s, s->held_data->buffer, s->held_data->len);
+        s->held_data->len = 0;
+    }
+    if (s->held_fin) {
+        s->ops->deliver(s, NULL, 0);
+        stripe_close_wires(s);
+    }
+    stripe_pump(s);
+}
+
+struct socket_ctx * stripe_session_drain_wire(struct stripe_session *s) {
+    struct socket_ctx *best = NULL;
+    size_t best_size = 0, i;
+    for (i = 0; i < s->count; ++i) {
+        struct stripe_subflow *f = &s->subflows[i];
+        struct socket_ctx *wire;
+        size_t size;
+        if (stripe_subflow_usable(s, f) == false) {
+            continue;
+        }
+        wire = s->ops->wire(f->tunnel);
+        size = uv_stream_get_write_queue_size(&wire->handle.stream);
+        if (best == NULL || size < best_size) {
+            best = wire;
+            best_size = size;
+        }
+    }
+    return best;
+}
+
+void stripe_session_stats(const struct stripe_session *s, size_t index, struct stripe_subflow_stats *stats) {
+    if (index < s->count && stats) {
+        *stats = s->subflows[index].stats;
+    }
+}
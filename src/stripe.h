@@ -0,0 +1,110 @@
+#if !defined(__stripe_h__)
+#define __stripe_h__ 1
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+struct tunnel_ctx;
+struct socket_ctx;
+struct buffer_t;
+struct socks5_address;
+struct stripe_session;
+
+/*
+ * One proxied connection spread over several SSR connections, the subflows,
+ * so a per-flow throttle or a single congestion window no longer caps it.
+ *
+ * Every subflow is a regular tunnel with its own cipher. It asks for the
+ * destination "<ID>-<TOKEN>-<INDEX>-<COUNT>.stripe.invalid", port 0, and
+ * from then on carries chunks of the relayed stream in both directions:
+ *
+ *    +-----+-----+----------+
+ *    | SEQ | LEN |   DATA   |
+ *    +-----+-----+----------+
+ *    |  4  |  2  | Variable |
+ *    +-----+-----+----------+
+ *
+ * SEQ counts the chunks of one direction over all subflows, the receiver
+ * puts them back in order. LEN 0 ends the direction. The first chunk from
+ * the client rides on subflow 0 and is the real destination header.
+ *
+ * ID names the session, TOKEN is a random secret of the client that opened
+ * it, and a subflow that does not carry the same one may not join.
+ */
+#define STRIPE_CHUNK_HEADER_SIZE 6
+#define STRIPE_ID_SIZE 8
+#define STRIPE_TOKEN_SIZE 8
+#define STRIPE_NAME_SIZE (STRIPE_ID_SIZE * 2 + 1)
+#define STRIPE_MAX_SUBFLOWS 8
+
+/* Payload per chunk, the unit the scheduler places on a subflow. */
+#ifndef STRIPE_CHUNK_SIZE
+#define STRIPE_CHUNK_SIZE (8 * 1024)
+#endif
+
+/* Reordered or held data above which subflows that are ahead stop being read. */
+#ifndef STRIPE_BUFFER_HIGH
+#define STRIPE_BUFFER_HIGH (512 * 1024)
+#endif
+
+struct stripe_ops {
+    struct socket_ctx * (*wire)(struct tunnel_ctx *subflow);  /* The subflow's connection to the other proxy. */
+    bool (*seal)(struct tunnel_ctx *subflow, struct buffer_t *buf);  /* Encrypts in place with the subflow's cipher. */
+    void (*deliver)(struct stripe_session *session, const uint8_t *data, size_t len);  /* In order, len 0 is the end. */
+};
+
+struct stripe_subflow_stats {
+    uint64_t bytes_sent;
+    uint64_t bytes_received;
+    uint64_t chunks_sent;
+    uint64_t chunks_received;
+    uint32_t rtt_us;  /* Kernel estimate at the last send, 0 when unknown. */
+    uint32_t retransmits;
+};
+
+/* The session id in hex, how both ends name the session. */
+void stripe_id_to_name(const uint8_t *id, char *name);
+struct buffer_t * stripe_header_create(const uint8_t *id, const uint8_t *token, size_t index, size_t count);
+bool stripe_header_parse(const struct socks5_address *addr, uint8_t *id, uint8_t *token, size_t *index, size_t *count);
+
+/* Sessions start out holding delivered data back, see stripe_session_release(). */
+struct stripe_session * stripe_session_create(const uint8_t *id, const uint8_t *token, size_t count, const struct stripe_ops *ops, void *data);
+void stripe_session_destroy(struct stripe_session *s);
+void * stripe_session_data(const struct stripe_session *s);
+const char * stripe_session_name(const struct stripe_session *s);
+size_t stripe_session_count(const struct stripe_session *s);
+/* Whether |token| is the one the session was opened with. */
+bool stripe_session_token_matches(const struct stripe_session *s, const uint8_t *token);
+struct tunnel_ctx * stripe_session_subflow(const struct stripe_session *s, size_t index);
+
+bool stripe_session_attach(struct stripe_session *s, size_t index, struct tunnel_ctx *tunnel);
+/* The subflow is streaming, the session may send on it and now drives its reads. */
+void stripe_session_ready(struct stripe_session *s, size_t index);
+/*
+ * The subflow's tunnel is gone. Unless the session finished, or the subflow
+ * never carried anything, that tears down the others. True when it was the last.
+ */
+bool stripe_session_detach(struct stripe_session *s, size_t index);
+void stripe_session_abort(struct stripe_session *s);
+
+/* Appends the next chunk to |buf|, for data that rides on a handshake packet. */
+void stripe_session_append(struct stripe_session *s, struct buffer_t *buf, const uint8_t *data, size_t len);
+/* Spreads |len| bytes over the subflows, len 0 ends the direction. False if nothing can carry them. */
+bool stripe_session_send(struct stripe_session *s, const uint8_t *data, size_t len);
+/* Decrypted bytes from a subflow, false on a framing error. */
+bool stripe_session_receive(struct stripe_session *s, size_t index, const uint8_t *data, size_t len);
+/* The peer closed a subflow, false if data was cut off by it. */
+bool stripe_session_eof(struct stripe_session *s, size_t index);
+
+/* In-order data collected while the receiving end is not up yet. */
+const struct buffer_t * stripe_session_held(const struct stripe_session *s);
+size_t stripe_session_take_held(struct stripe_session *s, struct buffer_t *dst);
+/* Stop holding, hand everything collected so far to deliver(). */
+void stripe_session_release(struct stripe_session *s);
+
+/* The least backed up wire, the one to throttle reads on. */
+struct socket_ctx * stripe_session_drain_wire(struct stripe_session *s);
+void stripe_session_stats(const struct stripe_session *s, size_t index, struct stripe_subflow_stats *stats);
+
+#endif // !defined(__stripe_h__)
@@ -26,20 +26,115 @@
 #include "common.h"
 #include "tunnel.h"
 #include "dump_info.h"
+#include "zerocopy.h"
+
+/* A half-closed tunnel is torn down once the open direction idles this long (ms). */
+#ifndef TUNNEL_HALF_CLOSE_LINGER
+#define TUNNEL_HALF_CLOSE_LINGER (30 * 1000)
+#endif
+
+/* Process-wide cap on bytes sitting in read and write buffers. */
+#ifndef TUNNEL_MEMORY_BUDGET
+#define TUNNEL_MEMORY_BUDGET (64 * 1024 * 1024)
+#endif
+
+/* Stop reading a producer once its peer has this much queued, resume below the low mark. */
+#ifndef TUNNEL_WRITE_QUEUE_HIGH
+#define TUNNEL_WRITE_QUEUE_HIGH (256 * 1024)
+#endif
+
+#ifndef TUNNEL_WRITE_QUEUE_LOW
+#define TUNNEL_WRITE_QUEUE_LOW (64 * 1024)
+#endif
+
+/* Released tunnels kept for reuse so the accept path does not hit the allocator. */
+#ifndef TUNNEL_POOL_SIZE
+#define TUNNEL_POOL_SIZE 64
+#endif
+
+/* A tunnel and everything it owns, allocated as one block. */
+struct tunnel_block {
+    struct tunnel_ctx tunnel;
+    struct socket_ctx incoming;
+    struct socket_ctx outgoing;
+    struct socks5_address desired_addr;
+    struct tunnel_block *next;
+};
+
+/* A socket_write() payload, shared by its uv_write() and a zero-copy send. */
+struct write_block {
+    size_t len;
+    unsigned int refs;
+};
+
+static struct tunnel_block *tunnel_pool = NULL;
+static size_t tunnel_pool_count = 0;
+
+/* Bytes a bulk tunnel may relay before it yields the loop to other tunnels. */
+#ifndef TUNNEL_ITERATION_BUDGET
+#define TUNNEL_ITERATION_BUDGET (64 * 1024)
+#endif
+
+/* Tunnels whose reads average below this are interactive and never yield. */
+#ifndef TUNNEL_INTERACTIVE_READ_SIZE
+#define TUNNEL_INTERACTIVE_READ_SIZE 1024
+#endif
+
+/* Largest SO_RCVLOWAT asked for, and how long (ms) a partial frame may hold a read back. */
+#ifndef TUNNEL_RCVLOWAT_MAX
+#define TUNNEL_RCVLOWAT_MAX (16 * 1024)
+#endif
+
+#ifndef TUNNEL_RCVLOWAT_TIMEOUT
+#define TUNNEL_RCVLOWAT_TIMEOUT 50
+#endif
+
+/* How often (ms) zero-copy completions are reaped while readers are parked. */
+#ifndef TUNNEL_PARKED_REAP_INTERVAL
+#define TUNNEL_PARKED_REAP_INTERVAL 10
+#endif
+
+static size_t memory_budget = TUNNEL_MEMORY_BUDGET;
+static size_t buffered_bytes = 0;
+static struct socket_ctx *parked_sockets = NULL;
+static uv_timer_t *parked_reap_timer = NULL;
 
 static bool tunnel_is_in_streaming_wrapper(struct tunnel_ctx *tunnel);
 static bool tunnel_is_dead(struct tunnel_ctx *tunnel);
 static void tunnel_add_ref(struct tunnel_ctx *tunnel);
 static void tunnel_release(struct tunnel_ctx *tunnel);
+static struct tunnel_block * tunnel_block_acquire(void);
+static struct tunnel_ctx * tunnel_create(uv_tcp_t *listener, unsigned int idle_timeout);
+static void tunnel_block_recycle(struct tunnel_block *block);
+static void tunnel_half_close(struct tunnel_ctx *tunnel, struct socket_ctx *socket);
 static void socket_timer_expire_cb(uv_timer_t *handle);
-static void socket_timer_start(struct socket_ctx *c);
-static void socket_timer_stop(struct socket_ctx *c);
+static void socket_rcvlowat_set(struct socket_ctx *c, unsigned int value);
+static void socket_rcvlowat_update(struct socket_ctx *c);
 static void socket_connect_done_cb(uv_connect_t *req, int status);
+static bool socket_read_on_accept(struct socket_ctx *c);
 static void socket_read_done_cb(uv_stream_t *handle, ssize_t nread, const uv_buf_t *buf);
 static void socket_alloc_cb(uv_handle_t *handle, size_t size, uv_buf_t *buf);
 static void socket_getaddrinfo_done_cb(uv_getaddrinfo_t *req, int status, struct addrinfo *ai);
 static void socket_write_done_cb(uv_write_t *req, int status);
+static bool socket_zerocopy_wanted(struct socket_ctx *c, size_t len);
+static void write_block_release(void *token);
+static void socket_shutdown_done_cb(uv_shutdown_t *req, int status);
 static void socket_close(struct socket_ctx *c);
+static bool socket_should_park(struct socket_ctx *peer);
+static void socket_park(struct socket_ctx *c);
+static void socket_unpark(struct socket_ctx *c);
+static void socket_resume_parked(void);
+static void parked_reap_start(uv_loop_t *loop);
+static void parked_reap_cb(uv_timer_t *handle);
+static void socket_resume_waiters(struct socket_ctx *target);
+static void socket_resume(struct socket_ctx *c);
+static struct socket_ctx * socket_drain_target(struct socket_ctx *c);
+static void tunnel_account_read(struct tunnel_ctx *tunnel, size_t len);
+static bool tunnel_should_yield(struct tunnel_ctx *tunnel);
+static void socket_defer_read(struct socket_ctx *c);
+static void socket_defer_check_cb(uv_check_t *handle);
+static void buffered_bytes_add(size_t len);
+static void buffered_bytes_sub(size_t len);
 static void socket_close_done_cb(uv_handle_t *handle);
 
 int uv_stream_fd(const uv_tcp_t *handle) {
@@ -84,6 +179,30 @@ size_t _update_tcp_mss(struct socket_ctx *socket) {
     return _tcp_mss;
 }
 
+void tunnel_set_memory_budget(size_t budget) {
+    memory_budget = budget ? budget : TUNNEL_MEMORY_BUDGET;
+}
+
+size_t tunnel_buffered_bytes(void) {
+    return buffered_bytes;
+}
+
+static void buffered_bytes_add(size_t len) {
+    buffered_bytes += len;
+}
+
+static void buffered_bytes_sub(size_t len) {
+    size_t low_mark = (memory_budget / 4) * 3;
+    bool above = (buffered_bytes > low_mark);
+    ASSERT(buffered_bytes >= len);
+    buffered_bytes -= len;
+    // Readers parked on a peer's queue are resumed by that peer, see
+    // socket_resume_waiters(). Only the budget going down frees them all.
+    if (above && buffered_bytes <= low_mark) {
+        socket_resume_parked();
+    }
+}
+
 static bool tunnel_is_in_streaming_wrapper(struct tunnel_ctx *tunnel) {
     return (tunnel && tunnel->tunnel_is_in_streaming && tunnel->tunnel_is_in_streaming(tunnel));
 }
@@ -102,63 +221,113 @@ static void tunnel_release(struct tunnel_ctx *tunnel) {
         if (tunnel->tunnel_dying) {
             tunnel->tunnel_dying(tunnel);
         }
+        tunnel_block_recycle(CONTAINER_OF(tunnel, struct tunnel_block, tunnel));
+    }
+}
 
-        free(tunnel->incoming);
-
-        free(tunnel->outgoing);
+static struct tunnel_block * tunnel_block_acquire(void) {
+    struct tunnel_block *block = tunnel_pool;
+    if (block == NULL) {
+        return (struct tunnel_block *) calloc(1, sizeof(*block));
+    }
+    tunnel_pool = block->next;
+    tunnel_pool_count--;
+    memset(block, 0, sizeof(*block));
+    return block;
+}
 
-        free(tunnel->desired_addr);
-        free(tunnel);
+static void tunnel_block_recycle(struct tunnel_block *block) {
+    if (tunnel_pool_count >= TUNNEL_POOL_SIZE) {
+        free(block);
+        return;
     }
+    block->next = tunnel_pool;
+    tunnel_pool = block;
+    tunnel_pool_count++;
 }
 
-/* |incoming| has been initialized by listener.c when this is called. */
-void tunnel_initialize(uv_tcp_t *listener, unsigned int idle_timeout, bool(*init_done_cb)(struct tunnel_ctx *tunnel, void *p), void *p) {
+static struct tunnel_ctx * tunnel_create(uv_tcp_t *listener, unsigned int idle_timeout) {
     struct socket_ctx *incoming;
     struct socket_ctx *outgoing;
     struct tunnel_ctx *tunnel;
+    struct tunnel_block *block;
     uv_loop_t *loop = listener->loop;
-    bool success = false;
 
-    tunnel = (struct tunnel_ctx *) calloc(1, sizeof(*tunnel));
+    block = tunnel_block_acquire();
+    tunnel = &block->tunnel;
 
     tunnel->listener = listener;
     tunnel->ref_count = 0;
-    tunnel->desired_addr = (struct socks5_address *)calloc(1, sizeof(struct socks5_address));
+    tunnel->desired_addr = &block->desired_addr;
 
-    incoming = (struct socket_ctx *) calloc(1, sizeof(*incoming));
+    incoming = &block->incoming;
     incoming->tunnel = tunnel;
     incoming->result = 0;
     incoming->rdstate = socket_stop;
     incoming->wrstate = socket_stop;
+    incoming->sdstate = socket_stop;
     incoming->idle_timeout = idle_timeout;
     VERIFY(0 == uv_timer_init(loop, &incoming->timer_handle));
+    VERIFY(0 == uv_check_init(loop, &incoming->defer_handle));
     VERIFY(0 == uv_tcp_init(loop, &incoming->handle.tcp));
-    VERIFY(0 == uv_accept((uv_stream_t *)listener, &incoming->handle.stream));
     tunnel->incoming = incoming;
 
-    outgoing = (struct socket_ctx *) calloc(1, sizeof(*outgoing));
+    outgoing = &block->outgoing;
     outgoing->tunnel = tunnel;
     outgoing->result = 0;
     outgoing->rdstate = socket_stop;
     outgoing->wrstate = socket_stop;
+    outgoing->sdstate = socket_stop;
     outgoing->idle_timeout = idle_timeout;
     VERIFY(0 == uv_timer_init(loop, &outgoing->timer_handle));
+    VERIFY(0 == uv_check_init(loop, &outgoing->defer_handle));
     VERIFY(0 == uv_tcp_init(loop, &outgoing->handle.tcp));
     tunnel->outgoing = outgoing;
 
+    return tunnel;
+}
+
+/* |incoming| has been initialized by listener.c when this is called. */
+void tunnel_initialize(uv_tcp_t *listener, unsigned int idle_timeout, bool(*init_done_cb)(struct tunnel_ctx *tunnel, void *p), void *p) {
+    struct tunnel_ctx *tunnel;
+    struct socket_ctx *incoming;
+    bool success = false;
+
+    tunnel = tunnel_create(listener, idle_timeout);
+    incoming = tunnel->incoming;
+    VERIFY(0 == uv_accept((uv_stream_t *)listener, &incoming->handle.stream));
+
     if (init_done_cb) {
         success = init_done_cb(tunnel, p);
     }
 
     if (success) {
-        /* Wait for the initial packet. */
-        socket_read(incoming);
+        if (tunnel->connect_on_accept) {
+            /* Nothing to read before the upstream is there, the peer may wait for it to speak first. */
+        } else if (tunnel->read_on_accept == false || socket_read_on_accept(incoming) == false) {
+            /* Take the initial packet right away if it came with the connection, otherwise wait for it. */
+            socket_read(incoming);
+        }
     } else {
         tunnel_shutdown(tunnel);
     }
 }
 
+/*
+ * A tunnel that only dials out, its |incoming| is never connected. The side
+ * counts as finished, so shutting down |outgoing| alone ends the tunnel.
+ */
+void tunnel_initialize_outbound(uv_tcp_t *listener, unsigned int idle_timeout, bool(*init_done_cb)(struct tunnel_ctx *tunnel, void *p), void *p) {
+    struct tunnel_ctx *tunnel = tunnel_create(listener, idle_timeout);
+
+    tunnel->incoming->sdstate = socket_done;
+    tunnel->incoming->rd_eof = true;
+
+    if (init_done_cb == NULL || init_done_cb(tunnel, p) == false) {
+        tunnel_shutdown(tunnel);
+    }
+}
+
 void tunnel_shutdown(struct tunnel_ctx *tunnel) {
     if (tunnel_is_dead(tunnel) != false) {
         return;
@@ -177,6 +346,34 @@ void tunnel_shutdown(struct tunnel_ctx *tunnel) {
     tunnel->terminated = true;
 }
 
+/* |socket| reached EOF: pass the FIN on and keep the reverse direction alive. */
+static void tunnel_half_close(struct tunnel_ctx *tunnel, struct socket_ctx *socket) {
+    struct socket_ctx *target;
+
+    ASSERT(socket == tunnel->incoming || socket == tunnel->outgoing);
+    target = ((socket == tunnel->incoming) ? tunnel->outgoing : tunnel->incoming);
+
+    socket_read_stop(socket);
+    socket->rd_eof = true;
+
+    // uv_shutdown() sends the FIN only after the writes queued on |target| drained.
+    socket_shutdown(target);
+
+    if (tunnel_is_dead(tunnel) || target->rd_eof) {
+        return;
+    }
+
+    if (socket->idle_timeout > TUNNEL_HALF_CLOSE_LINGER) {
+        socket->idle_timeout = TUNNEL_HALF_CLOSE_LINGER;
+    }
+    if (target->idle_timeout > TUNNEL_HALF_CLOSE_LINGER) {
+        target->idle_timeout = TUNNEL_HALF_CLOSE_LINGER;
+    }
+    if (target->rdstate == socket_busy) {
+        socket_timer_start(target);
+    }
+}
+
 void tunnel_process_streaming(struct tunnel_ctx *tunnel, struct socket_ctx *socket) {
     struct socket_ctx *incoming = tunnel->incoming;
     struct socket_ctx *outgoing = tunnel->outgoing;
@@ -193,10 +390,20 @@ void tunnel_process_streaming(struct tunnel_ctx *tunnel, struct socket_ctx *sock
 
     ASSERT(tunnel->tunnel_extract_data);
     buffer = tunnel->tunnel_extract_data(socket, &malloc, &len);
-    if (buffer && (len > 0)) {
+    if (buffer == NULL) {
+        tunnel_shutdown(tunnel);
+        return;
+    }
+    if (len > 0) {
         socket_write(write_target, buffer, len);
     }
     free(buffer);
+
+    if (socket_should_park(write_target)) {
+        socket_park(socket);
+    } else if (tunnel_should_yield(tunnel)) {
+        socket_defer_read(socket);
+    }
 }
 
 //
@@ -218,8 +425,14 @@ void tunnel_traditional_streaming(struct tunnel_ctx *tunnel, struct socket_ctx *
 
     if (current_socket->wrstate == socket_done) {
         current_socket->wrstate = socket_stop;
-        if (target_socket->rdstate == socket_stop) {
-            socket_read(target_socket);
+        if (target_socket->rdstate == socket_stop && target_socket->rd_eof == false) {
+            if (socket_should_park(current_socket)) {
+                socket_park(target_socket);
+            } else if (tunnel_should_yield(tunnel)) {
+                socket_defer_read(target_socket);
+            } else {
+                socket_read(target_socket);
+            }
         }
     }
 
@@ -241,14 +454,18 @@ void tunnel_traditional_streaming(struct tunnel_ctx *tunnel, struct socket_ctx *
     }
 }
 
-static void socket_timer_start(struct socket_ctx *c) {
+void socket_timer_start(struct socket_ctx *c) {
+    unsigned int timeout = c->idle_timeout;
+    if (c->rcvlowat > 1 && c->rdstate == socket_busy && timeout > TUNNEL_RCVLOWAT_TIMEOUT) {
+        timeout = TUNNEL_RCVLOWAT_TIMEOUT;
+    }
     VERIFY(0 == uv_timer_start(&c->timer_handle,
         socket_timer_expire_cb,
-        c->idle_timeout,
+        timeout,
         0));
 }
 
-static void socket_timer_stop(struct socket_ctx *c) {
+void socket_timer_stop(struct socket_ctx *c) {
     VERIFY(0 == uv_timer_stop(&c->timer_handle));
 }
 
@@ -257,14 +474,21 @@ static void socket_timer_expire_cb(uv_timer_t *handle) {
     struct tunnel_ctx *tunnel;
 
     c = CONTAINER_OF(handle, struct socket_ctx, timer_handle);
-    c->result = UV_ETIMEDOUT;
-
     tunnel = c->tunnel;
 
     if (tunnel_is_dead(tunnel)) {
         return;
     }
 
+    if (c->rcvlowat > 1) {
+        // The rest of the frame is late, take what arrived and wait out the idle timeout.
+        socket_rcvlowat_set(c, 1);
+        socket_timer_start(c);
+        return;
+    }
+
+    c->result = UV_ETIMEDOUT;
+
     if (tunnel->tunnel_timeout_expire_done) {
         tunnel->tunnel_timeout_expire_done(tunnel, c);
     }
@@ -311,9 +535,39 @@ void socket_read(struct socket_ctx *c) {
     ASSERT(c->rdstate == socket_stop);
     VERIFY(0 == uv_read_start(&c->handle.stream, socket_alloc_cb, socket_read_done_cb));
     c->rdstate = socket_busy;
+    socket_rcvlowat_update(c);
     socket_timer_start(c);
 }
 
+static void socket_rcvlowat_set(struct socket_ctx *c, unsigned int value) {
+#if defined(__linux__) && defined(SO_RCVLOWAT)
+    int lowat = (int)value;
+    if (value == c->rcvlowat || (value <= 1 && c->rcvlowat <= 1)) {
+        return;
+    }
+    if (setsockopt(uv_stream_fd(&c->handle.tcp), SOL_SOCKET, SO_RCVLOWAT, &lowat, sizeof(lowat)) == 0) {
+        c->rcvlowat = value;
+    }
+#else
+    (void)c;
+    (void)value;
+#endif
+}
+
+/*
+ * Have the kernel hold a read back until the frame the decoders wait for
+ * is complete, rather than wake us for each of its segments. The timer
+ * falls back to the default if the rest is late, see socket_timer_start().
+ */
+static void socket_rcvlowat_update(struct socket_ctx *c) {
+    struct tunnel_ctx *tunnel = c->tunnel;
+    size_t need = 0;
+    if (tunnel->tunnel_get_recv_need) {
+        need = tunnel->tunnel_get_recv_need(tunnel, c);
+    }
+    socket_rcvlowat_set(c, (unsigned int)min(max(need, 1), TUNNEL_RCVLOWAT_MAX));
+}
+
 static void socket_read_done_cb(uv_stream_t *handle, ssize_t nread, const uv_buf_t *buf) {
     struct socket_ctx *c;
     struct tunnel_ctx *tunnel;
@@ -327,17 +581,29 @@ static void socket_read_done_cb(uv_stream_t *handle, ssize_t nread, const uv_buf
             break;
         }
 
+        if (nread == 0) {
+            // Nothing read, the read stays pending. Zero-copy completions wake us like this.
+            zerocopy_reap(c->zerocopy);
+            break;
+        }
+
         if (tunnel_is_in_streaming_wrapper(tunnel) == false) {
             uv_read_stop(&c->handle.stream);
         }
 
         socket_timer_stop(c);
-
-        if (nread == 0) {
-            break;
-        }
         if (nread < 0) {
             // http://docs.libuv.org/en/v1.x/stream.html
+            if (nread == UV_EOF && tunnel->tunnel_read_eof) {
+                socket_read_stop(c);
+                c->rd_eof = true;
+                tunnel->tunnel_read_eof(tunnel, c);
+                break;
+            }
+            if (nread == UV_EOF && tunnel->half_close_allowed) {
+                tunnel_half_close(tunnel, c);
+                break;
+            }
             if (nread != UV_EOF) {
                 socket_dump_error_info("recieve data failed", c);
             }
@@ -346,6 +612,7 @@ static void socket_read_done_cb(uv_stream_t *handle, ssize_t nread, const uv_buf
         }
 
         c->buf = buf;
+        tunnel_account_read(tunnel, (size_t)nread);
         if (tunnel_is_in_streaming_wrapper(tunnel) == false) {
             ASSERT(c->rdstate == socket_busy);
         }
@@ -355,10 +622,35 @@ static void socket_read_done_cb(uv_stream_t *handle, ssize_t nread, const uv_buf
         tunnel->tunnel_read_done(tunnel, c);
     } while (0);
 
+    c->buf = NULL;
     if (buf->base) {
         free(buf->base); // important!!!
+        buffered_bytes_sub(buf->len);
     }
-    c->buf = NULL;
+}
+
+/*
+ * With deferred accept the first packet is normally queued by the time the
+ * connection is handed to us; read it with one non-blocking recv() and run it
+ * through the regular read completion instead of waiting for the next poll.
+ */
+static bool socket_read_on_accept(struct socket_ctx *c) {
+    uv_buf_t buf = { 0 };
+    ssize_t nread;
+    int fd = uv_stream_fd(&c->handle.tcp);
+
+    c->rdstate = socket_busy;
+    socket_alloc_cb(&c->handle.handle, 64 * 1024, &buf);
+    nread = (ssize_t) recv(fd, buf.base, (int)buf.len, 0);
+    if (nread <= 0) {
+        // Nothing queued yet (or EOF / error): let libuv report it.
+        free(buf.base);
+        buffered_bytes_sub(buf.len);
+        c->rdstate = socket_stop;
+        return false;
+    }
+    socket_read_done_cb(&c->handle.stream, nread, &buf);
+    return true;
 }
 
 void socket_read_stop(struct socket_ctx *c) {
@@ -382,6 +674,7 @@ static void socket_alloc_cb(uv_handle_t *handle, size_t size, uv_buf_t *buf) {
     }
 
     *buf = uv_buf_init((char *)calloc(size, sizeof(char)), (unsigned int)size);
+    buffered_bytes_add(size);
 }
 
 void socket_getaddrinfo(struct socket_ctx *c, const char *hostname) {
@@ -450,7 +743,9 @@ static void socket_getaddrinfo_done_cb(uv_getaddrinfo_t *req, int status, struct
 void socket_write(struct socket_ctx *c, const void *data, size_t len) {
     uv_buf_t buf;
     struct tunnel_ctx *tunnel = c->tunnel;
-    char *write_buf = NULL;
+    struct write_block *block;
+    char *payload;
+    size_t sent = 0;
     uv_write_t *req;
 
     if (tunnel_is_in_streaming_wrapper(tunnel) == false) {
@@ -458,37 +753,83 @@ void socket_write(struct socket_ctx *c, const void *data, size_t len) {
     }
     c->wrstate = socket_busy;
 
-    // It's okay to cast away constness here, uv_write() won't modify the memory.
-    write_buf = (char *)calloc(len + 1, sizeof(*write_buf));
-    memcpy(write_buf, data, len);
-    buf = uv_buf_init(write_buf, (unsigned int)len);
+    // Hand back what the kernel finished with, a socket that only writes never sees a wakeup read.
+    zerocopy_reap(c->zerocopy);
+
+    block = (struct write_block *)calloc(1, sizeof(*block) + len + 1);
+    block->len = len;
+    block->refs = 1;
+    payload = (char *)(block + 1);
+    memcpy(payload, data, len);
+    buffered_bytes_add(len);
+
+    if (socket_zerocopy_wanted(c, len)) {
+        block->refs++;
+        sent = zerocopy_send(c->zerocopy, payload, len, block);
+        if (sent == 0) {
+            block->refs--;
+        }
+    }
+
+    // The rest goes through libuv. An empty write still completes, which keeps write_done in step.
+    buf = uv_buf_init(payload + sent, (unsigned int)(len - sent));
 
     req = (uv_write_t *)calloc(1, sizeof(uv_write_t));
-    req->data = write_buf;
+    req->data = block;
 
     VERIFY(0 == uv_write(req, &c->handle.stream, &buf, 1, socket_write_done_cb));
     socket_timer_start(c);
 }
 
+/* Large writes, and only while libuv has nothing queued that they could overtake. */
+static bool socket_zerocopy_wanted(struct socket_ctx *c, size_t len) {
+    if (len < ZEROCOPY_MIN_SIZE || c->zerocopy_off) {
+        return false;
+    }
+    if (uv_stream_get_write_queue_size(&c->handle.stream) != 0) {
+        return false;
+    }
+    if (c->zerocopy == NULL) {
+        c->zerocopy = zerocopy_sender_create((uv_os_sock_t)uv_stream_fd(&c->handle.tcp), &write_block_release);
+        if (c->zerocopy == NULL) {
+            c->zerocopy_off = true;
+            return false;
+        }
+    }
+    return zerocopy_wanted(c->zerocopy, len);
+}
+
+static void write_block_release(void *token) {
+    struct write_block *block = (struct write_block *)token;
+    size_t len = block->len;
+    ASSERT(block->refs > 0);
+    if (--block->refs == 0) {
+        free(block);
+        buffered_bytes_sub(len);
+    }
+}
+
 static void socket_write_done_cb(uv_write_t *req, int status) {
     struct socket_ctx *c;
     struct tunnel_ctx *tunnel;
-    char *write_buf = NULL;
+    struct write_block *block = NULL;
 
     c = CONTAINER_OF(req->handle, struct socket_ctx, handle.stream);
 
-    VERIFY((write_buf = (char *)req->data));
-    free(write_buf);
-
+    VERIFY((block = (struct write_block *)req->data));
     c->result = status;
     free(req);
     tunnel = c->tunnel;
 
+    write_block_release(block);
+
     if (tunnel_is_dead(tunnel)) {
         return;
     }
 
     socket_timer_stop(c);
+    zerocopy_reap(c->zerocopy);
+    socket_resume_waiters(c);
 
     if (status < 0 /*status == UV_ECANCELED*/) {
         socket_dump_error_info("send data failed", c);
@@ -511,19 +852,72 @@ static void socket_write_done_cb(uv_write_t *req, int status) {
     tunnel->tunnel_write_done(tunnel, c);
 }
 
+void socket_shutdown(struct socket_ctx *c) {
+    ASSERT(c->sdstate == socket_stop);
+    c->sdstate = socket_busy;
+    if (uv_shutdown(&c->t.shutdown_req, &c->handle.stream, socket_shutdown_done_cb) != 0) {
+        tunnel_shutdown(c->tunnel);
+    }
+}
+
+static void socket_shutdown_done_cb(uv_shutdown_t *req, int status) {
+    struct socket_ctx *c;
+    struct tunnel_ctx *tunnel;
+
+    c = CONTAINER_OF(req, struct socket_ctx, t.shutdown_req);
+    c->result = status;
+
+    tunnel = c->tunnel;
+
+    if (tunnel_is_dead(tunnel)) {
+        return;
+    }
+
+    if (status < 0) {
+        socket_dump_error_info("shutdown failed", c);
+        tunnel_shutdown(tunnel);
+        return;
+    }
+    c->sdstate = socket_done;
+
+    // Both directions have ended and every byte has been flushed.
+    if (tunnel->incoming->sdstate == socket_done && tunnel->outgoing->sdstate == socket_done) {
+        tunnel_shutdown(tunnel);
+    }
+}
+
 static void socket_close(struct socket_ctx *c) {
     struct tunnel_ctx *tunnel = c->tunnel;
     ASSERT(c->rdstate != socket_dead);
     ASSERT(c->wrstate != socket_dead);
+    socket_unpark(c);
+    // Nobody waits on a closed queue. Readers of other tunnels (stripe
+    // subflows) fall back to their own peer and read on.
+    while (c->waiters) {
+        struct socket_ctx *waiter = c->waiters;
+        if (waiter->drain_target == c) {
+            waiter->drain_target = NULL;
+        }
+        if (waiter->tunnel == tunnel) {
+            socket_unpark(waiter);
+        } else {
+            socket_resume(waiter);
+        }
+    }
     c->rdstate = socket_dead;
     c->wrstate = socket_dead;
+    zerocopy_sender_close(c->zerocopy, c->handle.handle.loop);
+    c->zerocopy = NULL;
     c->timer_handle.data = c;
+    c->defer_handle.data = c;
     c->handle.handle.data = c;
 
     tunnel_add_ref(tunnel);
     uv_close(&c->handle.handle, socket_close_done_cb);
     tunnel_add_ref(tunnel);
     uv_close((uv_handle_t *)&c->timer_handle, socket_close_done_cb);
+    tunnel_add_ref(tunnel);
+    uv_close((uv_handle_t *)&c->defer_handle, socket_close_done_cb);
 }
 
 static void socket_close_done_cb(uv_handle_t *handle) {
@@ -536,6 +930,249 @@ static void socket_close_done_cb(uv_handle_t *handle) {
     tunnel_release(tunnel);
 }
 
+//
+// Cooperative scheduling: a tunnel moving bulk data gets TUNNEL_ITERATION_BUDGET
+// bytes, then its next read is pushed to a later loop iteration so the reads
+// already pending for interactive tunnels (small packets, e.g. SSH or DNS over
+// TCP) are served first. Interactive tunnels are never held back.
+//
+static void tunnel_account_read(struct tunnel_ctx *tunnel, size_t len) {
+    uint64_t now = uv_now(tunnel->incoming->handle.handle.loop);
+    if (tunnel->budget_stamp != now) {
+        tunnel->budget_stamp = now;
+        tunnel->budget_bytes = 0;
+    }
+    tunnel->budget_bytes += len;
+    tunnel->avg_read_size = (tunnel->avg_read_size * 7 + len) / 8;
+}
+
+static bool tunnel_should_yield(struct tunnel_ctx *tunnel) {
+    if (tunnel->avg_read_size < TUNNEL_INTERACTIVE_READ_SIZE) {
+        return false;
+    }
+    if (tunnel->budget_stamp != uv_now(tunnel->incoming->handle.handle.loop)) {
+        return false;
+    }
+    return (tunnel->budget_bytes >= TUNNEL_ITERATION_BUDGET);
+}
+
+/*
+ * The check handle runs once the current poll phase has dispatched every
+ * pending callback. It has no other user, so writes that restart or stop the
+ * idle timer in the meantime cannot lose the wakeup.
+ */
+static void socket_defer_read(struct socket_ctx *c) {
+    socket_read_stop(c);
+    VERIFY(0 == uv_check_start(&c->defer_handle, socket_defer_check_cb));
+}
+
+static void socket_defer_check_cb(uv_check_t *handle) {
+    struct socket_ctx *c = CONTAINER_OF(handle, struct socket_ctx, defer_handle);
+    struct tunnel_ctx *tunnel = c->tunnel;
+
+    VERIFY(0 == uv_check_stop(handle));
+    if (tunnel_is_dead(tunnel) || c->rdstate != socket_stop || c->rd_eof || c->parked || c->stalled) {
+        return;
+    }
+    tunnel->budget_bytes = 0;
+    if (socket_should_park(socket_drain_target(c))) {
+        socket_park(c);
+    } else {
+        socket_read(c);
+    }
+}
+
+/* True when reading more for |peer| would overrun its write queue or the global budget. */
+static bool socket_should_park(struct socket_ctx *peer) {
+    if (buffered_bytes > memory_budget) {
+        // Finished zero-copy sends count against the budget until they are reaped.
+        zerocopy_reap(peer->zerocopy);
+    }
+    if (buffered_bytes > memory_budget) {
+        return true;
+    }
+    return (uv_stream_get_write_queue_size(&peer->handle.stream) > TUNNEL_WRITE_QUEUE_HIGH);
+}
+
+/*
+ * A parked socket is on two lists: the global one, walked when the budget
+ * drops below its low mark, and the waiters of its drain target, resumed
+ * when that target's write queue drains.
+ */
+static void socket_park(struct socket_ctx *c) {
+    struct socket_ctx *target = socket_drain_target(c);
+    ASSERT(c->parked == false);
+    socket_read_stop(c);
+    socket_timer_stop(c);
+    c->parked = true;
+    c->parked_prev = NULL;
+    c->parked_next = parked_sockets;
+    if (parked_sockets) {
+        parked_sockets->parked_prev = c;
+    }
+    parked_sockets = c;
+
+    c->parked_on = target;
+    c->waiter_prev = NULL;
+    c->waiter_next = target->waiters;
+    if (target->waiters) {
+        target->waiters->waiter_prev = c;
+    }
+    target->waiters = c;
+
+    parked_reap_start(c->handle.handle.loop);
+}
+
+/*
+ * Parked readers stop their own reads and timers, so nothing they do
+ * reaps the zero-copy sends that hold the budget. Poll for completions
+ * while any are outstanding, resuming happens as they are released.
+ */
+static void parked_reap_start(uv_loop_t *loop) {
+    if (zerocopy_outstanding() == false) {
+        return;
+    }
+    if (parked_reap_timer == NULL) {
+        parked_reap_timer = (uv_timer_t *)calloc(1, sizeof(uv_timer_t));
+        VERIFY(0 == uv_timer_init(loop, parked_reap_timer));
+        uv_unref((uv_handle_t *)parked_reap_timer);
+    }
+    if (uv_is_active((uv_handle_t *)parked_reap_timer) == 0) {
+        VERIFY(0 == uv_timer_start(parked_reap_timer, parked_reap_cb,
+            TUNNEL_PARKED_REAP_INTERVAL, TUNNEL_PARKED_REAP_INTERVAL));
+    }
+}
+
+static void parked_reap_cb(uv_timer_t *handle) {
+    zerocopy_reap_outstanding();
+    if (parked_sockets == NULL || zerocopy_outstanding() == false) {
+        VERIFY(0 == uv_timer_stop(handle));
+    }
+}
+
+static void socket_unpark(struct socket_ctx *c) {
+    if (c->parked == false) {
+        return;
+    }
+    if (c->waiter_prev) {
+        c->waiter_prev->waiter_next = c->waiter_next;
+    } else {
+        c->parked_on->waiters = c->waiter_next;
+    }
+    if (c->waiter_next) {
+        c->waiter_next->waiter_prev = c->waiter_prev;
+    }
+    c->waiter_prev = c->waiter_next = NULL;
+    c->parked_on = NULL;
+
+    if (c->parked_prev) {
+        c->parked_prev->parked_next = c->parked_next;
+    } else {
+        parked_sockets = c->parked_next;
+    }
+    if (c->parked_next) {
+        c->parked_next->parked_prev = c->parked_prev;
+    }
+    c->parked_prev = c->parked_next = NULL;
+    c->parked = false;
+}
+
+/* Take |c| off the parked lists and read again, unless it was stopped for good meanwhile. */
+static void socket_resume(struct socket_ctx *c) {
+    struct tunnel_ctx *tunnel = c->tunnel;
+    socket_unpark(c);
+    if (tunnel_is_dead(tunnel) == false && c->rdstate == socket_stop && c->rd_eof == false) {
+        socket_read(c);
+    }
+}
+
+/* Restart parked readers once the budget and their peer's queue are below the low marks. */
+static void socket_resume_parked(void) {
+    struct socket_ctx *c = parked_sockets;
+    if (buffered_bytes > (memory_budget / 4) * 3) {
+        return;
+    }
+    while (c) {
+        struct socket_ctx *next = c->parked_next;
+        if (uv_stream_get_write_queue_size(&c->parked_on->handle.stream) <= TUNNEL_WRITE_QUEUE_LOW) {
+            socket_resume(c);
+        }
+        c = next;
+    }
+}
+
+/* |target| wrote something out, restart the readers that waited on its queue. */
+static void socket_resume_waiters(struct socket_ctx *target) {
+    if (target->waiters == NULL || buffered_bytes > (memory_budget / 4) * 3) {
+        return;
+    }
+    if (uv_stream_get_write_queue_size(&target->handle.stream) > TUNNEL_WRITE_QUEUE_LOW) {
+        return;
+    }
+    while (target->waiters) {
+        socket_resume(target->waiters);
+    }
+}
+
+static struct socket_ctx * socket_drain_target(struct socket_ctx *c) {
+    struct tunnel_ctx *tunnel = c->tunnel;
+    if (c->drain_target) {
+        return c->drain_target;
+    }
+    return (c == tunnel->incoming) ? tunnel->outgoing : tunnel->incoming;
+}
+
+/*
+ * Streaming mode, after a read of |c| went out on |target|: keep reading
+ * unless |target|, which may belong to another tunnel, is backed up or the
+ * tunnel used up its share of the loop.
+ */
+void socket_throttle(struct socket_ctx *c, struct socket_ctx *target) {
+    struct tunnel_ctx *tunnel = c->tunnel;
+
+    if (tunnel_is_dead(tunnel) || c->stalled || c->rd_eof || c->rdstate == socket_stop) {
+        return;
+    }
+    c->drain_target = target;
+    if (socket_should_park(target)) {
+        socket_park(c);
+    } else if (tunnel_should_yield(tunnel)) {
+        socket_defer_read(c);
+    } else {
+        c->rdstate = socket_busy;
+        socket_rcvlowat_update(c);
+        socket_timer_start(c);
+    }
+}
+
+/* Stop reading |c| until socket_unstall(), whatever its peer and the memory budget do. */
+void socket_stall(struct socket_ctx *c) {
+    if (c->stalled || tunnel_is_dead(c->tunnel)) {
+        return;
+    }
+    c->stalled = true;
+    socket_unpark(c);
+    socket_read_stop(c);
+    socket_timer_stop(c);
+}
+
+void socket_unstall(struct socket_ctx *c) {
+    if (c->stalled == false) {
+        return;
+    }
+    c->stalled = false;
+    if (tunnel_is_dead(c->tunnel) == false && c->rd_eof == false) {
+        socket_read(c);
+    }
+}
+
+/* Push back the idle timeout of a socket that is waiting for data. */
+void socket_keepalive(struct socket_ctx *c) {
+    if (tunnel_is_dead(c->tunnel) == false && c->rdstate == socket_busy && c->parked == false && c->stalled == false) {
+        socket_timer_start(c);
+    }
+}
+
 void socket_dump_error_info(const char *title, struct socket_ctx *socket) {
     struct tunnel_ctx *tunnel = socket->tunnel;
     int error = (int)socket->result;
@@ -551,5 +1188,6 @@ void socket_dump_error_info(const char *title, struct socket_ctx *socket) {
         universal_address_to_string(&tmp, addr, sizeof(addr));
         from = "_client_";
     }
-    pr_err("%s about %s \"%s\": %s", title, from, addr, uv_strerror(error));
+    // One bucket per kind of failure, so a flood of one does not hide the others.
+    pr_err_keyed(title, "%s about %s \"%s\": %s", title, from, addr, uv_strerror(error));
 }
@@ -7,6 +7,7 @@
 
 struct tunnel_ctx;
 struct buffer_t;
+struct zerocopy_sender;
 
 enum socket_state {
     socket_stop,  /* Stopped. */
@@ -18,6 +19,20 @@ enum socket_state {
 struct socket_ctx {
     enum socket_state rdstate;
     enum socket_state wrstate;
+    enum socket_state sdstate;  /* Progress of the FIN sent to the peer. */
+    bool rd_eof;  /* The peer has finished sending. */
+    bool parked;  /* Reading held back by the memory budget, see socket_park(). */
+    bool stalled;  /* Reading held back by its owner, see socket_stall(). */
+    struct socket_ctx *parked_prev;
+    struct socket_ctx *parked_next;
+    struct socket_ctx *drain_target;  /* Whose write queue gates a parked read, the peer when NULL. */
+    struct socket_ctx *parked_on;  /* The drain target at the time it was parked. */
+    struct socket_ctx *waiters;  /* Sockets parked on this one's write queue. */
+    struct socket_ctx *waiter_prev;
+    struct socket_ctx *waiter_next;
+    struct zerocopy_sender *zerocopy;  /* Large writes lend their buffer to the kernel, see socket_write(). */
+    bool zerocopy_off;  /* The socket refused SO_ZEROCOPY. */
+    unsigned int rcvlowat;  /* SO_RCVLOWAT in effect, 0 or 1 is the kernel default. */
     unsigned int idle_timeout;
     struct tunnel_ctx *tunnel;  /* Backlink to owning tunnel context. */
     ssize_t result;
@@ -28,10 +43,12 @@ struct socket_ctx {
         uv_udp_t udp;
     } handle;
     uv_timer_t timer_handle;  /* For detecting timeouts. */
+    uv_check_t defer_handle;  /* Resumes a read pushed back by socket_defer_read(). */
                               /* We only need one of these at a time so make them share memory. */
     union {
         uv_getaddrinfo_t addrinfo_req;
         uv_connect_t connect_req;
+        uv_shutdown_t shutdown_req;
         uv_req_t req;
     } t;
     union sockaddr_universal addr;
@@ -42,6 +59,12 @@ struct tunnel_ctx {
     void *data;
     bool terminated;
     bool getaddrinfo_pending;
+    bool half_close_allowed;  /* EOF on one side closes only that direction. */
+    bool read_on_accept;  /* Try to read the first packet synchronously on accept. */
+    bool connect_on_accept;  /* Destination known at accept time, init_done_cb starts connecting. */
+    uint64_t budget_stamp;  /* Loop time |budget_bytes| was counted in. */
+    size_t budget_bytes;  /* Bytes relayed since the tunnel last yielded. */
+    size_t avg_read_size;  /* Moving average, tells interactive from bulk traffic. */
     uv_tcp_t *listener;  /* Backlink to owning listener context. */
     struct socket_ctx *incoming;  /* Connection with the SOCKS client. */
     struct socket_ctx *outgoing;  /* Connection with upstream. */
@@ -54,16 +77,22 @@ struct tunnel_ctx {
     void(*tunnel_read_done)(struct tunnel_ctx *tunnel, struct socket_ctx *socket);
     void(*tunnel_getaddrinfo_done)(struct tunnel_ctx *tunnel, struct socket_ctx *socket);
     void(*tunnel_write_done)(struct tunnel_ctx *tunnel, struct socket_ctx *socket);
+    void(*tunnel_read_eof)(struct tunnel_ctx *tunnel, struct socket_ctx *socket);  /* Takes over EOF handling when set. */
     size_t(*tunnel_get_alloc_size)(struct tunnel_ctx *tunnel, struct socket_ctx *socket, size_t suggested_size);
+    size_t(*tunnel_get_recv_need)(struct tunnel_ctx *tunnel, struct socket_ctx *socket);  /* Bytes the next frame still lacks, 0 if unknown. */
     uint8_t*(*tunnel_extract_data)(struct socket_ctx *socket, void*(*allocator)(size_t size), size_t *size);
     bool(*tunnel_is_in_streaming)(struct tunnel_ctx *tunnel);
 };
 
+void tunnel_set_memory_budget(size_t budget);
+size_t tunnel_buffered_bytes(void);
+
 int uv_stream_fd(const uv_tcp_t *handle);
 uint16_t get_socket_port(const uv_tcp_t *tcp);
 size_t _update_tcp_mss(struct socket_ctx *socket);
 
 void tunnel_initialize(uv_tcp_t *lx, unsigned int idle_timeout, bool(*init_done_cb)(struct tunnel_ctx *tunnel, void *p), void *p);
+void tunnel_initialize_outbound(uv_tcp_t *lx, unsigned int idle_timeout, bool(*init_done_cb)(struct tunnel_ctx *tunnel, void *p), void *p);
 void tunnel_shutdown(struct tunnel_ctx *tunnel);
 void tunnel_process_streaming(struct tunnel_ctx *tunnel, struct socket_ctx *socket);
 void tunnel_traditional_streaming(struct tunnel_ctx *tunnel, struct socket_ctx *socket);
@@ -72,6 +101,13 @@ void socket_read(struct socket_ctx *c);
 void socket_read_stop(struct socket_ctx *c);
 void socket_getaddrinfo(struct socket_ctx *c, const char *hostname);
 void socket_write(struct socket_ctx *c, const void *data, size_t len);
+void socket_shutdown(struct socket_ctx *c);
+void socket_throttle(struct socket_ctx *c, struct socket_ctx *target);
+void socket_stall(struct socket_ctx *c);
+void socket_unstall(struct socket_ctx *c);
+void socket_keepalive(struct socket_ctx *c);
+void socket_timer_start(struct socket_ctx *c);
+void socket_timer_stop(struct socket_ctx *c);
 void socket_dump_error_info(const char *title, struct socket_ctx *socket);
 
 #endif // !defined(__tunnel_h__)
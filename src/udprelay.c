@@ -111,6 +111,8 @@ get_sockaddr_len(struct sockaddr *addr)
 
 struct udp_listener_ctx_t {
     uv_udp_t io;
+    char *recv_buf;  /* Owned by the listener, reused by every receive. */
+    size_t recv_buf_size;
     int timeout;
     struct cstl_set *connections;
 #ifdef MODULE_LOCAL
@@ -124,6 +126,28 @@ struct udp_listener_ctx_t {
     // SSR
     struct obfs_t *protocol_plugin;
     void *protocol_global;
+    // Sessions, least recently active first, and by udp_session_key.
+    struct udp_remote_ctx_t *sessions;
+    struct udp_remote_ctx_t *sessions_tail;
+    size_t session_count;
+    struct cstl_map *session_map;
+};
+
+/* What a session is found by, the local client and the destination header. */
+struct udp_session_key {
+    const struct sockaddr_storage *src_addr;
+    const char *addr_header;
+    int addr_header_len;
+};
+
+/*
+ * Lifecycle of a session, by destination port. Request/response protocols
+ * are closed as soon as every request got its reply, the rest idle out.
+ */
+struct udp_session_policy {
+    uint16_t port;  /* 0 matches any port. */
+    bool single_reply;
+    unsigned int timeout;  /* ms, 0 for the listener's timeout. */
 };
 
 #ifdef MODULE_REMOTE
@@ -148,7 +172,14 @@ struct udp_remote_ctx_t {
     struct sockaddr_storage dst_addr;
 #endif
     struct udp_listener_ctx_t *server_ctx;
+    struct buffer_t *recv_buf;  /* Replies are received and decrypted here, allocated on the first one. */
     int ref_count;
+    bool closing;
+    const struct udp_session_policy *policy;
+    struct udp_session_key key;  /* Points into this session once it is in the map. */
+    unsigned int pending;  /* Requests sent that are still waiting for a reply. */
+    struct udp_remote_ctx_t *prev;
+    struct udp_remote_ctx_t *next;
 };
 
 static void udp_listener_recv_cb(uv_udp_t* handle, ssize_t nread, const uv_buf_t* buf0, const struct sockaddr* addr, unsigned flags);
@@ -159,6 +190,8 @@ static void udp_remote_timeout_cb(uv_timer_t* handle);
 static void query_resolve_cb(struct sockaddr *addr, void *data);
 #endif
 static void udp_remote_shutdown(struct udp_remote_ctx_t *ctx);
+static void udp_session_touch(struct udp_remote_ctx_t *ctx);
+static void udp_session_replied(struct udp_remote_ctx_t *ctx);
 
 #ifdef ANDROID
 extern int log_tx_rx;
@@ -173,18 +206,137 @@ extern uint64_t tx;
 extern uint64_t rx;
 #endif
 
+/* Datagrams the listener pulls from the kernel per recvmmsg(), when libuv supports it. */
+#ifndef UDP_RECVMMSG_BATCH
+#define UDP_RECVMMSG_BATCH 16
+#endif
+
+/* libuv carves the receive buffer into slots of this size for recvmmsg(). */
+#define UDP_DGRAM_MAX_SIZE (64 * 1024)
+
+/*
+ * Room a datagram grows by on its way through: the destination header in
+ * tunnel mode, protocol padding and MAC, and the cipher IV. A datagram with
+ * this much left in its receive slot is processed where it was received.
+ */
+#define UDP_INPLACE_HEADROOM 1024
+
+/* Sessions per listener, the least recently active one makes room for a new one. */
+#ifndef UDP_SESSION_MAX
+#define UDP_SESSION_MAX MAX_UDP_CONN_NUM
+#endif
+
+/* Above this many sessions idle timeouts shrink, down to an eighth at UDP_SESSION_MAX. */
+#ifndef UDP_SESSION_PRESSURE
+#define UDP_SESSION_PRESSURE (UDP_SESSION_MAX / 2)
+#endif
+
+/* How long (ms) a request/response exchange such as DNS waits for its reply. */
+#ifndef UDP_SINGLE_REPLY_TIMEOUT
+#define UDP_SINGLE_REPLY_TIMEOUT (5 * 1000)
+#endif
+
+/* Ports that may be given single-reply lifecycles, see udprelay_set_single_reply_ports(). */
+#ifndef UDP_SINGLE_REPLY_PORTS_MAX
+#define UDP_SINGLE_REPLY_PORTS_MAX 16
+#endif
+
+static struct udp_session_policy udp_session_policies[UDP_SINGLE_REPLY_PORTS_MAX + 1] = {
+    { 53, true, UDP_SINGLE_REPLY_TIMEOUT },  /* DNS */
+    { 123, true, UDP_SINGLE_REPLY_TIMEOUT },  /* NTP */
+    { 0, false, 0 },
+};
+
+void udprelay_set_single_reply_ports(const char *ports, unsigned int timeout) {
+    size_t count = 0;
+    size_t i;
+
+    if (timeout == 0) {
+        timeout = UDP_SINGLE_REPLY_TIMEOUT;
+    }
+    if (ports == NULL) {
+        // The built-in DNS and NTP entries, with the new timeout.
+        for (i = 0; udp_session_policies[i].port != 0; ++i) {
+            udp_session_policies[i].timeout = timeout;
+        }
+        return;
+    }
+    while (*ports) {
+        char *end = NULL;
+        unsigned long port = strtoul(ports, &end, 10);
+        if (end == ports) {
+            ++ports;
+            continue;
+        }
+        ports = end;
+        if (port == 0 || port > 0xFFFF) {
+            continue;
+        }
+        if (count == UDP_SINGLE_REPLY_PORTS_MAX) {
+            LOGE("[udp] more than %d single-reply ports, ignoring the rest", UDP_SINGLE_REPLY_PORTS_MAX);
+            break;
+        }
+        udp_session_policies[count].port = (uint16_t)port;
+        udp_session_policies[count].single_reply = true;
+        udp_session_policies[count].timeout = timeout;
+        ++count;
+    }
+    udp_session_policies[count].port = 0;
+    udp_session_policies[count].single_reply = false;
+    udp_session_policies[count].timeout = 0;
+}
+
 static size_t packet_size                            = DEFAULT_PACKET_SIZE;
 static size_t buf_size                               = DEFAULT_PACKET_SIZE * 2;
 
-static void udp_uv_alloc_buffer(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf) {
-    char *tmp = (char *) ss_malloc(suggested_size * sizeof(char));
-    *buf = uv_buf_init(tmp, (unsigned int)suggested_size);
+/* Each session reuses one buffer for its replies, they are handled before the next is read. */
+static void udp_remote_alloc_buffer(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf) {
+    struct udp_remote_ctx_t *remote_ctx = CONTAINER_OF(handle, struct udp_remote_ctx_t, io);
+    (void)suggested_size;
+    if (remote_ctx->recv_buf == NULL) {
+        remote_ctx->recv_buf = buffer_alloc(packet_size + UDP_INPLACE_HEADROOM);
+    }
+    *buf = uv_buf_init((char *)remote_ctx->recv_buf->buffer, (unsigned int)remote_ctx->recv_buf->capacity);
 }
 
-static void udp_uv_release_buffer(uv_buf_t *buf) {
-    free(buf->base);
-    buf->base = NULL;
-    buf->len = 0;
+static void udp_listener_alloc_buffer(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf) {
+    struct udp_listener_ctx_t *server_ctx = CONTAINER_OF(handle, struct udp_listener_ctx_t, io);
+    (void)suggested_size;
+    *buf = uv_buf_init(server_ctx->recv_buf, (unsigned int)server_ctx->recv_buf_size);
+}
+
+struct udp_send_req {
+    uv_udp_send_t req;  /* Must be first, the send callbacks free() the request. */
+    char payload[1];
+};
+
+/*
+ * Send without a request allocation when the socket can take the datagram
+ * right now, otherwise queue a copy so the caller may free |data| at once.
+ */
+static int udp_send_payload(uv_udp_t *io, const void *data, size_t len, const struct sockaddr *addr, uv_udp_send_cb cb, void *ctx) {
+    uv_buf_t tmp = uv_buf_init((char *)data, (unsigned int)len);
+    struct udp_send_req *send_req;
+    int err;
+
+#if UV_VERSION_HEX >= 0x011b00
+    err = uv_udp_try_send(io, &tmp, 1, addr);
+    if (err >= 0) {
+        return 0;
+    }
+    if (err != UV_EAGAIN && err != UV_ENOSYS) {
+        return err;
+    }
+#endif
+    send_req = (struct udp_send_req *)calloc(1, sizeof(*send_req) + len);
+    memcpy(send_req->payload, data, len);
+    send_req->req.data = ctx;
+    tmp = uv_buf_init(send_req->payload, (unsigned int)len);
+    err = uv_udp_send(&send_req->req, io, &tmp, 1, addr, cb);
+    if (err != 0) {
+        free(send_req);
+    }
+    return err;
 }
 
 #if defined(MODULE_REMOTE) && defined(SO_BROADCAST)
@@ -447,7 +599,14 @@ udp_create_local_listener(const char *host, uint16_t port, uv_loop_t *loop, uv_u
         return -1;
     }
 
+#if UV_VERSION_HEX >= 0x012500
+    // Batch receives with recvmmsg(); libuv ignores the flag where it is unsupported.
+    if (uv_udp_init_ex(loop, udp, AF_UNSPEC | UV_UDP_RECVMMSG) != 0) {
+        uv_udp_init(loop, udp);
+    }
+#else
     uv_udp_init(loop, udp);
+#endif
 
     rp = result;
 
@@ -508,19 +667,183 @@ static void close_and_free_query(struct query_ctx *ctx) {
 
 #endif
 
+static const struct udp_session_policy * udp_session_policy_of(const char *addr_header, int addr_header_len) {
+    const struct udp_session_policy *policy = udp_session_policies;
+    uint16_t port = 0;
+    if (addr_header_len >= 3) {
+        port = (uint16_t)(((uint8_t)addr_header[addr_header_len - 2] << 8) | (uint8_t)addr_header[addr_header_len - 1]);
+    }
+    while (policy->port != 0 && policy->port != port) {
+        ++policy;
+    }
+    return policy;
+}
+
+static int udp_source_compare(const struct sockaddr_storage *a, const struct sockaddr_storage *b) {
+    if (a->ss_family != b->ss_family) {
+        return (a->ss_family < b->ss_family) ? -1 : 1;
+    }
+    if (a->ss_family == AF_INET) {
+        const struct sockaddr_in *x = (const struct sockaddr_in *)a;
+        const struct sockaddr_in *y = (const struct sockaddr_in *)b;
+        if (x->sin_port != y->sin_port) {
+            return (x->sin_port < y->sin_port) ? -1 : 1;
+        }
+        return memcmp(&x->sin_addr, &y->sin_addr, sizeof(x->sin_addr));
+    }
+    if (a->ss_family == AF_INET6) {
+        const struct sockaddr_in6 *x = (const struct sockaddr_in6 *)a;
+        const struct sockaddr_in6 *y = (const struct sockaddr_in6 *)b;
+        if (x->sin6_port != y->sin6_port) {
+            return (x->sin6_port < y->sin6_port) ? -1 : 1;
+        }
+        return memcmp(&x->sin6_addr, &y->sin6_addr, sizeof(x->sin6_addr));
+    }
+    return 0;
+}
+
+static int udp_session_key_compare(void *left, void *right) {
+    const struct udp_session_key *l = *(const struct udp_session_key **)left;
+    const struct udp_session_key *r = *(const struct udp_session_key **)right;
+    int diff;
+    if (l->addr_header_len != r->addr_header_len) {
+        return (l->addr_header_len < r->addr_header_len) ? -1 : 1;
+    }
+    diff = memcmp(l->addr_header, r->addr_header, (size_t)l->addr_header_len);
+    if (diff != 0) {
+        return diff;
+    }
+    return udp_source_compare(l->src_addr, r->src_addr);
+}
+
+/* The session of a local client with one destination, NULL if there is none yet. */
+static struct udp_remote_ctx_t * udp_session_find(struct udp_listener_ctx_t *server_ctx,
+    const struct sockaddr_storage *src_addr, const char *addr_header, int addr_header_len)
+{
+    struct udp_session_key probe;
+    const struct udp_session_key *key = &probe;
+    struct udp_remote_ctx_t **found;
+
+    probe.src_addr = src_addr;
+    probe.addr_header = addr_header;
+    probe.addr_header_len = addr_header_len;
+    found = (struct udp_remote_ctx_t **)obj_map_find(server_ctx->session_map, &key);
+    return (found ? *found : NULL);
+}
+
+static void udp_session_unlink(struct udp_remote_ctx_t *ctx) {
+    struct udp_listener_ctx_t *server_ctx = ctx->server_ctx;
+    if (ctx->prev == NULL && server_ctx->sessions != ctx) {
+        return;
+    }
+    if (ctx->prev) {
+        ctx->prev->next = ctx->next;
+    } else {
+        server_ctx->sessions = ctx->next;
+    }
+    if (ctx->next) {
+        ctx->next->prev = ctx->prev;
+    } else {
+        server_ctx->sessions_tail = ctx->prev;
+    }
+    ctx->prev = ctx->next = NULL;
+    --server_ctx->session_count;
+}
+
+static void udp_session_link(struct udp_remote_ctx_t *ctx) {
+    struct udp_listener_ctx_t *server_ctx = ctx->server_ctx;
+    ctx->prev = server_ctx->sessions_tail;
+    ctx->next = NULL;
+    if (server_ctx->sessions_tail) {
+        server_ctx->sessions_tail->next = ctx;
+    } else {
+        server_ctx->sessions = ctx;
+    }
+    server_ctx->sessions_tail = ctx;
+    ++server_ctx->session_count;
+}
+
+/* Takes a new session in, evicting the least recently active one at UDP_SESSION_MAX. */
+static void udp_session_add(struct udp_remote_ctx_t *ctx) {
+    struct udp_listener_ctx_t *server_ctx = ctx->server_ctx;
+    if (server_ctx->session_count >= UDP_SESSION_MAX && server_ctx->sessions) {
+        LOGI("[udp] too many sessions, evicting the oldest");
+        udp_remote_shutdown(server_ctx->sessions);
+    }
+    udp_session_link(ctx);
+    objects_container_add(server_ctx->connections, (void *)ctx);
+
+    ctx->key.src_addr = &ctx->src_addr;
+    ctx->key.addr_header = ctx->addr_header;
+    ctx->key.addr_header_len = ctx->addr_header_len;
+    {
+        const struct udp_session_key *key = &ctx->key;
+        obj_map_add(server_ctx->session_map, &key, sizeof(void *), &ctx, sizeof(void *));
+    }
+}
+
+/* The policy's idle timeout, shortened in proportion while sessions pile up. */
+static uint64_t udp_session_timeout(const struct udp_remote_ctx_t *ctx) {
+    const struct udp_listener_ctx_t *server_ctx = ctx->server_ctx;
+    uint64_t timeout = (uint64_t)server_ctx->timeout;
+    if (ctx->policy && ctx->policy->timeout && ctx->policy->timeout < timeout) {
+        timeout = ctx->policy->timeout;
+    }
+    if (server_ctx->session_count > UDP_SESSION_PRESSURE) {
+        uint64_t span = UDP_SESSION_MAX - UDP_SESSION_PRESSURE;
+        uint64_t over = min((uint64_t)(server_ctx->session_count - UDP_SESSION_PRESSURE), span);
+        timeout -= timeout * 7 * over / (8 * span);
+    }
+    return timeout;
+}
+
+/* The session is active, move it to the back and re-arm its idle timer. */
+static void udp_session_touch(struct udp_remote_ctx_t *ctx) {
+    if (ctx == NULL || ctx->closing) {
+        return;
+    }
+    if (ctx->server_ctx->sessions_tail != ctx) {
+        udp_session_unlink(ctx);
+        udp_session_link(ctx);
+    }
+    uv_timer_start(&ctx->watcher, udp_remote_timeout_cb, udp_session_timeout(ctx), 0);
+}
+
+/* A reply went out to the local client. */
+static void udp_session_replied(struct udp_remote_ctx_t *ctx) {
+    if (ctx == NULL || ctx->closing) {
+        return;
+    }
+    if (ctx->pending > 0) {
+        --ctx->pending;
+    }
+    if (ctx->policy && ctx->policy->single_reply && ctx->pending == 0) {
+        udp_remote_shutdown(ctx);
+        return;
+    }
+    udp_session_touch(ctx);
+}
+
 static void udp_remote_close_done_cb(uv_handle_t* handle) {
     struct udp_remote_ctx_t *ctx = (struct udp_remote_ctx_t *)handle->data;
     --ctx->ref_count;
     if (ctx->ref_count <= 0) {
+        buffer_free(ctx->recv_buf);
         free(ctx);
     }
 }
 
 static void udp_remote_shutdown(struct udp_remote_ctx_t *ctx) {
-    if (ctx == NULL) {
+    if (ctx == NULL || ctx->closing) {
         return;
     }
+    ctx->closing = true;
+    udp_session_unlink(ctx);
     objects_container_remove(ctx->server_ctx->connections, ctx);
+    if (ctx->key.addr_header) {
+        const struct udp_session_key *key = &ctx->key;
+        obj_map_remove(ctx->server_ctx->session_map, &key);
+    }
 
     ctx->watcher.data = ctx;
     uv_timer_stop(&ctx->watcher);
@@ -614,6 +937,7 @@ static void query_resolve_cb(struct sockaddr *addr, void *data) {
                 remote_ctx->addr_header_len = query_ctx->addr_header_len;
                 memcpy(remote_ctx->addr_header, query_ctx->addr_header,
                        query_ctx->addr_header_len);
+                remote_ctx->policy = udp_session_policy_of(remote_ctx->addr_header, remote_ctx->addr_header_len);
             } else {
                 SS_ERROR("[udp] bind() error");
             }
@@ -643,10 +967,8 @@ static void query_resolve_cb(struct sockaddr *addr, void *data) {
                 }
             }
 #else
-            uv_udp_send_t *req = (uv_udp_send_t *)calloc(1, sizeof(uv_udp_send_t));
-            req->data = remote_ctx;
-            uv_buf_t tmp = uv_buf_init(query_ctx->buf->buffer, (unsigned int)query_ctx->buf->len);
-            uv_udp_send(req, &remote_ctx->io, &tmp, 1, (const struct sockaddr *)&remote_ctx->dst_addr, udp_remote_send_done_cb);
+            udp_send_payload(&remote_ctx->io, query_ctx->buf->buffer, query_ctx->buf->len,
+                (const struct sockaddr *)&remote_ctx->dst_addr, udp_remote_send_done_cb, remote_ctx);
 #endif
         }
     }
@@ -667,11 +989,18 @@ udp_remote_recv_cb(uv_udp_t* handle, ssize_t nread, const uv_buf_t* buf0, const
 {
     struct udp_remote_ctx_t *remote_ctx = CONTAINER_OF(handle, struct udp_remote_ctx_t, io);
     struct udp_listener_ctx_t *server_ctx = remote_ctx->server_ctx;
-    struct buffer_t *buf = NULL;
+    struct buffer_t *buf = remote_ctx->recv_buf;
+    bool forwarded = false;
     int err;
     int len;
     size_t remote_src_addr_len;
 
+    (void)buf0;
+    if (nread == 0 && addr == NULL) {
+        // Nothing more to read, the session lives on.
+        return;
+    }
+
     uv_timer_stop(&remote_ctx->watcher);
 
     // server has been closed
@@ -681,7 +1010,7 @@ udp_remote_recv_cb(uv_udp_t* handle, ssize_t nread, const uv_buf_t* buf0, const
         return;
     }
 
-    if (nread == -1) {
+    if (nread < 0) {
         // error on recv, simply drop that packet
         LOGE("[udp] remote_recv_recvfrom");
         goto CLEAN_UP;
@@ -690,14 +1019,11 @@ udp_remote_recv_cb(uv_udp_t* handle, ssize_t nread, const uv_buf_t* buf0, const
         goto CLEAN_UP;
     }
 
-    buf = buffer_alloc(max((size_t)buf_size, (size_t)nread));
-    memcpy(buf->buffer, buf0->base, (size_t)nread);
+    // The datagram is already in the session's buffer, |buf0| points at it.
     buf->len = (size_t)nread;
 
-    udp_uv_release_buffer((uv_buf_t *)buf0);
-
 #ifdef MODULE_LOCAL
-    err = ss_decrypt_all(server_ctx->cipher_env, buf, buf_size);
+    err = ss_decrypt_all(server_ctx->cipher_env, buf, buf->len);
     if (err) {
         // drop the packet silently
         goto CLEAN_UP;
@@ -714,7 +1040,7 @@ udp_remote_recv_cb(uv_udp_t* handle, ssize_t nread, const uv_buf_t* buf0, const
                 return;
             }
             if (buf->len == 0) {
-                return;
+                goto CLEAN_UP;
             }
         }
     }
@@ -763,7 +1089,7 @@ udp_remote_recv_cb(uv_udp_t* handle, ssize_t nread, const uv_buf_t* buf0, const
         buf->len -= len;
         memmove(buf->buffer, buf->buffer + len, buf->len);
     } else {
-        buffer_realloc(buf, max(buf->len + 3, buf_size));
+        buffer_realloc(buf, buf->len + 3);
         memmove(buf->buffer + 3, buf->buffer, buf->len);
         memset(buf->buffer, 0, 3);
         buf->len += 3;
@@ -848,20 +1174,18 @@ udp_remote_recv_cb(uv_udp_t* handle, ssize_t nread, const uv_buf_t* buf0, const
     close(src_fd);
 
 #else
-    {
-    uv_buf_t tmp;
-    uv_udp_send_t *req = (uv_udp_send_t *)calloc(1, sizeof(uv_udp_send_t));
-    req->data = server_ctx;
-    tmp = uv_buf_init((char *)buf->buffer, (unsigned int) buf->len);
-    uv_udp_send(req, &server_ctx->io, &tmp, 1, (const struct sockaddr *)&remote_ctx->src_addr, udp_send_done_cb);
-    }
+    udp_send_payload(&server_ctx->io, buf->buffer, buf->len,
+        (const struct sockaddr *)&remote_ctx->src_addr, udp_send_done_cb, server_ctx);
 #endif
+    forwarded = true;
 
 CLEAN_UP:
-
-    udp_remote_shutdown(remote_ctx);
-
-    buffer_free(buf);
+    // Single-reply sessions end here, the others idle out or are evicted.
+    if (forwarded) {
+        udp_session_replied(remote_ctx);
+    } else {
+        udp_session_touch(remote_ctx);
+    }
 }
 
 static void 
@@ -869,7 +1193,8 @@ udp_listener_recv_cb(uv_udp_t* handle, ssize_t nread, const uv_buf_t* buf0, cons
 {
     struct udp_listener_ctx_t *server_ctx;
     struct sockaddr_storage src_addr;
-    struct buffer_t *buf;
+    struct buffer_t in_place = { 0 };
+    struct buffer_t *buf = NULL;
     socklen_t src_addr_len;
     unsigned int offset;
     char addr_header[512] = { 0 };
@@ -892,13 +1217,13 @@ udp_listener_recv_cb(uv_udp_t* handle, ssize_t nread, const uv_buf_t* buf0, cons
 
     src_addr = *(struct sockaddr_storage *)addr;
 
-    buf = buffer_alloc(max((size_t)buf_size, (size_t)nread));
-
     src_addr_len = sizeof(src_addr);
     offset    = 0;
     (void)src_addr_len;
 
 #ifdef MODULE_REDIR
+    buf = buffer_alloc(max((size_t)buf_size, (size_t)nread));
+
     char control_buffer[64] = { 0 };
     struct msghdr msg;
     memset(&msg, 0, sizeof(struct msghdr));
@@ -944,16 +1269,24 @@ udp_listener_recv_cb(uv_udp_t* handle, ssize_t nread, const uv_buf_t* buf0, cons
         goto CLEAN_UP;
     }
 
-    memcpy(buf->buffer, buf0->base, nread);
+    // |buf0| is the datagram's slot in the listener's receive buffer. The
+    // rest of the slot is free, so the datagram is worked on right there;
+    // only one too large to leave the headroom is copied out.
+    if (buf0->len - (size_t)nread >= UDP_INPLACE_HEADROOM) {
+        in_place.buffer = (uint8_t *)buf0->base;
+        in_place.capacity = buf0->len - 1;
+        buf = &in_place;
+    } else {
+        buf = buffer_alloc((size_t)nread + UDP_INPLACE_HEADROOM);
+        memcpy(buf->buffer, buf0->base, (size_t)nread);
+    }
     buf->len = (size_t) nread;
-
-    udp_uv_release_buffer((uv_buf_t *)buf0);
 #endif
 
 #ifdef MODULE_REMOTE
     tx += buf->len;
 
-    int err = ss_decrypt_all(server_ctx->cipher_env, buf, buf_size);
+    int err = ss_decrypt_all(server_ctx->cipher_env, buf, buf->len);
     if (err) {
         // drop the packet silently
         goto CLEAN_UP;
@@ -1066,8 +1399,8 @@ udp_listener_recv_cb(uv_udp_t* handle, ssize_t nread, const uv_buf_t* buf0, cons
         memcpy(addr_header + addr_header_len, &port_net_num, 2);
         addr_header_len += 2;
 
-        // reconstruct the buffer
-        buffer_realloc(buf, max(buf->len + addr_header_len, buf_size));
+        // reconstruct the buffer, within the headroom
+        buffer_realloc(buf, buf->len + addr_header_len);
         memmove(buf->buffer + addr_header_len, buf->buffer, buf->len);
         memcpy(buf->buffer, addr_header, addr_header_len);
         buf->len += addr_header_len;
@@ -1115,7 +1448,8 @@ udp_listener_recv_cb(uv_udp_t* handle, ssize_t nread, const uv_buf_t* buf0, cons
 
     remote_addr = &server_ctx->remote_addr.addr;
 
-    {
+    remote_ctx = udp_session_find(server_ctx, &src_addr, addr_header, addr_header_len);
+    if (remote_ctx == NULL) {
         bool ipv6;
         int remotefd;
         remote_ctx = (struct udp_remote_ctx_t *) calloc(1, sizeof(struct udp_remote_ctx_t));
@@ -1133,14 +1467,16 @@ udp_listener_recv_cb(uv_udp_t* handle, ssize_t nread, const uv_buf_t* buf0, cons
         remote_ctx->src_addr        = src_addr;
         remote_ctx->addr_header_len = addr_header_len;
         memcpy(remote_ctx->addr_header, addr_header, (size_t) addr_header_len);
+        remote_ctx->policy = udp_session_policy_of(addr_header, addr_header_len);
 
         uv_timer_init(server_ctx->io.loop, &remote_ctx->watcher);
 
-        objects_container_add(server_ctx->connections, (void *)remote_ctx);
+        udp_session_add(remote_ctx);
 
-        uv_udp_recv_start(&remote_ctx->io, udp_uv_alloc_buffer, udp_remote_recv_cb);
-        uv_timer_start(&remote_ctx->watcher, udp_remote_timeout_cb, (uint64_t)server_ctx->timeout, 0);
+        uv_udp_recv_start(&remote_ctx->io, udp_remote_alloc_buffer, udp_remote_recv_cb);
     }
+    ++remote_ctx->pending;
+    udp_session_touch(remote_ctx);
 
     if (offset > 0) {
         buf->len -= offset;
@@ -1167,13 +1503,7 @@ udp_listener_recv_cb(uv_udp_t* handle, ssize_t nread, const uv_buf_t* buf0, cons
         LOGE("[udp] server_recv_sendto fragmentation");
         goto CLEAN_UP;
     }
-    {
-    uv_buf_t tmp;
-    uv_udp_send_t *req = (uv_udp_send_t *)calloc(1, sizeof(uv_udp_send_t));
-    req->data = server_ctx;
-    tmp = uv_buf_init((char *)buf->buffer, (unsigned int) buf->len);
-    uv_udp_send(req, &remote_ctx->io, &tmp, 1, remote_addr, udp_send_done_cb);
-    }
+    udp_send_payload(&remote_ctx->io, buf->buffer, buf->len, remote_addr, udp_send_done_cb, server_ctx);
 #if !defined(MODULE_TUNNEL) && !defined(MODULE_REDIR)
 #ifdef ANDROID
     if (log_tx_rx)
@@ -1231,6 +1561,7 @@ udp_listener_recv_cb(uv_udp_t* handle, ssize_t nread, const uv_buf_t* buf0, cons
                 remote_ctx->server_ctx      = server_ctx;
                 remote_ctx->addr_header_len = addr_header_len;
                 memcpy(remote_ctx->addr_header, addr_header, addr_header_len);
+                remote_ctx->policy = udp_session_policy_of(addr_header, addr_header_len);
                 memcpy(&remote_ctx->dst_addr, &dst_addr, sizeof(struct sockaddr_storage));
             } else {
                 SS_ERROR("[udp] bind() error");
@@ -1264,10 +1595,8 @@ udp_listener_recv_cb(uv_udp_t* handle, ssize_t nread, const uv_buf_t* buf0, cons
         }
         */
         remote_ctx->dst_addr;
-        uv_udp_send_t *req = (uv_udp_send_t *)calloc(1, sizeof(uv_udp_send_t));
-        req->data = remote_ctx;
-        uv_buf_t tmp = uv_buf_init(buf->buffer + addr_header_len, (unsigned int)buf->len - addr_header_len);
-        uv_udp_send(req, &remote_ctx->io, &tmp, 1, (const struct sockaddr *)&remote_ctx->dst_addr, udp_remote_send_done_cb);
+        udp_send_payload(&remote_ctx->io, buf->buffer + addr_header_len, buf->len - addr_header_len,
+            (const struct sockaddr *)&remote_ctx->dst_addr, udp_remote_send_done_cb, remote_ctx);
     } else {
         struct addrinfo hints;
         memset(&hints, 0, sizeof(struct addrinfo));
@@ -1298,7 +1627,9 @@ udp_listener_recv_cb(uv_udp_t* handle, ssize_t nread, const uv_buf_t* buf0, cons
 #endif
 
 CLEAN_UP:
-    buffer_free(buf);
+    if (buf != &in_place) {
+        buffer_free(buf);
+    }
 }
 
 struct udp_listener_ctx_t *
@@ -1324,6 +1655,12 @@ udprelay_begin(uv_loop_t *loop, const char *server_host, uint16_t server_port,
     // Setup server context
 
     server_ctx = (struct udp_listener_ctx_t *)calloc(1, sizeof(struct udp_listener_ctx_t));
+#if UV_VERSION_HEX >= 0x012500
+    server_ctx->recv_buf_size = UDP_RECVMMSG_BATCH * UDP_DGRAM_MAX_SIZE;
+#else
+    server_ctx->recv_buf_size = UDP_DGRAM_MAX_SIZE;
+#endif
+    server_ctx->recv_buf = (char *)calloc(server_ctx->recv_buf_size, sizeof(char));
 
     // Bind to port
     serverfd = udp_create_local_listener(server_host, server_port, loop, &server_ctx->io);
@@ -1337,6 +1674,7 @@ udprelay_begin(uv_loop_t *loop, const char *server_host, uint16_t server_port,
 #endif
     server_ctx->timeout    = max(timeout, MIN_UDP_TIMEOUT);
     server_ctx->connections = objects_container_create();
+    server_ctx->session_map = obj_map_create(udp_session_key_compare, NULL, NULL);
 #ifdef MODULE_LOCAL
     server_ctx->remote_addr     = *remote_addr;
     //SSR beg
@@ -1361,7 +1699,7 @@ udprelay_begin(uv_loop_t *loop, const char *server_host, uint16_t server_port,
     }
 #endif
 
-    uv_udp_recv_start(&server_ctx->io, udp_uv_alloc_buffer, udp_listener_recv_cb);
+    uv_udp_recv_start(&server_ctx->io, udp_listener_alloc_buffer, udp_listener_recv_cb);
     
     return server_ctx;
 }
@@ -1369,6 +1707,8 @@ udprelay_begin(uv_loop_t *loop, const char *server_host, uint16_t server_port,
 static void udp_local_listener_close_done_cb(uv_handle_t* handle) {
     struct udp_listener_ctx_t *server_ctx = CONTAINER_OF(handle, struct udp_listener_ctx_t, io);
     objects_container_destroy(server_ctx->connections);
+    obj_map_destroy(server_ctx->session_map);
+    free(server_ctx->recv_buf);
 
 #ifdef MODULE_LOCAL
     // SSR beg
@@ -40,4 +40,11 @@ struct udp_listener_ctx_t * udprelay_begin(uv_loop_t *loop, const char *server_h
 
 void udprelay_shutdown(struct udp_listener_ctx_t *server_ctx);
 
+/*
+ * Destination ports whose sessions close once every request got its reply,
+ * comma separated, and how long (ms) a request waits for it. NULL keeps
+ * DNS and NTP, a zero timeout the built-in one.
+ */
+void udprelay_set_single_reply_ports(const char *ports, unsigned int timeout);
+
 #endif // _UDPRELAY_H
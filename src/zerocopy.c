@@ -0,0 +1,307 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#if defined(__linux__)
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+#endif
+
+#include "zerocopy.h"
+
+#if defined(__linux__) && defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY) && defined(SO_EE_ORIGIN_ZEROCOPY)
+#define ZEROCOPY_SUPPORTED 1
+#endif
+
+#if (ZEROCOPY_MAX_PENDING & (ZEROCOPY_MAX_PENDING - 1)) != 0
+#error "ZEROCOPY_MAX_PENDING must be a power of two, send ids wrap at 2^32."
+#endif
+
+/* Threshold ceiling, larger than any tunnel write, so the socket always copies. */
+#define ZEROCOPY_MAX_SIZE (1024 * 1024)
+
+/* A closed socket's error queue is polled this often (ms), and waited for this long. */
+#define ZEROCOPY_LINGER_POLL 500
+#define ZEROCOPY_LINGER_MAX (120 * 1000)
+
+struct zerocopy_sender {
+    uv_os_sock_t fd;
+    void (*release)(void *token);
+    size_t threshold;
+    uint32_t head_id;  /* Oldest send the kernel may still hold. */
+    uint32_t next_id;  /* The kernel numbers successful zero-copy sends per socket. */
+    void *tokens[ZEROCOPY_MAX_PENDING];
+    size_t lens[ZEROCOPY_MAX_PENDING];
+    bool done[ZEROCOPY_MAX_PENDING];
+    uv_timer_t *linger;  /* Set once the socket is closed. */
+    unsigned int linger_ticks;
+    bool aborted;  /* Reset after ZEROCOPY_LINGER_MAX, the buffers go back on the next tick. */
+    bool listed;  /* On |pending_senders|, open with sends the kernel still holds. */
+    struct zerocopy_sender *pending_prev;
+    struct zerocopy_sender *pending_next;
+};
+
+static uint64_t zerocopy_sent_bytes = 0;
+static uint64_t zerocopy_copied_bytes = 0;
+static struct zerocopy_sender *pending_senders = NULL;
+
+static void zerocopy_pending_link(struct zerocopy_sender *zs) {
+    if (zs->listed) {
+        return;
+    }
+    zs->listed = true;
+    zs->pending_prev = NULL;
+    zs->pending_next = pending_senders;
+    if (pending_senders) {
+        pending_senders->pending_prev = zs;
+    }
+    pending_senders = zs;
+}
+
+static void zerocopy_pending_unlink(struct zerocopy_sender *zs) {
+    if (zs->listed == false) {
+        return;
+    }
+    if (zs->pending_prev) {
+        zs->pending_prev->pending_next = zs->pending_next;
+    } else {
+        pending_senders = zs->pending_next;
+    }
+    if (zs->pending_next) {
+        zs->pending_next->pending_prev = zs->pending_prev;
+    }
+    zs->pending_prev = zs->pending_next = NULL;
+    zs->listed = false;
+}
+
+void zerocopy_stats(uint64_t *sent, uint64_t *copied) {
+    if (sent) {
+        *sent = zerocopy_sent_bytes;
+    }
+    if (copied) {
+        *copied = zerocopy_copied_bytes;
+    }
+}
+
+struct zerocopy_sender * zerocopy_sender_create(uv_os_sock_t fd, void (*release)(void *token)) {
+#if defined(ZEROCOPY_SUPPORTED)
+    struct zerocopy_sender *zs;
+    int one = 1;
+
+    if (setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) != 0) {
+        return NULL;
+    }
+    zs = (struct zerocopy_sender *)calloc(1, sizeof(*zs));
+    zs->fd = fd;
+    zs->release = release;
+    zs->threshold = ZEROCOPY_MIN_SIZE;
+    return zs;
+#else
+    (void)fd;
+    (void)release;
+    return NULL;
+#endif
+}
+
+bool zerocopy_wanted(const struct zerocopy_sender *zs, size_t len) {
+    if (zs == NULL || zs->linger != NULL) {
+        return false;
+    }
+    return (len >= zs->threshold && (uint32_t)(zs->next_id - zs->head_id) < ZEROCOPY_MAX_PENDING);
+}
+
+size_t zerocopy_send(struct zerocopy_sender *zs, const void *data, size_t len, void *token) {
+#if defined(ZEROCOPY_SUPPORTED)
+    ssize_t n;
+    size_t slot;
+
+    if (zerocopy_wanted(zs, len) == false) {
+        return 0;
+    }
+    do {
+        n = send(zs->fd, data, len, MSG_ZEROCOPY | MSG_DONTWAIT | MSG_NOSIGNAL);
+    } while (n < 0 && errno == EINTR);
+    if (n <= 0) {
+        // EAGAIN, ENOBUFS over the pinned memory limit, or an error the regular write reports.
+        return 0;
+    }
+
+    slot = zs->next_id % ZEROCOPY_MAX_PENDING;
+    zs->tokens[slot] = token;
+    zs->lens[slot] = (size_t)n;
+    zs->done[slot] = false;
+    zs->next_id++;
+    zerocopy_pending_link(zs);
+    zerocopy_sent_bytes += (uint64_t)n;
+    return (size_t)n;
+#else
+    (void)zs;
+    (void)data;
+    (void)len;
+    (void)token;
+    return 0;
+#endif
+}
+
+static void zerocopy_release_head(struct zerocopy_sender *zs) {
+    while (zs->head_id != zs->next_id) {
+        size_t slot = zs->head_id % ZEROCOPY_MAX_PENDING;
+        if (zs->done[slot] == false && zs->aborted == false) {
+            break;
+        }
+        zs->release(zs->tokens[slot]);
+        zs->tokens[slot] = NULL;
+        zs->head_id++;
+    }
+    if (zs->head_id == zs->next_id) {
+        zerocopy_pending_unlink(zs);
+    }
+}
+
+#if defined(ZEROCOPY_SUPPORTED)
+/* The kernel let go of sends |lo| to |hi|, ids may wrap. */
+static void zerocopy_complete(struct zerocopy_sender *zs, uint32_t lo, uint32_t hi, bool copied) {
+    uint32_t id;
+    for (id = zs->head_id; id != zs->next_id; ++id) {
+        size_t slot = id % ZEROCOPY_MAX_PENDING;
+        if ((uint32_t)(id - lo) > (uint32_t)(hi - lo) || zs->done[slot]) {
+            continue;
+        }
+        zs->done[slot] = true;
+        if (copied) {
+            zerocopy_copied_bytes += zs->lens[slot];
+        }
+    }
+
+    if (copied) {
+        zs->threshold = (zs->threshold < ZEROCOPY_MAX_SIZE / 2) ? zs->threshold * 2 : ZEROCOPY_MAX_SIZE;
+    } else if (zs->threshold > ZEROCOPY_MIN_SIZE) {
+        zs->threshold = (zs->threshold / 2 > ZEROCOPY_MIN_SIZE) ? zs->threshold / 2 : ZEROCOPY_MIN_SIZE;
+    }
+    zerocopy_release_head(zs);
+}
+#endif
+
+void zerocopy_reap(struct zerocopy_sender *zs) {
+#if defined(ZEROCOPY_SUPPORTED)
+    char control[128];
+    struct msghdr msg;
+    struct cmsghdr *cm;
+
+    if (zs == NULL) {
+        return;
+    }
+    while (zs->head_id != zs->next_id) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(zs->fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+            break;
+        }
+        for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            const struct sock_extended_err *serr;
+            if (!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+                  (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))) {
+                continue;
+            }
+            serr = (const struct sock_extended_err *)CMSG_DATA(cm);
+            if (serr->ee_errno != 0 || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+                continue;
+            }
+            zerocopy_complete(zs, serr->ee_info, serr->ee_data, (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) != 0);
+        }
+    }
+#else
+    (void)zs;
+#endif
+}
+
+bool zerocopy_outstanding(void) {
+    return (pending_senders != NULL);
+}
+
+void zerocopy_reap_outstanding(void) {
+    struct zerocopy_sender *zs = pending_senders;
+    while (zs) {
+        // Reaping may take |zs| off the list, never another sender.
+        struct zerocopy_sender *next = zs->pending_next;
+        zerocopy_reap(zs);
+        zs = next;
+    }
+}
+
+#if defined(ZEROCOPY_SUPPORTED)
+static void zerocopy_linger_close_cb(uv_handle_t *handle) {
+    struct zerocopy_sender *zs = (struct zerocopy_sender *)handle->data;
+    free(handle);
+    free(zs);
+}
+
+static void zerocopy_linger_cb(uv_timer_t *handle) {
+    struct zerocopy_sender *zs = (struct zerocopy_sender *)handle->data;
+
+    if (zs->aborted) {
+        // The reset purged the socket's queues, the kernel no longer reads the buffers.
+        zerocopy_release_head(zs);
+    } else {
+        zerocopy_reap(zs);
+        if (zs->head_id != zs->next_id) {
+            if (++zs->linger_ticks < ZEROCOPY_LINGER_MAX / ZEROCOPY_LINGER_POLL) {
+                return;
+            }
+            {
+                struct linger lg = { 1, 0 };
+                setsockopt(zs->fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+            }
+            close(zs->fd);
+            zs->aborted = true;
+            return;
+        }
+        close(zs->fd);
+    }
+    uv_timer_stop(handle);
+    uv_close((uv_handle_t *)handle, zerocopy_linger_close_cb);
+}
+#endif
+
+void zerocopy_sender_close(struct zerocopy_sender *zs, uv_loop_t *loop) {
+#if defined(ZEROCOPY_SUPPORTED)
+    int fd;
+
+    if (zs == NULL) {
+        return;
+    }
+    zerocopy_reap(zs);
+    // From here on the linger timer reaps it, or nothing is left to reap.
+    zerocopy_pending_unlink(zs);
+    if (zs->head_id == zs->next_id) {
+        free(zs);
+        return;
+    }
+
+    // Our descriptor is about to go, a duplicate keeps the error queue readable.
+    fd = dup(zs->fd);
+    if (fd < 0) {
+        // Never told when the kernel is done. Reset instead, the close that
+        // follows purges the queues, and the buffers go back right away.
+        struct linger lg = { 1, 0 };
+        setsockopt(zs->fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+        zs->aborted = true;
+        zerocopy_release_head(zs);
+        free(zs);
+        return;
+    }
+    shutdown(fd, SHUT_RDWR);
+    zs->fd = fd;
+    zs->linger = (uv_timer_t *)calloc(1, sizeof(uv_timer_t));
+    uv_timer_init(loop, zs->linger);
+    zs->linger->data = zs;
+    uv_timer_start(zs->linger, zerocopy_linger_cb, ZEROCOPY_LINGER_POLL, ZEROCOPY_LINGER_POLL);
+    uv_unref((uv_handle_t *)zs->linger);
+#else
+    (void)loop;
+    free(zs);
+#endif
+}
@@ -0,0 +1,55 @@
+#if !defined(__zerocopy_h__)
+#define __zerocopy_h__ 1
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <uv.h>
+
+struct zerocopy_sender;
+
+/*
+ * Linux MSG_ZEROCOPY for large stream writes. The kernel sends straight
+ * from our buffer instead of copying it into the socket, and tells us on
+ * the socket's error queue when it no longer needs the pages. Until then
+ * the buffer stays with the kernel, |release| hands it back.
+ *
+ * Small writes cost more to pin and notify than to copy, so each socket
+ * only takes this path from a size threshold on. The threshold grows when
+ * the kernel reports it had to copy anyway, loopback or a NIC without
+ * scatter-gather, and shrinks back while zero-copy works.
+ */
+
+/* Writes below this are always copied. */
+#ifndef ZEROCOPY_MIN_SIZE
+#define ZEROCOPY_MIN_SIZE (16 * 1024)
+#endif
+
+/* Sends the kernel may hold at once on one socket, further writes are copied. */
+#ifndef ZEROCOPY_MAX_PENDING
+#define ZEROCOPY_MAX_PENDING 64
+#endif
+
+/* Turns SO_ZEROCOPY on for |fd|, NULL where the kernel or the platform can't. */
+struct zerocopy_sender * zerocopy_sender_create(uv_os_sock_t fd, void (*release)(void *token));
+/*
+ * The socket is about to be closed. Buffers the kernel still holds are
+ * waited for on a duplicate of the descriptor, then released. Without a
+ * duplicate the connection is reset on close and they are released at once.
+ */
+void zerocopy_sender_close(struct zerocopy_sender *zs, uv_loop_t *loop);
+
+bool zerocopy_wanted(const struct zerocopy_sender *zs, size_t len);
+/* Non-blocking send lending |data| to the kernel, returns the bytes sent, 0 if none. */
+size_t zerocopy_send(struct zerocopy_sender *zs, const void *data, size_t len, void *token);
+/* Reads completions off the error queue and releases what the kernel is done with. */
+void zerocopy_reap(struct zerocopy_sender *zs);
+
+/* Whether any open socket has sends the kernel still holds, and zerocopy_reap() on each. */
+bool zerocopy_outstanding(void);
+void zerocopy_reap_outstanding(void);
+
+/* Process-wide bytes sent zero-copy, and how many of them the kernel copied after all. */
+void zerocopy_stats(uint64_t *sent, uint64_t *copied);
+
+#endif // !defined(__zerocopy_h__)